@@ -0,0 +1,88 @@
+#include "chunkmap.h"
+#include "util.h"
+#include "world.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * inserts a cube of chunks into a chunk map, then looks random ones up
+ * from 1 to MAX_THREADS threads at once.
+ *
+ *   bench_chunkmap [side] [lookups per thread]
+ */
+#define MAX_THREADS 8
+
+static void  *lookup_worker(void *arg);
+static double now();
+
+static Chunk *chunks;
+static size_t chunk_total;
+static long lookups;
+static ChunkMap map;
+
+int
+main(int argc, char *argv[])
+{
+	int side = argc > 1 ? atoi(argv[1]) : 48;
+	double t;
+
+	lookups = argc > 2 ? atol(argv[2]) : 2000000;
+	chunk_total = (size_t)side * side * side;
+	chunks = emalloc(sizeof(Chunk) * chunk_total);
+	memset(chunks, 0, sizeof(Chunk) * chunk_total);
+	for(size_t i = 0; i < chunk_total; i++) {
+		chunks[i].x = ((int)(i % side) - side / 2) * CHUNK_SIZE;
+		chunks[i].y = ((int)(i / side % side) - side / 2) * CHUNK_SIZE;
+		chunks[i].z = ((int)(i / side / side) - side / 2) * CHUNK_SIZE;
+	}
+
+	/* from the smallest table, so the inserts go through every resize */
+	chunkmap_init(&map, 0);
+	t = now();
+	for(size_t i = 0; i < chunk_total; i++)
+		chunkmap_insert(&map, &chunks[i]);
+	t = now() - t;
+	printf("insert   %zu chunks: %.2f M/s, capacity %zu\n",
+			chunk_total, chunk_total / t / 1e6, chunkmap_capacity(&map));
+
+	for(long threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		pthread_t workers[MAX_THREADS];
+
+		t = now();
+		for(long i = 0; i < threads; i++)
+			pthread_create(&workers[i], NULL, lookup_worker, (void *)i);
+		for(long i = 0; i < threads; i++)
+			pthread_join(workers[i], NULL);
+		t = now() - t;
+		printf("lookup   %ld threads: %.2f M/s\n", threads, threads * lookups / t / 1e6);
+	}
+
+	chunkmap_terminate(&map);
+	efree(chunks);
+	return 0;
+}
+
+void *
+lookup_worker(void *arg)
+{
+	PCG32State rng = (uintptr_t)arg * 7919 + 1;
+
+	for(long i = 0; i < lookups; i++) {
+		Chunk *c = &chunks[rand_pcg32(&rng) % chunk_total];
+		if(chunkmap_find(&map, c->x, c->y, c->z) != c)
+			die("chunk %d %d %d lost\n", c->x, c->y, c->z);
+	}
+	return NULL;
+}
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
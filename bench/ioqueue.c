@@ -0,0 +1,137 @@
+#include "ioqueue.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * many small random reads of one file, one blocking pread() at a time
+ * against batches through the I/O queue on both of its backends, then the
+ * same with adjacent reads, which the queue coalesces.
+ *
+ *   bench_ioqueue [reads] [file]
+ */
+#define FILE_BYTES (64u << 20)
+#define READ_SIZE  4096
+#define BATCH      256
+
+static void   run_blocking(int fd, const off_t *offsets, int count, unsigned char *buffer);
+static void   run_batched(int fd, const off_t *offsets, int count, unsigned char *buffers, bool uring, bool adjacent);
+static void   print_histogram(const char *name, const size_t *histogram);
+static double now();
+
+int
+main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	const char *path = argc > 2 ? argv[2] : "bench_ioqueue.dat";
+	unsigned char *chunk = emalloc(1 << 20);
+	PCG32State rng = 1;
+	int fd;
+
+	/* written once, the reads come from the page cache after that */
+	if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		die("can't create %s\n", path);
+	for(int i = 0; i < 1 << 20; i++)
+		chunk[i] = rand_pcg32(&rng);
+	for(size_t offset = 0; offset < FILE_BYTES; offset += 1 << 20)
+		if(pwrite(fd, chunk, 1 << 20, offset) != 1 << 20)
+			die("can't write %s\n", path);
+	efree(chunk);
+
+	off_t *offsets = emalloc(sizeof(off_t) * count);
+	unsigned char *buffers = emalloc((size_t)BATCH * READ_SIZE);
+	for(int i = 0; i < count; i++)
+		offsets[i] = (off_t)(rand_pcg32(&rng) % (FILE_BYTES / READ_SIZE)) * READ_SIZE;
+
+	run_blocking(fd, offsets, count, buffers);
+	run_batched(fd, offsets, count, buffers, true, false);
+	run_batched(fd, offsets, count, buffers, false, false);
+	run_batched(fd, offsets, count, buffers, true, true);
+	run_batched(fd, offsets, count, buffers, false, true);
+
+	efree(offsets);
+	efree(buffers);
+	close(fd);
+	unlink(path);
+	return 0;
+}
+
+void
+run_blocking(int fd, const off_t *offsets, int count, unsigned char *buffer)
+{
+	double t = now();
+
+	for(int i = 0; i < count; i++)
+		if(pread(fd, buffer, READ_SIZE, offsets[i]) != READ_SIZE)
+			die("short read\n");
+	t = now() - t;
+	printf("%-9s random:   %.3f s, %.2f us/read\n", "blocking", t, t * 1e6 / count);
+}
+
+void
+run_batched(int fd, const off_t *offsets, int count, unsigned char *buffers, bool uring, bool adjacent)
+{
+	IoRequest *reqs = emalloc(sizeof(IoRequest) * BATCH);
+	IoRequest *batch[BATCH];
+	IoStats stats;
+	double t;
+
+	ioq_init(uring);
+	t = now();
+	for(int base = 0; base < count; base += BATCH) {
+		int n = count - base < BATCH ? count - base : BATCH;
+
+		/* every other one overtakes the rest */
+		for(int i = 0; i < n; i++) {
+			off_t offset = adjacent ? (off_t)(base + i) * READ_SIZE % FILE_BYTES : offsets[base + i];
+
+			memset(&reqs[i], 0, sizeof(reqs[i]));
+			reqs[i].fd = fd;
+			reqs[i].op = IOQ_READ;
+			reqs[i].buffer = buffers + (size_t)i * READ_SIZE;
+			reqs[i].size = READ_SIZE;
+			reqs[i].offset = offset;
+			reqs[i].priority = i & 1 ? IOQ_HIGH : IOQ_LOW;
+			batch[i] = &reqs[i];
+		}
+		ioq_submit_batch(batch, n);
+		for(int i = 0; i < n; i++) {
+			ioq_wait(batch[i]);
+			if(batch[i]->result != READ_SIZE)
+				die("short read\n");
+		}
+	}
+	t = now() - t;
+
+	ioq_get_stats(&stats);
+	printf("%-9s %s %.3f s, %.2f us/read, %zu batches, %zu coalesced\n",
+			stats.backend, adjacent ? "adjacent:" : "random:  ", t, t * 1e6 / count,
+			stats.batches, stats.coalesced);
+	print_histogram("queue depth", stats.depth);
+	print_histogram("latency us", stats.latency);
+	ioq_terminate();
+	efree(reqs);
+}
+
+void
+print_histogram(const char *name, const size_t *histogram)
+{
+	printf("  %-12s", name);
+	for(int i = 0; i < IOQ_HISTOGRAM; i++)
+		if(histogram[i])
+			printf(" <=%d: %zu", 1 << i, histogram[i]);
+	printf("\n");
+}
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
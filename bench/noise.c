@@ -0,0 +1,114 @@
+#include "noise.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * evaluates the same random points with every batch kernel the CPU has,
+ * checking each against noise_2d() and noise_3d() bit for bit over every
+ * batch length up to 40 and a few longer ones, then times whole batches.
+ *
+ *   bench_noise [points] [repeats]
+ */
+static bool   check(const Noise *n, const float *x, const float *y, const float *z,
+                    const float *ref_2d, const float *ref_3d, float *out, size_t count);
+static double now();
+
+int
+main(int argc, char *argv[])
+{
+	size_t count = argc > 1 ? (size_t)atol(argv[1]) : 4096;
+	int repeats = argc > 2 ? atoi(argv[2]) : 200;
+	float *x, *y, *z, *ref_2d, *ref_3d, *out;
+	PCG32State state = 1;
+	bool all_exact = true;
+	Noise n;
+
+	if(count == 0 || repeats <= 0) {
+		fprintf(stderr, "usage: %s [points] [repeats]\n", argv[0]);
+		return 1;
+	}
+
+	x = emalloc(sizeof(float) * count);
+	y = emalloc(sizeof(float) * count);
+	z = emalloc(sizeof(float) * count);
+	ref_2d = emalloc(sizeof(float) * count);
+	ref_3d = emalloc(sizeof(float) * count);
+	out = emalloc(sizeof(float) * count);
+
+	/* about the coordinates the world generator asks for */
+	init_pcg32(&state);
+	for(size_t i = 0; i < count; i++) {
+		x[i] = (rand_pcg32(&state) / 4294967296.0f - 0.5f) * 2000;
+		y[i] = (rand_pcg32(&state) / 4294967296.0f - 0.5f) * 600;
+		z[i] = (rand_pcg32(&state) / 4294967296.0f - 0.5f) * 2000;
+	}
+
+	noise_seed(&n, 1234);
+	for(size_t i = 0; i < count; i++) {
+		ref_2d[i] = noise_2d(&n, x[i], z[i]);
+		ref_3d[i] = noise_3d(&n, x[i], y[i], z[i]);
+	}
+
+	for(NoiseIsa isa = NOISE_SCALAR; isa <= NOISE_AVX512; isa++) {
+		double best_2d = 1e9, best_3d = 1e9, t;
+		bool exact;
+
+		if(noise_set_isa(isa) != isa) {
+			printf("%-8s unsupported\n", noise_isa_name(isa));
+			continue;
+		}
+		exact = check(&n, x, y, z, ref_2d, ref_3d, out, count);
+		all_exact = all_exact && exact;
+
+		for(int i = 0; i < repeats; i++) {
+			t = now();
+			noise_2d_batch(&n, x, z, out, count);
+			t = now() - t;
+			best_2d = t < best_2d ? t : best_2d;
+
+			t = now();
+			noise_3d_batch(&n, x, y, z, out, count);
+			t = now() - t;
+			best_3d = t < best_3d ? t : best_3d;
+		}
+		printf("%-8s 2d %7.1f M/s  3d %7.1f M/s  %s\n", noise_isa_name(isa),
+				count / best_2d / 1e6, count / best_3d / 1e6,
+				exact ? "bit exact" : "MISMATCH");
+	}
+
+	efree(x);
+	efree(y);
+	efree(z);
+	efree(ref_2d);
+	efree(ref_3d);
+	efree(out);
+	return all_exact ? 0 : 1;
+}
+
+bool
+check(const Noise *n, const float *x, const float *y, const float *z,
+      const float *ref_2d, const float *ref_3d, float *out, size_t count)
+{
+	/* every length up to 40 goes through each kernel's tail handling */
+	for(size_t len = 1; len <= count; len = len < 40 ? len + 1 : len * 2) {
+		noise_2d_batch(n, x, z, out, len);
+		if(memcmp(out, ref_2d, sizeof(float) * len))
+			return false;
+		noise_3d_batch(n, x, y, z, out, len);
+		if(memcmp(out, ref_3d, sizeof(float) * len))
+			return false;
+	}
+	return true;
+}
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
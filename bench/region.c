@@ -0,0 +1,120 @@
+#include "region.h"
+#include "util.h"
+#include "world.h"
+#include "worldgen.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * generates the chunks around the origin with region saves on, saves them
+ * by closing the world, then opens it again and loads the same chunks from
+ * the region files. the radius is rounded to whole chunks.
+ *
+ *   bench_region [radius in blocks]
+ */
+#define SEED "bench"
+#define HEIGHT 128
+
+static uint64_t load_all(int radius, double *seconds);
+static void     remove_saves(const char *dir);
+static double   now();
+
+int
+main(int argc, char *argv[])
+{
+	int radius = ((argc > 1 ? atoi(argv[1]) : 96) + CHUNK_SIZE - 1) & CHUNK_MASK;
+	char dir[] = "/tmp/bench_region.XXXXXX";
+	double generate, load;
+	uint64_t generated, loaded;
+	WorldStats stats;
+	RegionStats saved;
+	/* the ones waited for, the ones only shaped on the way don't count */
+	int side = radius * 2 / CHUNK_SIZE + 2;
+	int chunks = side * side * (HEIGHT / CHUNK_SIZE + 2);
+
+	if(!mkdtemp(dir))
+		die("can't create a save directory\n");
+	wgen_set_seed(SEED);
+
+	world_init();
+	world_set_save_directory(dir, SAVE_REGIONS);
+	world_set_load_border(0, HEIGHT / 2, 0, radius * 4);
+	generated = load_all(radius, &generate);
+	world_terminate();
+	region_get_stats(&saved);
+
+	world_init();
+	world_set_save_directory(dir, SAVE_REGIONS);
+	world_set_load_border(0, HEIGHT / 2, 0, radius * 4);
+	loaded = load_all(radius, &load);
+	world_get_stats(&stats);
+	world_terminate();
+
+	if(loaded != generated)
+		die("loaded chunks differ from the generated ones\n");
+	printf("generate %d chunks: %.3f s, %.1f us/chunk\n", chunks, generate, generate * 1e6 / chunks);
+	printf("load     %d chunks: %.3f s, %.1f us/chunk, %.1fx faster, %zu from the region files\n",
+			chunks, load, load * 1e6 / chunks, generate / load, stats.chunks_loaded);
+	printf("saved    %zu chunks: %zu bytes, %.1f bytes/chunk\n",
+			saved.stores, saved.bytes_written, (double)saved.bytes_written / (saved.stores ? saved.stores : 1));
+
+	remove_saves(dir);
+	return 0;
+}
+
+uint64_t
+load_all(int radius, double *seconds)
+{
+	/* FNV-1a over every block, so both runs are known to load the same world */
+	uint64_t hash = UINT64_C(1469598103934665603);
+	double t = now();
+
+	/* with a ring of chunks around, whose structures reach into the ones
+	 * hashed. the ring goes from here to the save with them too */
+	for(int z = -radius - CHUNK_SIZE; z < radius + CHUNK_SIZE; z += CHUNK_SIZE)
+	for(int y = -CHUNK_SIZE; y < HEIGHT + CHUNK_SIZE; y += CHUNK_SIZE)
+	for(int x = -radius - CHUNK_SIZE; x < radius + CHUNK_SIZE; x += CHUNK_SIZE)
+		world_wait_chunk(x, y, z, CSTATE_DECORATED);
+	*seconds = now() - t;
+
+	for(int z = -radius; z < radius; z++)
+	for(int y = 0; y < HEIGHT; y++)
+	for(int x = -radius; x < radius; x++)
+		hash = (hash ^ (unsigned char)world_get_block(x, y, z)) * UINT64_C(1099511628211);
+	return hash;
+}
+
+void
+remove_saves(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	ArrayBuffer path;
+
+	if(!d)
+		return;
+	arrbuf_init(&path);
+	while((e = readdir(d))) {
+		if(e->d_name[0] == '.')
+			continue;
+		arrbuf_clear(&path);
+		arrbuf_printf(&path, "%s/%s", dir, e->d_name);
+		unlink(path.data);
+	}
+	closedir(d);
+	arrbuf_free(&path);
+	rmdir(dir);
+}
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,82 @@
+#include "world.h"
+#include "worldgen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * generates a box of chunks around the origin with no save directory, then
+ * prints how many chunks each generator stage went through a second of
+ * worker CPU time, and the whole run's chunks a second of wall time. the ring
+ * around the box is waited for too, so the box is all decorated.
+ *
+ *   bench_stages [radius in blocks] [lattice]
+ */
+#define SEED "Gente que passa o dia inteiro no twitter e em chan não deveria nem ter direito a voto."
+#define BOTTOM (-CHUNK_SIZE)
+#define TOP    (128 + CHUNK_SIZE)
+
+static void   print_stage(const char *name, size_t count, double time);
+static double now();
+
+int
+main(int argc, char *argv[])
+{
+	int radius = argc > 1 ? atoi(argv[1]) : 48;
+	int lattice = argc > 2 ? atoi(argv[2]) : 0;
+	WorldStats stats;
+	double t;
+
+	if(radius <= 0) {
+		fprintf(stderr, "usage: %s [radius in blocks] [lattice]\n", argv[0]);
+		return 1;
+	}
+	radius = (radius + CHUNK_SIZE - 1) & CHUNK_MASK;
+
+	if(lattice > 0)
+		wgen_set_lattice(lattice, lattice);
+	wgen_set_seed(SEED);
+	world_init();
+	world_set_load_border(0, 64, 0, 2 * radius + 4 * CHUNK_SIZE);
+
+	t = now();
+	for(int z = -radius - CHUNK_SIZE; z <= radius; z += CHUNK_SIZE)
+	for(int y = BOTTOM; y < TOP; y += CHUNK_SIZE)
+	for(int x = -radius - CHUNK_SIZE; x <= radius; x += CHUNK_SIZE)
+		world_enqueue_load(x, y, z);
+	for(int z = -radius - CHUNK_SIZE; z <= radius; z += CHUNK_SIZE)
+	for(int y = BOTTOM; y < TOP; y += CHUNK_SIZE)
+	for(int x = -radius - CHUNK_SIZE; x <= radius; x += CHUNK_SIZE)
+		world_wait_chunk(x, y, z, CSTATE_DECORATED);
+	t = now() - t;
+
+	world_get_stats(&stats);
+	print_stage("shape", stats.shape_count, stats.shape_time);
+	print_stage("surface", stats.surface_count, stats.surface_time);
+	print_stage("decorate", stats.decorate_count, stats.decorate_time);
+	printf("total    %6d chunks %9.3f s wall     %9.0f chunks/s\n",
+			stats.chunk_count, t, stats.chunk_count / t);
+	world_terminate();
+	return 0;
+}
+
+void
+print_stage(const char *name, size_t count, double time)
+{
+	if(!count) {
+		printf("%-8s      0 chunks\n", name);
+		return;
+	}
+	printf("%-8s %6zu chunks %9.1f us/chunk %9.0f chunks/s\n",
+			name, count, time * 1e6 / count, count / time);
+}
+
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,239 @@
+#include "blockstore.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+static BlockStorage *storage_alloc(int bits);
+static int           bits_for(int palette_len);
+static int           palette_index(const BlockStorage *s, Block block);
+static void          write_index(BlockStorage *s, int index, unsigned value);
+static void          init_uniforms();
+
+static atomic_size_t allocated_bytes;
+
+static pthread_once_t uniforms_once = PTHREAD_ONCE_INIT;
+static BlockStorage  *uniforms[256];
+
+BlockStorage *
+bstore_new(Block fill)
+{
+	return bstore_uniform(fill);
+}
+
+BlockStorage *
+bstore_uniform(Block fill)
+{
+	pthread_once(&uniforms_once, init_uniforms);
+	return uniforms[(unsigned char)fill];
+}
+
+BlockStorage *
+bstore_encode(const signed char blocks[BSTORE_VOLUME])
+{
+	int remap[256];
+	int palette_len = 0;
+	unsigned char palette[256];
+
+	memset(remap, -1, sizeof(remap));
+	for(int i = 0; i < BSTORE_VOLUME; i++) {
+		unsigned char b = blocks[i];
+		if(remap[b] < 0) {
+			remap[b] = palette_len;
+			palette[palette_len++] = b;
+		}
+	}
+
+	if(palette_len == 1)
+		return bstore_uniform(palette[0]);
+
+	BlockStorage *s = storage_alloc(bits_for(palette_len));
+	if(s->bits == BSTORE_DIRECT_BITS) {
+		for(int i = 0; i < 256; i++)
+			remap[i] = i;
+	} else {
+		memcpy(s->palette, palette, palette_len);
+		s->palette_len = palette_len;
+	}
+
+	const int per_word = 64 / s->bits;
+	for(int w = 0; w < BSTORE_VOLUME / per_word; w++) {
+		uint64_t word = 0;
+		const signed char *b = blocks + w * per_word;
+		for(int i = 0; i < per_word; i++)
+			word |= (uint64_t)remap[(unsigned char)b[i]] << (i * s->bits);
+		s->data[w] = word;
+	}
+
+	return s;
+}
+
+BlockStorage *
+bstore_compact(const BlockStorage *s)
+{
+	signed char blocks[BSTORE_VOLUME];
+
+	bstore_decode(s, blocks);
+	return bstore_encode(blocks);
+}
+
+void
+bstore_free(BlockStorage *s)
+{
+	if(bstore_is_uniform(s) || s->mapped)
+		return;
+	bstore_free_retired(s);
+	atomic_fetch_sub(&allocated_bytes, bstore_size(s));
+	free(s);
+}
+
+void
+bstore_free_retired(BlockStorage *s)
+{
+	if(bstore_is_uniform(s))
+		return;
+
+	BlockStorage *r = s->retired;
+	while(r) {
+		BlockStorage *next = r->retired;
+		atomic_fetch_sub(&allocated_bytes, bstore_size(r));
+		free(r);
+		r = next;
+	}
+	s->retired = NULL;
+}
+
+BlockStorage *
+bstore_set(BlockStorage *s, int index, Block block)
+{
+	int idx = palette_index(s, block);
+
+	/* shared, nothing to write when it already is that block */
+	if(bstore_is_uniform(s) && idx == 0)
+		return s;
+
+	if(idx < 0 && s->palette_len < (1 << s->bits)) {
+		s->palette[s->palette_len] = block;
+		/* readers only reach the new entry through the index written below */
+		atomic_thread_fence(memory_order_release);
+		idx = s->palette_len++;
+	}
+
+	if(idx < 0) {
+		signed char blocks[BSTORE_VOLUME];
+		BlockStorage *grown;
+
+		bstore_decode(s, blocks);
+		blocks[index] = block;
+		grown = bstore_encode(blocks);
+		/* uniforms and mapped ones are never freed, readers can keep
+		 * using them */
+		if(!bstore_is_uniform(s) && !s->mapped)
+			grown->retired = s;
+		return grown;
+	}
+
+	write_index(s, index, idx);
+	return s;
+}
+
+void
+bstore_decode(const BlockStorage *s, signed char out[BSTORE_VOLUME])
+{
+	const int bits = s->bits;
+
+	if(bstore_is_uniform(s)) {
+		memset(out, s->palette[0], BSTORE_VOLUME);
+		return;
+	}
+
+	const int per_word = 64 / bits;
+	const uint64_t mask = (UINT64_C(1) << bits) - 1;
+
+	if(bits == BSTORE_DIRECT_BITS) {
+		for(int w = 0; w < BSTORE_VOLUME / per_word; w++)
+			for(int i = 0; i < per_word; i++)
+				*out++ = (s->data[w] >> (i * bits)) & mask;
+		return;
+	}
+
+	for(int w = 0; w < BSTORE_VOLUME / per_word; w++) {
+		uint64_t word = s->data[w];
+		for(int i = 0; i < per_word; i++, word >>= bits)
+			*out++ = s->palette[word & mask];
+	}
+}
+
+size_t
+bstore_size(const BlockStorage *s)
+{
+	return sizeof(*s) + BSTORE_VOLUME / 64 * s->bits * sizeof(s->data[0]);
+}
+
+size_t
+bstore_allocated_bytes()
+{
+	return atomic_load(&allocated_bytes);
+}
+
+BlockStorage *
+storage_alloc(int bits)
+{
+	size_t size = sizeof(BlockStorage) + BSTORE_VOLUME / 64 * bits * sizeof(uint64_t);
+	BlockStorage *s = emalloc(size);
+
+	memset(s, 0, size);
+	s->bits = bits;
+	atomic_fetch_add(&allocated_bytes, size);
+	return s;
+}
+
+void
+init_uniforms()
+{
+	/* one data word so bstore_get() reads index 0 without special casing */
+	for(int i = 0; i < 256; i++) {
+		BlockStorage *s = emalloc(sizeof(BlockStorage) + sizeof(uint64_t));
+
+		memset(s, 0, sizeof(BlockStorage) + sizeof(uint64_t));
+		s->bits = 0;
+		s->palette[0] = i;
+		s->palette_len = 1;
+		uniforms[i] = s;
+	}
+}
+
+int
+bits_for(int palette_len)
+{
+	if(palette_len <= 2)
+		return 1;
+	if(palette_len <= 4)
+		return 2;
+	if(palette_len <= BSTORE_MAX_PALETTE)
+		return 4;
+	return BSTORE_DIRECT_BITS;
+}
+
+int
+palette_index(const BlockStorage *s, Block block)
+{
+	if(s->bits == BSTORE_DIRECT_BITS)
+		return block;
+
+	for(int i = 0; i < s->palette_len; i++)
+		if(s->palette[i] == block)
+			return i;
+	return -1;
+}
+
+void
+write_index(BlockStorage *s, int index, unsigned value)
+{
+	unsigned bit = (unsigned)index * s->bits;
+	uint64_t mask = ((UINT64_C(1) << s->bits) - 1) << (bit & 63);
+	uint64_t *w = &s->data[bit >> 6];
+
+	*w = (*w & ~mask) | ((uint64_t)value << (bit & 63));
+}
@@ -0,0 +1,73 @@
+#ifndef BLOCKSTORE_H
+#define BLOCKSTORE_H
+
+#include "world.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BSTORE_VOLUME      (CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE)
+#define BSTORE_MAX_PALETTE 16
+#define BSTORE_DIRECT_BITS 8
+
+#define BSTORE_INDEX(X, Y, Z) \
+	(((Z) << (BLOCK_BITS * 2)) | ((Y) << BLOCK_BITS) | (X))
+
+/*
+ * palette compressed chunk blocks.
+ *
+ * every voxel stores a 1, 2 or 4 bit index into the palette, once a chunk
+ * holds more than BSTORE_MAX_PALETTE distinct blocks it switches to 8 bits
+ * per voxel holding the block itself. the layout is z, y, x like the old
+ * blocks[z][y][x] array, indices never straddle a word.
+ *
+ * chunks of a single block share one immutable 0 bit storage per block,
+ * bstore_set() hands back a private copy on the first write that changes it.
+ * storages may also be images in a mapped file, bstore_size() bytes long.
+ */
+struct BlockStorage {
+	unsigned char bits;
+	unsigned char palette_len;
+	/* lives in a mapped chunk store, see mapstore.h, and is never freed */
+	bool mapped;
+	unsigned char palette[BSTORE_MAX_PALETTE];
+	/* older versions of this storage that other threads may still read */
+	BlockStorage *retired;
+	uint64_t data[];
+};
+
+BlockStorage *bstore_new(Block fill);
+BlockStorage *bstore_uniform(Block fill);
+BlockStorage *bstore_encode(const signed char blocks[BSTORE_VOLUME]);
+BlockStorage *bstore_compact(const BlockStorage *s);
+void          bstore_free(BlockStorage *s);
+void          bstore_free_retired(BlockStorage *s);
+
+/*
+ * may grow the storage, in which case the new one is returned with the old
+ * one chained in ->retired, the caller is the one publishing it
+ */
+BlockStorage *bstore_set(BlockStorage *s, int index, Block block);
+void          bstore_decode(const BlockStorage *s, signed char out[BSTORE_VOLUME]);
+
+size_t bstore_size(const BlockStorage *s);
+size_t bstore_allocated_bytes();
+
+static inline bool
+bstore_is_uniform(const BlockStorage *s)
+{
+	return s->bits == 0;
+}
+
+static inline Block
+bstore_get(const BlockStorage *s, int index)
+{
+	unsigned bit = (unsigned)index * s->bits;
+	unsigned idx = (s->data[bit >> 6] >> (bit & 63)) & ((1u << s->bits) - 1);
+
+	if(s->bits == BSTORE_DIRECT_BITS)
+		return idx;
+	return s->palette[idx];
+}
+
+#endif
@@ -20,8 +20,20 @@ typedef struct {
 	vec2 texcoord;
 } Vertex;
 
+#define GCHUNK_SIZE_W 32
+#define GCHUNK_SIZE_D 32
+#define GCHUNK_SIZE_H 32
+
+/* a graphics chunk and the 1 block halo its faces look at */
+#define REGION_W (GCHUNK_SIZE_W + 2)
+#define REGION_H (GCHUNK_SIZE_H + 2)
+#define REGION_D (GCHUNK_SIZE_D + 2)
+
 typedef struct {
 	ArrayBuffer solid_buffer, water_buffer, grass_buffer;
+	signed char region[REGION_D][REGION_H][REGION_W];
+	/* the block that made the last build_chunk() fail */
+	int missing_x, missing_y, missing_z;
 } ChunkBuilder;
 
 typedef struct GraphicsChunk GraphicsChunk;
@@ -57,10 +69,6 @@ typedef struct {
 #define MAX_CHUNKS 16384
 #define MAX_WORK 16384
 
-#define GCHUNK_SIZE_W 32
-#define GCHUNK_SIZE_D 32
-#define GCHUNK_SIZE_H 32
-
 #define GBLOCK_MASK_X (GCHUNK_SIZE_W - 1)
 #define GBLOCK_MASK_Y (GCHUNK_SIZE_H - 1)
 #define GBLOCK_MASK_Z (GCHUNK_SIZE_D - 1)
@@ -81,6 +89,7 @@ typedef struct {
 static void chunk_builder_init(ChunkBuilder *builder);
 static void chunk_builder_terminate(ChunkBuilder *builder);
 static bool build_chunk(ChunkBuilder *builder, GraphicsChunk *chunk);
+static bool chunk_is_empty(GraphicsChunk *chunk);
 static void update_chunk(ChunkBuilder *builder, int cx, int cy, int cz);
 
 static GraphicsChunk *find_or_allocate_chunk(int x, int y, int z);
@@ -153,6 +162,7 @@ static pthread_mutex_t chunk_mutex;
 static int chunk_x, chunk_y, chunk_z;
 static int render_distance;
 static size_t update_chunk_count;
+static atomic_size_t uniform_skip_count;
 static ChunkBuilder main_builder;
 
 void
@@ -564,6 +574,12 @@ chunk_render_update_count()
 	return update_chunk_count;
 }
 
+size_t
+chunk_render_uniform_skip_count()
+{
+	return atomic_load(&uniform_skip_count);
+}
+
 void
 faces_worker_func(WorkGroup *wg)
 {
@@ -576,7 +592,14 @@ faces_worker_func(WorkGroup *wg)
 		if(!w.chunk)
 			continue;
 		chunk = w.chunk;
-		while(world_can_load(chunk->x, chunk->y, chunk->z) && !build_chunk(&builder, chunk));
+		while(world_can_load(chunk->x, chunk->y, chunk->z) && !build_chunk(&builder, chunk)) {
+			/* sleeps until the generator is done with it */
+			if(!world_wait_chunk(builder.missing_x, builder.missing_y, builder.missing_z, CSTATE_DECORATED)) {
+				/* the neighbour is past the load border, retry when sent again */
+				chunk->dirty = true;
+				break;
+			}
+		}
 	}
 	chunk_builder_terminate(&builder);
 }
@@ -693,6 +716,23 @@ chunk_render_request_update_block(int x, int y, int z)
 		update_chunk(&main_builder, chunk_x, chunk_y, chunk_z + GCHUNK_SIZE_D);
 }
 
+void
+chunk_render_request_update_chunk(int x, int y, int z)
+{
+	/* the meshes over the chunk and its faces are remade when next drawn,
+	 * one in the middle of meshing keeps what it copied */
+	pthread_mutex_lock(&chunk_mutex);
+	for(int gz = (z - 1) & GCHUNK_MASK_Z; gz <= ((z + CHUNK_SIZE) & GCHUNK_MASK_Z); gz += GCHUNK_SIZE_D)
+	for(int gy = (y - 1) & GCHUNK_MASK_Y; gy <= ((y + CHUNK_SIZE) & GCHUNK_MASK_Y); gy += GCHUNK_SIZE_H)
+	for(int gx = (x - 1) & GCHUNK_MASK_X; gx <= ((x + CHUNK_SIZE) & GCHUNK_MASK_X); gx += GCHUNK_SIZE_W) {
+		for(GraphicsChunk *c = chunkmap[chunk_coord_hash(gx, gy, gz)]; c; c = c->next) {
+			if(c->x == gx && c->y == gy && c->z == gz && !c->free && c->state == GSTATE_DONE)
+				c->dirty = true;
+		}
+	}
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
 void
 manhattan_load(int x, int y, int z, int r)
 {
@@ -738,8 +778,29 @@ bool
 build_chunk(ChunkBuilder *builder, GraphicsChunk *chunk)
 {
 	Block face_blocks[6];
+	int missing[3];
+
+	if(chunk_is_empty(chunk)) {
+		/* nothing is drawn with no vertices, the buffer can stay as is */
+		chunk->vert_count = 0;
+		chunk->water_vert_count = 0;
+		chunk->grass_vert_count = 0;
+		chunk->state = GSTATE_DONE;
+		atomic_fetch_add(&uniform_skip_count, 1);
+		return true;
+	}
+
+	/* the region is indexed one block off, 0 is the halo */
+	#define REGION_AT(X, Y, Z) builder->region[(Z) + 1][(Y) + 1][(X) + 1]
+
+	if(world_copy_region(chunk->x - 1, chunk->y - 1, chunk->z - 1,
+				REGION_W, REGION_H, REGION_D, &builder->region[0][0][0], missing, 1)) {
+		builder->missing_x = missing[0];
+		builder->missing_y = missing[1];
+		builder->missing_z = missing[2];
+		return false;
+	}
 
-	#define LOAD_BLOCK(BLOCK, X, Y, Z) if((BLOCK = world_get_block(X, Y, Z)) == BLOCK_UNLOADED) return false;
 	arrbuf_clear(&builder->solid_buffer);
 	arrbuf_clear(&builder->water_buffer);
 	arrbuf_clear(&builder->grass_buffer);
@@ -750,21 +811,19 @@ build_chunk(ChunkBuilder *builder, GraphicsChunk *chunk)
 				Block block;
 				int x, y, z;
 
-				x = chunk->xx + chunk->x;
-				y = chunk->yy + chunk->y;
-				z = chunk->zz + chunk->z;
+				x = chunk->xx;
+				y = chunk->yy;
+				z = chunk->zz;
 
-				LOAD_BLOCK(block, x, y, z);
-				LOAD_BLOCK(face_blocks[TOP], x, y + 1, z);
-				LOAD_BLOCK(face_blocks[BOTTOM], x, y - 1, z);
-				LOAD_BLOCK(face_blocks[LEFT], x - 1, y, z);
-				LOAD_BLOCK(face_blocks[RIGHT], x + 1, y, z);
-				LOAD_BLOCK(face_blocks[FRONT], x, y, z + 1);
-				LOAD_BLOCK(face_blocks[BACK], x, y, z - 1);
+				block = REGION_AT(x, y, z);
+				face_blocks[TOP]    = REGION_AT(x, y + 1, z);
+				face_blocks[BOTTOM] = REGION_AT(x, y - 1, z);
+				face_blocks[LEFT]   = REGION_AT(x - 1, y, z);
+				face_blocks[RIGHT]  = REGION_AT(x + 1, y, z);
+				face_blocks[FRONT]  = REGION_AT(x, y, z + 1);
+				face_blocks[BACK]   = REGION_AT(x, y, z - 1);
 
 				switch(block) {
-					case BLOCK_UNLOADED:
-						return false;
 					case 0:
 						continue;
 					case BLOCK_WATER:
@@ -778,7 +837,8 @@ build_chunk(ChunkBuilder *builder, GraphicsChunk *chunk)
 						chunk_generate_face(chunk->xx, chunk->yy, chunk->zz, block, face_blocks, &builder->solid_buffer);
 				}
 			}
-	
+	#undef REGION_AT
+
 	chunk->vert_count = arrbuf_length(&builder->solid_buffer, sizeof(Vertex));
 	chunk->water_vert_count = arrbuf_length(&builder->water_buffer, sizeof(Vertex));
 	chunk->grass_vert_count = arrbuf_length(&builder->grass_buffer, sizeof(Vertex));
@@ -797,6 +857,20 @@ build_chunk(ChunkBuilder *builder, GraphicsChunk *chunk)
 	return true;
 }
 
+bool
+chunk_is_empty(GraphicsChunk *chunk)
+{
+	/* air makes no faces whatever its neighbours are */
+	for(int z = 0; z < GCHUNK_SIZE_D; z += CHUNK_SIZE)
+	for(int y = 0; y < GCHUNK_SIZE_H; y += CHUNK_SIZE)
+	for(int x = 0; x < GCHUNK_SIZE_W; x += CHUNK_SIZE) {
+		Block b;
+		if(!world_chunk_uniform(chunk->x + x, chunk->y + y, chunk->z + z, &b) || b != BLOCK_NULL)
+			return false;
+	}
+	return true;
+}
+
 void
 update_chunk(ChunkBuilder *builder, int cx, int cy, int cz)
 {
@@ -804,7 +878,12 @@ update_chunk(ChunkBuilder *builder, int cx, int cy, int cz)
 		return;
 
 	GraphicsChunk *c = find_or_allocate_chunk(cx, cy, cz);
-	if(c->state == GSTATE_DONE)
-		while(!build_chunk(builder, c));
+	if(c->state == GSTATE_DONE && !build_chunk(builder, c)) {
+		/* some neighbour got unloaded, let the meshers wait for it */
+		wg_send(facesg, &(ChunkFaceWork) {
+			.chunk = c,
+			.mode = FORCED
+		});
+	}
 }
 
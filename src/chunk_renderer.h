@@ -10,9 +10,12 @@ void chunk_render_terminate();
 void chunk_render_set_camera(vec3 position, vec3 look_at, float aspect, float distance);
 void chunk_render_update();
 void chunk_render_request_update_block(int x, int y, int z);
+/* from any thread, with the origin of a world chunk whose blocks changed */
+void chunk_render_request_update_chunk(int x, int y, int z);
 
 void chunk_render();
 
 size_t chunk_render_update_count();
+size_t chunk_render_uniform_skip_count();
 
 #endif
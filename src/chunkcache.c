@@ -0,0 +1,287 @@
+#include "chunkcache.h"
+#include "chunkmap.h"
+#include "region.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define INITIAL_SLOTS 1024
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+	uint64_t key;
+	int x, y, z;
+	/* the save directory doesn't have these blocks */
+	bool dirty;
+	/* out of the LRU and the budget, in the table until it is spilled */
+	bool spilling;
+	uint32_t size;
+	CacheEntry *lru_prev, *lru_next;
+	unsigned char data[];
+};
+
+static CacheEntry **find_slot(uint64_t key);
+static CacheEntry **wait_slot(uint64_t key);
+static void         insert_entry(CacheEntry *e);
+static void         remove_slot(CacheEntry *e);
+static void         unlink_entry(CacheEntry *e);
+static void         evict_entry(CacheEntry *e, CacheEntry **spills);
+static void         spill_entries(CacheEntry *spills);
+static BlockStorage *decode_entry(const CacheEntry *e);
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast when a spilled entry leaves the table */
+static pthread_cond_t  spill_cond = PTHREAD_COND_INITIALIZER;
+static CacheEntry **table;
+static size_t table_mask, table_used;
+/* most recently stored at the head */
+static CacheEntry *lru_head, *lru_tail;
+static void (*spill_callback)(int x, int y, int z, BlockStorage *blocks);
+static ChunkCacheStats stats;
+
+void
+ccache_init(size_t budget, void (*spill)(int x, int y, int z, BlockStorage *blocks))
+{
+	pthread_mutex_lock(&cache_mutex);
+	table_mask = INITIAL_SLOTS - 1;
+	table_used = 0;
+	table = emalloc(sizeof(CacheEntry *) * INITIAL_SLOTS);
+	memset(table, 0, sizeof(CacheEntry *) * INITIAL_SLOTS);
+	lru_head = lru_tail = NULL;
+	spill_callback = spill;
+	memset(&stats, 0, sizeof(stats));
+	stats.budget = budget;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void
+ccache_terminate()
+{
+	CacheEntry *spills = NULL;
+
+	pthread_mutex_lock(&cache_mutex);
+	/* oldest first, like they would have gone anyway */
+	while(lru_tail)
+		evict_entry(lru_tail, &spills);
+	pthread_mutex_unlock(&cache_mutex);
+	spill_entries(spills);
+
+	pthread_mutex_lock(&cache_mutex);
+	efree(table);
+	table = NULL;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void
+ccache_set_budget(size_t budget)
+{
+	CacheEntry *spills = NULL;
+
+	pthread_mutex_lock(&cache_mutex);
+	stats.budget = budget;
+	while(lru_tail && stats.bytes > stats.budget)
+		evict_entry(lru_tail, &spills);
+	pthread_mutex_unlock(&cache_mutex);
+	spill_entries(spills);
+}
+
+void
+ccache_put(int x, int y, int z, const BlockStorage *blocks, bool dirty)
+{
+	unsigned char data[REGION_MAX_RECORD];
+	size_t size = region_encode(blocks, data);
+	CacheEntry *e = emalloc(sizeof(*e) + size);
+	CacheEntry *spills = NULL;
+
+	e->key = chunk_coord_key(x, y, z);
+	e->x = x;
+	e->y = y;
+	e->z = z;
+	e->dirty = dirty;
+	e->spilling = false;
+	e->size = size;
+	memcpy(e->data, data, size);
+
+	pthread_mutex_lock(&cache_mutex);
+	CacheEntry **slot = wait_slot(e->key);
+	if(*slot) {
+		/* a newer version of the same blocks, still dirty if the old was */
+		CacheEntry *old = *slot;
+		e->dirty |= old->dirty;
+		remove_slot(old);
+		unlink_entry(old);
+		efree(old);
+	}
+	insert_entry(e);
+	while(lru_tail != e && stats.bytes > stats.budget)
+		evict_entry(lru_tail, &spills);
+	pthread_mutex_unlock(&cache_mutex);
+	spill_entries(spills);
+}
+
+BlockStorage *
+ccache_take(int x, int y, int z, bool *dirty)
+{
+	pthread_mutex_lock(&cache_mutex);
+	CacheEntry *e = table ? *wait_slot(chunk_coord_key(x, y, z)) : NULL;
+	if(e) {
+		remove_slot(e);
+		unlink_entry(e);
+		stats.hits++;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if(!e)
+		return NULL;
+
+	BlockStorage *s = decode_entry(e);
+	if(dirty)
+		*dirty = e->dirty;
+	efree(e);
+	return s;
+}
+
+void
+ccache_get_stats(ChunkCacheStats *out)
+{
+	pthread_mutex_lock(&cache_mutex);
+	*out = stats;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+CacheEntry **
+find_slot(uint64_t key)
+{
+	/* cache_mutex is held */
+	size_t i;
+
+	for(i = hash_int64(key) & table_mask; table[i]; i = (i + 1) & table_mask)
+		if(table[i]->key == key)
+			break;
+	return &table[i];
+}
+
+CacheEntry **
+wait_slot(uint64_t key)
+{
+	/* cache_mutex is held. a chunk being spilled is found wherever the
+	 * spill puts it once it is done */
+	CacheEntry **slot;
+
+	while(*(slot = find_slot(key)) && (*slot)->spilling)
+		pthread_cond_wait(&spill_cond, &cache_mutex);
+	return slot;
+}
+
+void
+insert_entry(CacheEntry *e)
+{
+	/* cache_mutex is held, e is not in the table */
+	if((table_used + 1) * 2 > table_mask + 1) {
+		CacheEntry **old = table;
+		size_t old_len = table_mask + 1;
+
+		table_mask = old_len * 2 - 1;
+		table = emalloc(sizeof(CacheEntry *) * (table_mask + 1));
+		memset(table, 0, sizeof(CacheEntry *) * (table_mask + 1));
+		for(size_t i = 0; i < old_len; i++)
+			if(old[i])
+				*find_slot(old[i]->key) = old[i];
+		efree(old);
+	}
+	*find_slot(e->key) = e;
+	table_used++;
+
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+
+	stats.chunks++;
+	stats.bytes += sizeof(*e) + e->size;
+}
+
+void
+remove_slot(CacheEntry *e)
+{
+	/* cache_mutex is held */
+	size_t i = find_slot(e->key) - table;
+
+	/* linear probing, shift back the entries that probed past the hole */
+	for(size_t j = (i + 1) & table_mask; table[j]; j = (j + 1) & table_mask) {
+		size_t home = hash_int64(table[j]->key) & table_mask;
+		bool between = i <= j ? i < home && home <= j : i < home || home <= j;
+		if(between)
+			continue;
+		table[i] = table[j];
+		i = j;
+	}
+	table[i] = NULL;
+	table_used--;
+}
+
+void
+unlink_entry(CacheEntry *e)
+{
+	/* cache_mutex is held, e is in the LRU */
+	if(e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		lru_head = e->lru_next;
+	if(e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		lru_tail = e->lru_prev;
+
+	stats.chunks--;
+	stats.bytes -= sizeof(*e) + e->size;
+}
+
+void
+evict_entry(CacheEntry *e, CacheEntry **spills)
+{
+	/* cache_mutex is held. a dirty entry goes on spills and stays in the
+	 * table for spill_entries(), a load of the chunk meanwhile waits */
+	unlink_entry(e);
+	if(e->dirty && spill_callback) {
+		e->spilling = true;
+		e->lru_next = *spills;
+		*spills = e;
+		stats.spills++;
+	} else {
+		remove_slot(e);
+		stats.drops++;
+		efree(e);
+	}
+}
+
+void
+spill_entries(CacheEntry *e)
+{
+	/* cache_mutex is not held, the entries are left alone by everyone
+	 * else while spilling */
+	while(e) {
+		CacheEntry *next = e->lru_next;
+
+		spill_callback(e->x, e->y, e->z, decode_entry(e));
+		pthread_mutex_lock(&cache_mutex);
+		remove_slot(e);
+		pthread_cond_broadcast(&spill_cond);
+		pthread_mutex_unlock(&cache_mutex);
+		efree(e);
+		e = next;
+	}
+}
+
+BlockStorage *
+decode_entry(const CacheEntry *e)
+{
+	signed char blocks[BSTORE_VOLUME];
+
+	if(!region_decode(e->data, e->size, blocks))
+		die("chunk cache record of %d %d %d is corrupt\n", e->x, e->y, e->z);
+	return bstore_encode(blocks);
+}
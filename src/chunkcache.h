@@ -0,0 +1,42 @@
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include "world.h"
+#include "blockstore.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * the warm tier between the chunks in memory and the save directory.
+ *
+ * decorated chunks leaving memory are kept here as region records, see
+ * region.h, a few hundred bytes each, and decoded again when loaded back.
+ * once the records take more than the budget the least recently stored
+ * ones go, the ones holding blocks the save directory doesn't have yet
+ * through the spill callback, the rest are dropped.
+ */
+typedef struct {
+	size_t chunks;
+	/* of the records and their entries */
+	size_t bytes;
+	size_t budget;
+	size_t hits;
+	size_t spills;
+	size_t drops;
+} ChunkCacheStats;
+
+/* spill takes ownership of the storage it is given, and is called without
+ * the cache's lock, by whoever put the chunk that pushed it out */
+void ccache_init(size_t budget, void (*spill)(int x, int y, int z, BlockStorage *blocks));
+/* spills every dirty chunk before returning */
+void ccache_terminate();
+void ccache_set_budget(size_t budget);
+
+void          ccache_put(int x, int y, int z, const BlockStorage *blocks, bool dirty);
+/* removes the chunk from the cache, NULL if it isn't there */
+BlockStorage *ccache_take(int x, int y, int z, bool *dirty);
+
+void ccache_get_stats(ChunkCacheStats *stats);
+
+#endif
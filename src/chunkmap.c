@@ -0,0 +1,243 @@
+#include "chunkmap.h"
+#include "util.h"
+#include "world.h"
+
+#include <sched.h>
+
+#define KEY_EMPTY     0
+#define KEY_TOMBSTONE 1
+#define KEY_BITS      21
+#define KEY_MASK      ((UINT64_C(1) << KEY_BITS) - 1)
+#define KEY_LIVE      (UINT64_C(1) << 63)
+
+/* resize once 3/4 of the slots were claimed (tombstones included) */
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
+#define MIN_CAPACITY 64
+
+typedef struct {
+	_Atomic uint64_t key;
+	_Atomic(Chunk *) chunk;
+} Slot;
+
+struct ChunkMapTable {
+	size_t mask;
+	atomic_size_t used;
+	Slot slots[];
+};
+
+static ChunkMapTable *table_new(size_t capacity);
+static void           table_resize(ChunkMap *map, ChunkMapTable *old);
+static atomic_long   *reader_enter(ChunkMap *map);
+static void           wait_readers(ChunkMap *map);
+
+/* the reader stripe of each thread, handed out round robin */
+static _Thread_local int reader_stripe = -1;
+static atomic_int next_stripe;
+
+void
+chunkmap_init(ChunkMap *map, size_t capacity)
+{
+	size_t c = MIN_CAPACITY;
+	while(c < capacity)
+		c *= 2;
+
+	atomic_init(&map->table, table_new(c));
+	atomic_init(&map->phase, 0);
+	for(int i = 0; i < 2; i++)
+	for(int j = 0; j < CHUNKMAP_READER_STRIPES; j++)
+		atomic_init(&map->readers[i][j].count, 0);
+	pthread_rwlock_init(&map->resize_lock, NULL);
+}
+
+void
+chunkmap_terminate(ChunkMap *map)
+{
+	free(atomic_load(&map->table));
+	pthread_rwlock_destroy(&map->resize_lock);
+}
+
+Chunk *
+chunkmap_find(ChunkMap *map, int x, int y, int z)
+{
+	uint64_t key = chunk_coord_key(x, y, z);
+	atomic_long *readers = reader_enter(map);
+	ChunkMapTable *t = atomic_load_explicit(&map->table, memory_order_acquire);
+	Chunk *c = NULL;
+
+	for(size_t i = hash_int64(key) & t->mask;; i = (i + 1) & t->mask) {
+		uint64_t k = atomic_load_explicit(&t->slots[i].key, memory_order_acquire);
+		if(k == KEY_EMPTY)
+			break;
+		if(k == key) {
+			c = atomic_load_explicit(&t->slots[i].chunk, memory_order_acquire);
+			break;
+		}
+	}
+	atomic_fetch_sub_explicit(readers, 1, memory_order_release);
+	return c;
+}
+
+Chunk *
+chunkmap_insert(ChunkMap *map, Chunk *c)
+{
+	ChunkMapTable *t;
+	uint64_t key = chunk_coord_key(c->x, c->y, c->z);
+
+	for(;;) {
+		pthread_rwlock_rdlock(&map->resize_lock);
+		t = atomic_load_explicit(&map->table, memory_order_acquire);
+		if((atomic_load(&t->used) + 1) * MAX_LOAD_DEN <= (t->mask + 1) * MAX_LOAD_NUM)
+			break;
+		pthread_rwlock_unlock(&map->resize_lock);
+		table_resize(map, t);
+	}
+
+	for(size_t i = hash_int64(key) & t->mask;; i = (i + 1) & t->mask) {
+		Slot *s = &t->slots[i];
+		uint64_t k = atomic_load_explicit(&s->key, memory_order_acquire);
+
+		/* slots only go EMPTY -> key -> TOMBSTONE, so two threads inserting
+		 * the same key race for the same empty slot and the loser sees the
+		 * winner's key right there */
+		if(k == KEY_EMPTY) {
+			if(atomic_compare_exchange_strong(&s->key, &k, key)) {
+				atomic_fetch_add(&t->used, 1);
+				atomic_store_explicit(&s->chunk, c, memory_order_release);
+				pthread_rwlock_unlock(&map->resize_lock);
+				return c;
+			}
+		}
+
+		if(k == key) {
+			Chunk *found;
+			/* the winner publishes the chunk right after claiming the key */
+			while(!(found = atomic_load_explicit(&s->chunk, memory_order_acquire)));
+			pthread_rwlock_unlock(&map->resize_lock);
+			return found;
+		}
+	}
+}
+
+bool
+chunkmap_remove(ChunkMap *map, Chunk *c)
+{
+	bool removed = false;
+	uint64_t key = chunk_coord_key(c->x, c->y, c->z);
+
+	pthread_rwlock_rdlock(&map->resize_lock);
+	ChunkMapTable *t = atomic_load_explicit(&map->table, memory_order_acquire);
+	for(size_t i = hash_int64(key) & t->mask;; i = (i + 1) & t->mask) {
+		Slot *s = &t->slots[i];
+		uint64_t k = atomic_load_explicit(&s->key, memory_order_acquire);
+		if(k == KEY_EMPTY)
+			break;
+		if(k == key && atomic_load_explicit(&s->chunk, memory_order_acquire) == c) {
+			removed = atomic_compare_exchange_strong(&s->key, &k, KEY_TOMBSTONE);
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&map->resize_lock);
+	return removed;
+}
+
+size_t
+chunkmap_capacity(ChunkMap *map)
+{
+	return atomic_load(&map->table)->mask + 1;
+}
+
+uint64_t
+chunk_coord_key(int x, int y, int z)
+{
+	uint64_t kx = (uint64_t)(x >> BLOCK_BITS) & KEY_MASK;
+	uint64_t ky = (uint64_t)(y >> BLOCK_BITS) & KEY_MASK;
+	uint64_t kz = (uint64_t)(z >> BLOCK_BITS) & KEY_MASK;
+	return KEY_LIVE | kx | ky << KEY_BITS | kz << (KEY_BITS * 2);
+}
+
+ChunkMapTable *
+table_new(size_t capacity)
+{
+	ChunkMapTable *t = emalloc(sizeof(*t) + capacity * sizeof(t->slots[0]));
+	t->mask = capacity - 1;
+	atomic_init(&t->used, 0);
+	for(size_t i = 0; i < capacity; i++) {
+		atomic_init(&t->slots[i].key, KEY_EMPTY);
+		atomic_init(&t->slots[i].chunk, NULL);
+	}
+	return t;
+}
+
+void
+table_resize(ChunkMap *map, ChunkMapTable *old)
+{
+	pthread_rwlock_wrlock(&map->resize_lock);
+	if(atomic_load(&map->table) != old) {
+		/* someone else got here first */
+		pthread_rwlock_unlock(&map->resize_lock);
+		return;
+	}
+
+	size_t live = 0;
+	for(size_t i = 0; i <= old->mask; i++)
+		if(atomic_load_explicit(&old->slots[i].key, memory_order_relaxed) > KEY_TOMBSTONE)
+			live++;
+
+	/* dropping the tombstones may be enough, otherwise keep it at most half full */
+	size_t capacity = old->mask + 1;
+	while(live * 2 > capacity)
+		capacity *= 2;
+
+	ChunkMapTable *t = table_new(capacity);
+	for(size_t i = 0; i <= old->mask; i++) {
+		uint64_t key = atomic_load_explicit(&old->slots[i].key, memory_order_relaxed);
+		if(key <= KEY_TOMBSTONE)
+			continue;
+
+		size_t j = hash_int64(key) & t->mask;
+		while(atomic_load_explicit(&t->slots[j].key, memory_order_relaxed) != KEY_EMPTY)
+			j = (j + 1) & t->mask;
+		atomic_store_explicit(&t->slots[j].key, key, memory_order_relaxed);
+		atomic_store_explicit(&t->slots[j].chunk, atomic_load(&old->slots[i].chunk), memory_order_relaxed);
+		atomic_fetch_add_explicit(&t->used, 1, memory_order_relaxed);
+	}
+	atomic_store_explicit(&map->table, t, memory_order_release);
+
+	wait_readers(map);
+	free(old);
+	pthread_rwlock_unlock(&map->resize_lock);
+}
+
+atomic_long *
+reader_enter(ChunkMap *map)
+{
+	if(reader_stripe < 0)
+		reader_stripe = atomic_fetch_add(&next_stripe, 1) % CHUNKMAP_READER_STRIPES;
+
+	/* counted under the phase it still is once counted, so a resize
+	 * flipping it after this either waits for us or published its table
+	 * before we load it */
+	for(;;) {
+		unsigned phase = atomic_load(&map->phase);
+		atomic_long *count = &map->readers[phase & 1][reader_stripe].count;
+
+		atomic_fetch_add(count, 1);
+		if(atomic_load(&map->phase) == phase)
+			return count;
+		atomic_fetch_sub(count, 1);
+	}
+}
+
+void
+wait_readers(ChunkMap *map)
+{
+	/* resize_lock is held for writing and the new table published, the
+	 * lookups started before can still be walking the old one. lookups
+	 * never wait on anything, so this is short */
+	unsigned phase = atomic_fetch_add(&map->phase, 1);
+
+	for(int i = 0; i < CHUNKMAP_READER_STRIPES; i++)
+		while(atomic_load_explicit(&map->readers[phase & 1][i].count, memory_order_acquire))
+			sched_yield();
+}
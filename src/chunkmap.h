@@ -0,0 +1,49 @@
+#ifndef CHUNKMAP_H
+#define CHUNKMAP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Chunk Chunk;
+typedef struct ChunkMap ChunkMap;
+typedef struct ChunkMapTable ChunkMapTable;
+
+#define CHUNKMAP_READER_STRIPES 16
+
+typedef struct {
+	atomic_long count;
+	/* a cache line each, lookups from different threads don't share one */
+	char pad[64 - sizeof(atomic_long)];
+} ChunkMapReaders;
+
+/*
+ * open addressing chunk index.
+ *
+ * lookups never lock, inserts and removals claim slots with CAS and
+ * may run concurrently with each other, only a resize stops the writers
+ * (readers keep walking the old table, which is left untouched while
+ * the new one is built, and only freed once they all left it).
+ */
+struct ChunkMap {
+	_Atomic(ChunkMapTable *) table;
+	/* lookups in flight, by the parity of the phase they started in */
+	atomic_uint phase;
+	ChunkMapReaders readers[2][CHUNKMAP_READER_STRIPES];
+	pthread_rwlock_t resize_lock;
+};
+
+void   chunkmap_init(ChunkMap *map, size_t capacity);
+void   chunkmap_terminate(ChunkMap *map);
+
+Chunk *chunkmap_find(ChunkMap *map, int x, int y, int z);
+/* returns the chunk already mapped at c's coordinates, or c if it was inserted */
+Chunk *chunkmap_insert(ChunkMap *map, Chunk *c);
+bool   chunkmap_remove(ChunkMap *map, Chunk *c);
+
+size_t chunkmap_capacity(ChunkMap *map);
+
+uint64_t chunk_coord_key(int x, int y, int z);
+
+#endif
@@ -0,0 +1,523 @@
+#include "ioqueue.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+	#define HAVE_URING
+	#include <linux/io_uring.h>
+	#include <sys/eventfd.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
+
+#define MAX_COALESCE 16
+#define THREAD_WORKERS 4
+/* user_data of the read that wakes the ring up for new requests */
+#define WAKE_TAG 1
+
+typedef struct Batch Batch;
+struct Batch {
+	int fd;
+	IoOp op;
+	off_t offset;
+	int count;
+	IoRequest *reqs[MAX_COALESCE];
+	struct iovec iov[MAX_COALESCE];
+	Batch *next_free;
+};
+
+static void   start(bool try_uring);
+static bool   take_batch(Batch *b);
+static void   complete(Batch *b, ssize_t result);
+static void   record(size_t *histogram, uint64_t value);
+static uint64_t now_ns();
+static void  *thread_worker(void *arg);
+
+#ifdef HAVE_URING
+static bool   uring_init();
+static void   uring_terminate();
+static void   uring_push(int op, int fd, const struct iovec *iov, int count, off_t offset, uint64_t tag);
+static void  *uring_worker(void *arg);
+#endif
+
+static bool initialized, use_uring;
+
+/* protects the queues, the batches and the stats */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  done_cond = PTHREAD_COND_INITIALIZER;
+static IoRequest *queue_head[IOQ_PRIORITIES], *queue_tail[IOQ_PRIORITIES];
+static size_t queued, in_flight;
+static bool closing;
+static Batch batches[IOQ_DEPTH];
+static Batch *free_batches;
+static IoStats stats;
+
+static pthread_t workers[THREAD_WORKERS];
+static int worker_count;
+
+#ifdef HAVE_URING
+static struct {
+	int fd;
+	int wake_fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	uint64_t wake_value;
+	struct iovec wake_iov;
+} ring;
+#endif
+
+void
+ioq_init(bool try_uring)
+{
+	pthread_mutex_lock(&queue_mutex);
+	if(!initialized)
+		start(try_uring);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void
+ioq_terminate()
+{
+	pthread_mutex_lock(&queue_mutex);
+	if(!initialized) {
+		pthread_mutex_unlock(&queue_mutex);
+		return;
+	}
+	closing = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+#ifdef HAVE_URING
+	if(use_uring)
+		(void)!write(ring.wake_fd, &(uint64_t){ 1 }, sizeof(uint64_t));
+#endif
+	for(int i = 0; i < worker_count; i++)
+		pthread_join(workers[i], NULL);
+#ifdef HAVE_URING
+	if(use_uring)
+		uring_terminate();
+#endif
+
+	/* the next submission starts it again */
+	pthread_mutex_lock(&queue_mutex);
+	initialized = false;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void
+ioq_submit(IoRequest *req)
+{
+	ioq_submit_batch(&req, 1);
+}
+
+void
+ioq_submit_batch(IoRequest **reqs, size_t count)
+{
+	uint64_t t = now_ns();
+
+	pthread_mutex_lock(&queue_mutex);
+	if(!initialized)
+		start(true);
+	for(size_t i = 0; i < count; i++) {
+		IoRequest *req = reqs[i];
+		IoPriority p = req->priority < IOQ_PRIORITIES ? req->priority : IOQ_LOW;
+
+		atomic_store_explicit(&req->done, false, memory_order_relaxed);
+		req->result = 0;
+		req->submit_ns = t;
+		req->next = NULL;
+		if(queue_tail[p])
+			queue_tail[p]->next = req;
+		else
+			queue_head[p] = req;
+		queue_tail[p] = req;
+	}
+	queued += count;
+	stats.submitted += count;
+	pthread_mutex_unlock(&queue_mutex);
+
+#ifdef HAVE_URING
+	if(use_uring) {
+		(void)!write(ring.wake_fd, &(uint64_t){ 1 }, sizeof(uint64_t));
+		return;
+	}
+#endif
+	pthread_cond_broadcast(&queue_cond);
+}
+
+void
+ioq_wait(IoRequest *req)
+{
+	ASSERT(!req->callback);
+	if(atomic_load_explicit(&req->done, memory_order_acquire))
+		return;
+
+	pthread_mutex_lock(&queue_mutex);
+	while(!atomic_load_explicit(&req->done, memory_order_acquire))
+		pthread_cond_wait(&done_cond, &queue_mutex);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+ssize_t
+ioq_pread(int fd, void *buffer, size_t size, off_t offset, IoPriority priority)
+{
+	IoRequest req = {
+		.fd = fd, .op = IOQ_READ,
+		.buffer = buffer, .size = size, .offset = offset,
+		.priority = priority
+	};
+
+	ioq_submit(&req);
+	ioq_wait(&req);
+	return req.result;
+}
+
+ssize_t
+ioq_pwrite(int fd, const void *buffer, size_t size, off_t offset, IoPriority priority)
+{
+	IoRequest req = {
+		.fd = fd, .op = IOQ_WRITE,
+		.buffer = (void *)buffer, .size = size, .offset = offset,
+		.priority = priority
+	};
+
+	ioq_submit(&req);
+	ioq_wait(&req);
+	return req.result;
+}
+
+void
+ioq_get_stats(IoStats *out)
+{
+	pthread_mutex_lock(&queue_mutex);
+	*out = stats;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void
+start(bool try_uring)
+{
+	/* queue_mutex is held */
+	memset(&stats, 0, sizeof(stats));
+	free_batches = NULL;
+	for(int i = 0; i < IOQ_DEPTH; i++) {
+		batches[i].next_free = free_batches;
+		free_batches = &batches[i];
+	}
+	for(int i = 0; i < IOQ_PRIORITIES; i++)
+		queue_head[i] = queue_tail[i] = NULL;
+	queued = in_flight = 0;
+	closing = false;
+	initialized = true;
+
+	use_uring = false;
+#ifdef HAVE_URING
+	/* seccomp or an old kernel say no, the threads do the same job */
+	use_uring = try_uring && uring_init();
+#else
+	(void)try_uring;
+#endif
+
+	if(use_uring) {
+#ifdef HAVE_URING
+		stats.backend = "io_uring";
+		worker_count = 1;
+		pthread_create(&workers[0], NULL, uring_worker, NULL);
+#endif
+	} else {
+		stats.backend = "threads";
+		worker_count = THREAD_WORKERS;
+		for(int i = 0; i < worker_count; i++)
+			pthread_create(&workers[i], NULL, thread_worker, NULL);
+	}
+}
+
+bool
+take_batch(Batch *b)
+{
+	/* queue_mutex is held */
+	IoRequest *req = NULL;
+	int p;
+
+	for(p = 0; p < IOQ_PRIORITIES && !req; p++)
+		req = queue_head[p];
+	if(!req)
+		return false;
+
+	p--;
+	queue_head[p] = req->next;
+	if(!queue_head[p])
+		queue_tail[p] = NULL;
+	queued--;
+
+	b->fd = req->fd;
+	b->op = req->op;
+	b->offset = req->offset;
+	b->count = 1;
+	b->reqs[0] = req;
+	b->iov[0] = (struct iovec){ .iov_base = req->buffer, .iov_len = req->size };
+
+	/* pull in whatever continues the batch, whatever its priority */
+	off_t end = req->offset + req->size;
+	for(bool grown = true; grown && b->count < MAX_COALESCE;) {
+		grown = false;
+		for(int q = 0; q < IOQ_PRIORITIES && !grown; q++) {
+			IoRequest *prev = NULL;
+			for(IoRequest *r = queue_head[q]; r; prev = r, r = r->next) {
+				if(r->fd != b->fd || r->op != b->op || r->offset != end)
+					continue;
+
+				if(prev)
+					prev->next = r->next;
+				else
+					queue_head[q] = r->next;
+				if(queue_tail[q] == r)
+					queue_tail[q] = prev;
+				queued--;
+
+				b->reqs[b->count] = r;
+				b->iov[b->count] = (struct iovec){ .iov_base = r->buffer, .iov_len = r->size };
+				b->count++;
+				end += r->size;
+				stats.coalesced++;
+				grown = true;
+				break;
+			}
+		}
+	}
+
+	in_flight += b->count;
+	record(stats.depth, in_flight);
+	return true;
+}
+
+void
+complete(Batch *b, ssize_t result)
+{
+	uint64_t t = now_ns();
+
+	/* a short transfer fills the requests in order, like the iovecs */
+	for(int i = 0; i < b->count; i++) {
+		IoRequest *req = b->reqs[i];
+		if(result < 0) {
+			req->result = result;
+		} else {
+			req->result = (size_t)result < req->size ? result : (ssize_t)req->size;
+			result -= req->result;
+		}
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	in_flight -= b->count;
+	stats.completed += b->count;
+	for(int i = 0; i < b->count; i++)
+		record(stats.latency, (t - b->reqs[i]->submit_ns) / 1000);
+	pthread_mutex_unlock(&queue_mutex);
+
+	/* a request with a callback is the callback's, it may be gone as soon
+	 * as it is called */
+	for(int i = 0; i < b->count; i++) {
+		IoRequest *req = b->reqs[i];
+		if(req->callback)
+			req->callback(req);
+		else
+			atomic_store_explicit(&req->done, true, memory_order_release);
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void
+record(size_t *histogram, uint64_t value)
+{
+	int i = 0;
+
+	while(i < IOQ_HISTOGRAM - 1 && ((uint64_t)1 << i) < value)
+		i++;
+	histogram[i]++;
+}
+
+uint64_t
+now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void *
+thread_worker(void *arg)
+{
+	Batch b;
+
+	(void)arg;
+	pthread_mutex_lock(&queue_mutex);
+	for(;;) {
+		while(!closing && !queued)
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+		if(!take_batch(&b))
+			break;
+		stats.batches++;
+		pthread_mutex_unlock(&queue_mutex);
+
+		ssize_t r = b.op == IOQ_READ
+			? preadv(b.fd, b.iov, b.count, b.offset)
+			: pwritev(b.fd, b.iov, b.count, b.offset);
+		complete(&b, r < 0 ? -errno : r);
+
+		pthread_mutex_lock(&queue_mutex);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return NULL;
+}
+
+#ifdef HAVE_URING
+bool
+uring_init()
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(&ring, 0, sizeof(ring));
+	/* one more for the wake up read */
+	ring.fd = syscall(__NR_io_uring_setup, IOQ_DEPTH * 2, &p);
+	if(ring.fd < 0)
+		return false;
+
+	ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring.fd, IORING_OFF_SQ_RING);
+	ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring.fd, IORING_OFF_SQES);
+	ring.wake_fd = eventfd(0, EFD_CLOEXEC);
+	if(ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED || ring.wake_fd < 0) {
+		uring_terminate();
+		return false;
+	}
+
+	unsigned char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+	ring.sq_head  = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+void
+uring_terminate()
+{
+	if(ring.sq_ptr && ring.sq_ptr != MAP_FAILED)
+		munmap(ring.sq_ptr, ring.sq_size);
+	if(ring.cq_ptr && ring.cq_ptr != MAP_FAILED)
+		munmap(ring.cq_ptr, ring.cq_size);
+	if(ring.sqes && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqes_size);
+	if(ring.wake_fd > 0)
+		close(ring.wake_fd);
+	close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+}
+
+void
+uring_push(int op, int fd, const struct iovec *iov, int count, off_t offset, uint64_t tag)
+{
+	/* only the uring worker touches the submission ring */
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = count;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void *
+uring_worker(void *arg)
+{
+	int submit = 0;
+	bool wake_armed = false;
+
+	(void)arg;
+	ring.wake_iov = (struct iovec){ .iov_base = &ring.wake_value, .iov_len = sizeof(ring.wake_value) };
+	for(;;) {
+		if(!wake_armed) {
+			uring_push(IORING_OP_READV, ring.wake_fd, &ring.wake_iov, 1, 0, WAKE_TAG);
+			wake_armed = true;
+			submit++;
+		}
+
+		pthread_mutex_lock(&queue_mutex);
+		while(free_batches) {
+			Batch *b = free_batches;
+			if(!take_batch(b))
+				break;
+			free_batches = b->next_free;
+			uring_push(b->op == IOQ_READ ? IORING_OP_READV : IORING_OP_WRITEV,
+					b->fd, b->iov, b->count, b->offset, (uintptr_t)b);
+			submit++;
+		}
+		if(submit)
+			stats.batches++;
+		bool done = closing && !queued && !in_flight;
+		pthread_mutex_unlock(&queue_mutex);
+		if(done)
+			break;
+
+		/* submits and sleeps until something completes, the wake up read
+		 * completes as soon as a request is queued */
+		int r = syscall(__NR_io_uring_enter, ring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(r >= 0)
+			submit -= r;
+		else if(errno != EINTR)
+			die("io_uring_enter: %s\n", strerror(errno));
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			if(cqe->user_data == WAKE_TAG) {
+				wake_armed = false;
+				continue;
+			}
+
+			Batch *b = (Batch *)(uintptr_t)cqe->user_data;
+			complete(b, cqe->res);
+			pthread_mutex_lock(&queue_mutex);
+			b->next_free = free_batches;
+			free_batches = b;
+			pthread_mutex_unlock(&queue_mutex);
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+#endif
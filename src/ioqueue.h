@@ -0,0 +1,87 @@
+#ifndef IOQUEUE_H
+#define IOQUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IOQ_DEPTH     64
+#define IOQ_HISTOGRAM 16
+
+/*
+ * asynchronous positional reads and writes.
+ *
+ * requests wait in a queue per priority and go out highest priority first,
+ * in batches of up to IOQ_DEPTH, through io_uring where the kernel allows it
+ * and a pool of threads doing preadv()/pwritev() otherwise. a request to
+ * the same file and of the same kind as one going out, starting where it
+ * ends, goes out with it as a single vectored call.
+ *
+ * the callback runs on an I/O thread once the request is done and owns the
+ * request from then on, the queue doesn't touch it again. ioq_wait() is only
+ * for requests without a callback.
+ */
+typedef struct IoRequest IoRequest;
+
+typedef enum {
+	IOQ_READ,
+	IOQ_WRITE,
+} IoOp;
+
+typedef enum {
+	IOQ_HIGH,
+	IOQ_NORMAL,
+	IOQ_LOW,
+	IOQ_PRIORITIES
+} IoPriority;
+
+struct IoRequest {
+	int fd;
+	IoOp op;
+	void *buffer;
+	size_t size;
+	off_t offset;
+	IoPriority priority;
+	void (*callback)(IoRequest *req);
+	void *userptr;
+
+	/* bytes transferred or -errno, valid once done or in the callback */
+	ssize_t result;
+	atomic_bool done;
+
+	uint64_t submit_ns;
+	IoRequest *next;
+};
+
+typedef struct {
+	const char *backend;
+	size_t submitted;
+	size_t completed;
+	/* requests that went out as part of another one's call */
+	size_t coalesced;
+	/* calls into the kernel that submitted something */
+	size_t batches;
+	/* requests in flight as a batch goes out, bucket i counts up to 2^i */
+	size_t depth[IOQ_HISTOGRAM];
+	/* submission to completion, bucket i counts up to 2^i microseconds */
+	size_t latency[IOQ_HISTOGRAM];
+} IoStats;
+
+/* called by the first submission if not before, false picks the threads */
+void ioq_init(bool try_uring);
+/* finishes everything queued before returning */
+void ioq_terminate();
+
+void ioq_submit(IoRequest *req);
+void ioq_submit_batch(IoRequest **reqs, size_t count);
+void ioq_wait(IoRequest *req);
+
+/* blocking helpers going through the queue */
+ssize_t ioq_pread(int fd, void *buffer, size_t size, off_t offset, IoPriority priority);
+ssize_t ioq_pwrite(int fd, const void *buffer, size_t size, off_t offset, IoPriority priority);
+
+void ioq_get_stats(IoStats *stats);
+
+#endif
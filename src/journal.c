@@ -0,0 +1,422 @@
+#include "journal.h"
+#include "chunkmap.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC 0x4C4E524A
+/* below this it is never worth rewriting */
+#define COMPACT_MIN_BYTES (64 << 10)
+#define COMPACT_BATCH 4096
+
+typedef struct {
+	uint16_t index;
+	signed char block;
+} Edit;
+
+typedef struct {
+	uint64_t key;
+	int x, y, z;
+	ArrayBuffer edits;
+} ChunkEdits;
+
+static void       *committer(void *arg);
+static bool        replay(const char *path);
+static void        apply(int x, int y, int z, Block block);
+static ChunkEdits *chunk_edits(int x, int y, int z, bool create);
+static void        free_edits();
+static bool        write_batch(FileBuffer *f, const JournalRecord *records, uint32_t count);
+static void        snapshot(ArrayBuffer *records);
+static size_t      compact(const JournalRecord *records, size_t count);
+static uint32_t    checksum(const JournalRecord *records, uint32_t count);
+
+static bool enabled;
+static char *journal_path, *compact_path;
+static FileBuffer file;
+
+/* protects everything below, the file is only touched by the committer */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  journal_cond = PTHREAD_COND_INITIALIZER;
+static ArrayBuffer pending;
+static bool closing;
+static pthread_t committer_thread;
+
+/* open addressing by chunk_coord_key(), grows at half full */
+static ChunkEdits *chunks;
+static size_t chunks_mask, chunks_used;
+static JournalStats stats;
+
+bool
+journal_open(const char *dir)
+{
+	journal_close();
+	if(!dir)
+		return false;
+	if(mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "can't create save directory %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+
+	journal_path = emalloc(strlen(dir) + sizeof("/journal"));
+	sprintf(journal_path, "%s/journal", dir);
+	compact_path = emalloc(strlen(dir) + sizeof("/journal.compact"));
+	sprintf(compact_path, "%s/journal.compact", dir);
+
+	memset(&stats, 0, sizeof(stats));
+	chunks_mask = 1023;
+	chunks_used = 0;
+	chunks = emalloc(sizeof(ChunkEdits) * (chunks_mask + 1));
+	memset(chunks, 0, sizeof(ChunkEdits) * (chunks_mask + 1));
+
+	/* appending after a torn batch would hide everything that follows */
+	bool ok = replay(journal_path);
+	if(!ok) {
+		ArrayBuffer records;
+
+		arrbuf_init(&records);
+		snapshot(&records);
+		if((stats.file_bytes = compact(records.data, arrbuf_length(&records, sizeof(JournalRecord))))) {
+			stats.compactions++;
+			ok = true;
+		}
+		arrbuf_free(&records);
+	}
+	if(!ok || fbuf_open(&file, journal_path, "ab", allocator_default())) {
+		fprintf(stderr, "can't open journal %s\n", journal_path);
+		free_edits();
+		efree(journal_path);
+		efree(compact_path);
+		return false;
+	}
+
+	arrbuf_init(&pending);
+	closing = false;
+	enabled = true;
+	pthread_create(&committer_thread, NULL, committer, NULL);
+	return true;
+}
+
+void
+journal_close()
+{
+	if(!enabled)
+		return;
+
+	pthread_mutex_lock(&journal_mutex);
+	closing = true;
+	pthread_mutex_unlock(&journal_mutex);
+	pthread_cond_broadcast(&journal_cond);
+	pthread_join(committer_thread, NULL);
+
+	fbuf_close(&file);
+	arrbuf_free(&pending);
+	free_edits();
+	efree(journal_path);
+	efree(compact_path);
+	enabled = false;
+}
+
+bool
+journal_enabled()
+{
+	return enabled;
+}
+
+void
+journal_record(int x, int y, int z, Block block)
+{
+	JournalRecord r = { .x = x, .y = y, .z = z, .block = block };
+
+	pthread_mutex_lock(&journal_mutex);
+	apply(x, y, z, block);
+	arrbuf_insert(&pending, sizeof(r), &r);
+	stats.records++;
+	pthread_mutex_unlock(&journal_mutex);
+	pthread_cond_signal(&journal_cond);
+}
+
+BlockStorage *
+journal_replay(int x, int y, int z, BlockStorage *blocks)
+{
+	pthread_mutex_lock(&journal_mutex);
+	ChunkEdits *c = chunk_edits(x, y, z, false);
+	if(c) {
+		SPAN_FOR(arrbuf_span(&c->edits), e, Edit) {
+			BlockStorage *ns = bstore_set(blocks, e->index, e->block);
+			if(ns != blocks) {
+				/* never published, nobody can be reading the old one */
+				bstore_free_retired(ns);
+				blocks = ns;
+			}
+		}
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	return blocks;
+}
+
+bool
+journal_edited(int x, int y, int z)
+{
+	uint16_t index = BSTORE_INDEX(x & BLOCK_MASK, y & BLOCK_MASK, z & BLOCK_MASK);
+	bool edited = false;
+
+	pthread_mutex_lock(&journal_mutex);
+	ChunkEdits *c = chunk_edits(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, false);
+	if(c) {
+		SPAN_FOR(arrbuf_span(&c->edits), e, Edit) {
+			if(e->index == index) {
+				edited = true;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	return edited;
+}
+
+void
+journal_get_stats(JournalStats *out)
+{
+	pthread_mutex_lock(&journal_mutex);
+	*out = stats;
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+void *
+committer(void *arg)
+{
+	ArrayBuffer batch;
+
+	(void)arg;
+	arrbuf_init(&batch);
+	pthread_mutex_lock(&journal_mutex);
+	for(;;) {
+		while(!closing && pending.size == 0)
+			pthread_cond_wait(&journal_cond, &journal_mutex);
+		if(pending.size == 0)
+			break;
+
+		/* whatever comes in while this one syncs makes the next batch */
+		ArrayBuffer swap = batch;
+		batch = pending;
+		pending = swap;
+		arrbuf_clear(&pending);
+		pthread_mutex_unlock(&journal_mutex);
+
+		uint32_t count = arrbuf_length(&batch, sizeof(JournalRecord));
+		if(!write_batch(&file, batch.data, count))
+			fprintf(stderr, "can't write journal %s\n", journal_path);
+
+		pthread_mutex_lock(&journal_mutex);
+		stats.commits++;
+		stats.file_bytes += sizeof(JournalBatch) + count * sizeof(JournalRecord);
+		if(stats.file_bytes <= COMPACT_MIN_BYTES
+				|| stats.file_bytes <= 2 * (stats.edits * sizeof(JournalRecord) + sizeof(JournalBatch)))
+			continue;
+
+		/*
+		 * edits made after the snapshot are pending and get appended to
+		 * the new journal, replaying them twice is harmless
+		 */
+		arrbuf_clear(&batch);
+		snapshot(&batch);
+		pthread_mutex_unlock(&journal_mutex);
+
+		fbuf_close(&file);
+		size_t bytes = compact(batch.data, arrbuf_length(&batch, sizeof(JournalRecord)));
+		if(fbuf_open(&file, journal_path, "ab", allocator_default()))
+			die("can't reopen journal %s\n", journal_path);
+
+		pthread_mutex_lock(&journal_mutex);
+		if(bytes) {
+			stats.file_bytes = bytes;
+			stats.compactions++;
+		}
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	arrbuf_free(&batch);
+	return NULL;
+}
+
+bool
+replay(const char *path)
+{
+	size_t size, pos = 0;
+	char *data = read_file(path, &size);
+
+	/* nothing saved yet */
+	if(!data)
+		return true;
+
+	while(size - pos >= sizeof(JournalBatch)) {
+		JournalBatch b;
+
+		memcpy(&b, data + pos, sizeof(b));
+		if(b.magic != JOURNAL_MAGIC
+				|| (size - pos - sizeof(b)) / sizeof(JournalRecord) < b.count)
+			break;
+
+		const JournalRecord *records = (JournalRecord *)(data + pos + sizeof(b));
+		if(checksum(records, b.count) != b.checksum)
+			break;
+		for(uint32_t i = 0; i < b.count; i++)
+			apply(records[i].x, records[i].y, records[i].z, records[i].block);
+
+		pos += sizeof(b) + b.count * sizeof(JournalRecord);
+		stats.records += b.count;
+	}
+	free(data);
+
+	stats.file_bytes = pos;
+	if(pos != size)
+		fprintf(stderr, "%s: dropping %zu bytes of a torn batch\n", path, size - pos);
+	return pos == size;
+}
+
+void
+apply(int x, int y, int z, Block block)
+{
+	/* journal_mutex is held */
+	ChunkEdits *c = chunk_edits(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, true);
+	uint16_t index = BSTORE_INDEX(x & BLOCK_MASK, y & BLOCK_MASK, z & BLOCK_MASK);
+
+	SPAN_FOR(arrbuf_span(&c->edits), e, Edit) {
+		if(e->index == index) {
+			e->block = block;
+			return;
+		}
+	}
+	arrbuf_insert(&c->edits, sizeof(Edit), &(Edit){ .index = index, .block = block });
+	stats.edits++;
+}
+
+ChunkEdits *
+chunk_edits(int x, int y, int z, bool create)
+{
+	/* journal_mutex is held */
+	uint64_t key = chunk_coord_key(x, y, z);
+	size_t i;
+
+	for(i = hash_int64(key) & chunks_mask; chunks[i].key; i = (i + 1) & chunks_mask)
+		if(chunks[i].key == key)
+			return &chunks[i];
+	if(!create)
+		return NULL;
+
+	if((chunks_used + 1) * 2 > chunks_mask + 1) {
+		ChunkEdits *old = chunks;
+		size_t old_len = chunks_mask + 1;
+
+		chunks_mask = old_len * 2 - 1;
+		chunks = emalloc(sizeof(ChunkEdits) * (chunks_mask + 1));
+		memset(chunks, 0, sizeof(ChunkEdits) * (chunks_mask + 1));
+		for(size_t j = 0; j < old_len; j++) {
+			if(!old[j].key)
+				continue;
+			size_t k = hash_int64(old[j].key) & chunks_mask;
+			while(chunks[k].key)
+				k = (k + 1) & chunks_mask;
+			chunks[k] = old[j];
+		}
+		efree(old);
+
+		for(i = hash_int64(key) & chunks_mask; chunks[i].key; i = (i + 1) & chunks_mask)
+			;
+	}
+
+	chunks[i].key = key;
+	chunks[i].x = x;
+	chunks[i].y = y;
+	chunks[i].z = z;
+	arrbuf_init(&chunks[i].edits);
+	chunks_used++;
+	return &chunks[i];
+}
+
+void
+free_edits()
+{
+	for(size_t i = 0; i <= chunks_mask; i++)
+		if(chunks[i].key)
+			arrbuf_free(&chunks[i].edits);
+	efree(chunks);
+	chunks = NULL;
+}
+
+bool
+write_batch(FileBuffer *f, const JournalRecord *records, uint32_t count)
+{
+	JournalBatch b = {
+		.magic = JOURNAL_MAGIC,
+		.count = count,
+		.checksum = checksum(records, count)
+	};
+
+	fbuf_write(f, sizeof(b), &b);
+	fbuf_write(f, count * sizeof(JournalRecord), (void *)records);
+	if(fbuf_flush(f) != 1)
+		return false;
+	return fsync(fileno(f->file_handle)) == 0;
+}
+
+void
+snapshot(ArrayBuffer *records)
+{
+	/* journal_mutex is held, or nobody else is running yet */
+	for(size_t i = 0; i <= chunks_mask; i++) {
+		ChunkEdits *c = &chunks[i];
+		if(!c->key)
+			continue;
+
+		SPAN_FOR(arrbuf_span(&c->edits), e, Edit) {
+			JournalRecord r = {
+				.x = c->x + (e->index & BLOCK_MASK),
+				.y = c->y + ((e->index >> BLOCK_BITS) & BLOCK_MASK),
+				.z = c->z + (e->index >> (BLOCK_BITS * 2)),
+				.block = e->block
+			};
+			arrbuf_insert(records, sizeof(r), &r);
+		}
+	}
+}
+
+size_t
+compact(const JournalRecord *records, size_t count)
+{
+	/* returns the size of the new journal, 0 if it is still the old one */
+	FileBuffer f;
+	size_t bytes = 0;
+	bool ok = true;
+
+	if(fbuf_open(&f, compact_path, "wb", allocator_default()))
+		return 0;
+	for(size_t i = 0; ok && (i < count || i == 0); i += COMPACT_BATCH) {
+		uint32_t n = mini(count - i, COMPACT_BATCH);
+		ok = write_batch(&f, records + i, n);
+		bytes += sizeof(JournalBatch) + n * sizeof(JournalRecord);
+	}
+	fbuf_close(&f);
+
+	/* the old journal stays whole until the new one is */
+	if(!ok || rename(compact_path, journal_path)) {
+		fprintf(stderr, "can't compact journal %s\n", journal_path);
+		return 0;
+	}
+	return bytes;
+}
+
+uint32_t
+checksum(const JournalRecord *records, uint32_t count)
+{
+	const unsigned char *p = (const unsigned char *)records;
+	uint32_t h = 2166136261u;
+
+	for(size_t i = 0; i < count * sizeof(JournalRecord); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
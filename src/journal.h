@@ -0,0 +1,60 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "world.h"
+#include "blockstore.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * the edits made with world_set_block(), everything else comes back the same
+ * out of the generator, so they are all a world needs saving.
+ *
+ * the journal file is a sequence of batches, each a JournalBatch header and
+ * count JournalRecords, appended and synced by a committer thread so every
+ * edit made while the last batch was syncing goes in the next one. a batch
+ * that doesn't match its checksum ends the journal, it was torn by a crash.
+ * the live edits are kept indexed by chunk in memory, once the file holds
+ * more than twice what they take it is rewritten from them.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t checksum;
+} JournalBatch;
+
+typedef struct {
+	int32_t x, y, z;
+	int8_t  block;
+	uint8_t pad[3];
+} JournalRecord;
+
+typedef struct {
+	/* distinct blocks edited, the last edit of each one */
+	size_t edits;
+	size_t records;
+	size_t commits;
+	size_t compactions;
+	size_t file_bytes;
+} JournalStats;
+
+/* replays the journal in the directory, NULL disables */
+bool journal_open(const char *directory);
+/* commits what is pending before returning */
+void journal_close();
+bool journal_enabled();
+
+void journal_record(int x, int y, int z, Block block);
+/*
+ * applies the edits of the chunk at x, y, z to blocks, a storage nobody else
+ * sees yet. returns the storage, which may have been replaced like bstore_set()
+ */
+BlockStorage *journal_replay(int x, int y, int z, BlockStorage *blocks);
+/* true if the block was edited, the chunk holding it may not be loaded */
+bool          journal_edited(int x, int y, int z);
+
+void journal_get_stats(JournalStats *stats);
+
+#endif
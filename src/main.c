@@ -89,6 +89,7 @@ main()
 
 	world_init();
 	chunk_render_init();
+	world_set_change_callback(chunk_render_request_update_chunk);
 
 	player.yaw = 0.0;
 	player.pitch = 0.0;
@@ -97,6 +98,7 @@ main()
 	player.position[2] = 0;
 
 	wgen_set_seed("Gente que passa o dia inteiro no twitter e em chan não deveria nem ter direito a voto.");
+	world_set_save_directory("saves", SAVE_REGIONS);
 
 	glfwShowWindow(window);
 	pre_time = glfwGetTime();
@@ -131,7 +133,10 @@ main()
 		frames++;
 		fps_time += delta;
 		if(fps_time > 1.0) {
-			int current = world_allocated_chunks_count();
+			WorldStats stats;
+			world_get_stats(&stats);
+
+			int current = stats.chunk_count;
 			int cdelta = current - old_chunk_count;
 			old_chunk_count = current;
 			
@@ -139,7 +144,57 @@ main()
 			int udelta = ucurrent - old_update_count;
 			old_update_count = ucurrent;
 			
-			printf("FPS: %d (%d chunks (%0.2f MB), %d new chunks, %d mesh updates)\n", frames, current, (current * sizeof(Chunk) / (1024.0 * 1024.0)), cdelta, udelta);
+			size_t bytes = stats.chunk_bytes + stats.block_bytes + stats.scratch_bytes;
+			printf("FPS: %d (%d chunks (%0.2f MB, %zu B/chunk, %zu B/chunk unsplit, %d scratch), %d new chunks, %d mesh updates)\n",
+					frames, current,
+					bytes / (1024.0 * 1024.0),
+					current ? bytes / current : 0,
+					current ? stats.unsplit_bytes / current : 0,
+					stats.scratch_count,
+					cdelta, udelta);
+			printf("     (%0.2f/%0.2f MB budget, %0.2f MB slabs, %zu evicted, %zu overruns, %d queued loads)\n",
+					bytes / (1024.0 * 1024.0),
+					stats.memory_budget / (1024.0 * 1024.0),
+					stats.slab_bytes / (1024.0 * 1024.0),
+					stats.evictions,
+					stats.budget_overruns,
+					stats.load_queue);
+			printf("     (%d hot chunks, %zu warm (%0.2f/%0.2f MB budget, %zu hits, %zu spilled to disk))\n",
+					current,
+					stats.warm_count,
+					stats.warm_bytes / (1024.0 * 1024.0),
+					stats.warm_budget / (1024.0 * 1024.0),
+					stats.warm_hits,
+					stats.warm_spills);
+			printf("     (%zu column heightmaps, %zu hits, %zu misses, %zu chunks skipped)\n",
+					stats.column_count,
+					stats.column_hits,
+					stats.column_misses,
+					stats.skipped_chunks);
+			printf("     (%zu structure blocks waiting for %zu chunks)\n",
+					stats.pending_blocks,
+					stats.pending_chunks);
+			printf("     (%d uniform chunks (%0.1f%%), %zu empty meshes skipped)\n",
+					stats.uniform_count,
+					current ? 100.0 * stats.uniform_count / current : 0.0,
+					chunk_render_uniform_skip_count());
+			if(stats.save_mode == SAVE_REGIONS)
+				printf("     (%zu chunks loaded, %zu saved (%0.2f MB), %d saves queued)\n",
+						stats.chunks_loaded,
+						stats.chunks_saved,
+						stats.save_bytes / (1024.0 * 1024.0),
+						stats.save_queue);
+			else if(stats.save_mode == SAVE_EDITS)
+				printf("     (%zu edits journaled, %zu commits, %zu compactions)\n",
+						stats.journal_edits,
+						stats.journal_commits,
+						stats.compactions);
+			else if(stats.save_mode == SAVE_MAPPED)
+				printf("     (%0.2f MB stored, %0.2f MB resident, %zu minor %zu major faults)\n",
+						stats.store_bytes / (1024.0 * 1024.0),
+						stats.store_resident / (1024.0 * 1024.0),
+						stats.minor_faults,
+						stats.major_faults);
 			frames = 0;
 			fps_time = 0;
 		}
@@ -224,8 +279,10 @@ player_update(Player *player, float delta)
 			player->velocity[1] = -40.0;
 
 		AABB player_aabb;
+		BlockCursor cur;
 		vec3_dup(player_aabb.position, player->position);
 		vec3_dup(player_aabb.halfsize, (vec3){ 0.4, 0.8, 0.4 });
+		cursor_init(&cur, CSTATE_DECORATED);
 		for(int x = -1; x <= 1; x++)
 		for(int y = -1; y <= 1; y++)
 		for(int z = -1; z <= 1; z++) {
@@ -233,7 +290,7 @@ player_update(Player *player, float delta)
 			int player_y = floorf(y + player->position[1]);
 			int player_z = floorf(z + player->position[2]);
 
-			Block b = world_get_block(player_x, player_y, player_z);
+			Block b = cursor_get(&cur, player_x, player_y, player_z);
 			if(b > 0 && !block_properties(b)->is_ghost) {
 				Contact c;
 				AABB block_aabb = {
@@ -255,6 +312,7 @@ player_update(Player *player, float delta)
 				}
 			}
 		}
+		cursor_release(&cur);
 		physics_accum -= PHYSICS_DELTA;
 	}
 
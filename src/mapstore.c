@@ -0,0 +1,412 @@
+#include "mapstore.h"
+#include "chunkmap.h"
+#include "util.h"
+#include "worldgen.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_MAGIC   0x50414D43
+#define STORE_VERSION 2
+/* sparse, only what gets written takes disk */
+#define STORE_BYTES   ((size_t)4 << 30)
+#define TABLE_SLOTS   (1 << 20)
+#define TABLE_OFFSET  4096
+#define IMAGE_ALIGN   64
+#define PAGE          4096
+
+#ifdef MADV_COLD
+	#define ADVISE_LEFT MADV_COLD
+#else
+	#define ADVISE_LEFT MADV_DONTNEED
+#endif
+
+typedef struct {
+	int x, y, z, radius;
+} Border;
+
+static void          *border_worker(void *arg);
+static void           advise_box(Border box, Border other, int advice);
+static bool           in_box(Border box, int x, int y, int z);
+static MapStoreEntry *find_entry(int x, int y, int z, bool create);
+static bool           valid_range(const MapStoreEntry *e);
+static bool           valid_image(const MapStoreEntry *e);
+static size_t         images_offset();
+static size_t         align_up(size_t x, size_t a);
+
+static bool enabled;
+static int fd = -1;
+static unsigned char *map;
+static size_t map_size;
+static MapStoreHeader *header;
+static MapStoreEntry *table;
+
+/* protects the table and the header */
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t border_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  border_cond = PTHREAD_COND_INITIALIZER;
+static Border border;
+static bool border_changed, closing;
+static pthread_t border_thread;
+
+bool
+mapstore_open(const char *dir)
+{
+	ArrayBuffer path;
+	struct stat st;
+	size_t images = images_offset();
+
+	mapstore_close();
+	if(!dir)
+		return false;
+	if(mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "can't create save directory %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+
+	arrbuf_init(&path);
+	arrbuf_printf(&path, "%s/chunks.map", dir);
+	fd = open(path.data, O_RDWR | O_CREAT, 0644);
+	if(fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "can't open chunk store %s: %s\n", (char *)path.data, strerror(errno));
+		goto fail;
+	}
+	if(st.st_size == 0 && ftruncate(fd, STORE_BYTES)) {
+		fprintf(stderr, "can't size chunk store %s: %s\n", (char *)path.data, strerror(errno));
+		goto fail;
+	}
+
+	if(st.st_size && (size_t)st.st_size < images) {
+		fprintf(stderr, "%s: truncated chunk store\n", (char *)path.data);
+		goto fail;
+	}
+
+	map_size = st.st_size ? (size_t)st.st_size : STORE_BYTES;
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "can't map chunk store %s: %s\n", (char *)path.data, strerror(errno));
+		map = NULL;
+		goto fail;
+	}
+
+	header = (MapStoreHeader *)map;
+	table = (MapStoreEntry *)(map + TABLE_OFFSET);
+	if(st.st_size == 0) {
+		header->magic = STORE_MAGIC;
+		header->version = STORE_VERSION;
+		header->generator = wgen_version();
+		header->seed = wgen_seed();
+		header->table_slots = TABLE_SLOTS;
+		header->chunks = 0;
+		header->end = images;
+	} else if(header->magic != STORE_MAGIC || header->version != STORE_VERSION
+			|| header->table_slots != TABLE_SLOTS || header->end < images || header->end > map_size) {
+		fprintf(stderr, "%s is not a chunk store\n", (char *)path.data);
+		goto fail;
+	} else if(header->generator != wgen_version() || header->seed != wgen_seed()) {
+		fprintf(stderr, "%s was saved from another seed or generator, not saving to %s\n",
+				(char *)path.data, dir);
+		goto fail;
+	}
+
+	/* images are read a chunk at a time, reading ahead only wastes memory */
+	madvise(map + images, map_size - images, MADV_RANDOM);
+
+	arrbuf_free(&path);
+	border = (Border){ .radius = -1 };
+	border_changed = false;
+	closing = false;
+	enabled = true;
+	pthread_create(&border_thread, NULL, border_worker, NULL);
+	return true;
+
+fail:
+	arrbuf_free(&path);
+	if(map)
+		munmap(map, map_size);
+	if(fd >= 0)
+		close(fd);
+	map = NULL;
+	fd = -1;
+	return false;
+}
+
+void
+mapstore_close()
+{
+	if(!enabled)
+		return;
+
+	pthread_mutex_lock(&border_mutex);
+	closing = true;
+	pthread_mutex_unlock(&border_mutex);
+	pthread_cond_broadcast(&border_cond);
+	pthread_join(border_thread, NULL);
+
+	msync(map, header->end, MS_SYNC);
+	munmap(map, map_size);
+	close(fd);
+	map = NULL;
+	fd = -1;
+	enabled = false;
+}
+
+bool
+mapstore_enabled()
+{
+	return enabled;
+}
+
+BlockStorage *
+mapstore_load(int x, int y, int z)
+{
+	BlockStorage *s = NULL;
+
+	if(!enabled)
+		return NULL;
+
+	pthread_mutex_lock(&store_mutex);
+	MapStoreEntry *e = find_entry(x, y, z, false);
+	if(e && !e->capacity && e->offset < BLOCK_LAST)
+		s = bstore_uniform(e->offset);
+	else if(e && e->capacity && valid_image(e))
+		s = (BlockStorage *)(map + e->offset);
+	pthread_mutex_unlock(&store_mutex);
+
+	/* generated again, storing it then writes a new image */
+	if(e && !s)
+		fprintf(stderr, "chunk store entry of %d %d %d is corrupt\n", x, y, z);
+	return s;
+}
+
+void
+mapstore_store(int x, int y, int z, const BlockStorage *s)
+{
+	size_t size = bstore_size(s);
+	size_t offset = 0, capacity = 0;
+
+	pthread_mutex_lock(&store_mutex);
+	MapStoreEntry *e = find_entry(x, y, z, false);
+	/* edited in place, the file has it already */
+	if(e && e->capacity && (unsigned char *)s == map + e->offset)
+		goto out;
+
+	if(bstore_is_uniform(s)) {
+		offset = s->palette[0];
+	} else {
+		/* always a new image, even where the old one would fit: a chunk
+		 * that grew out of it may still have readers on it through its
+		 * retired storage. the old one is left for them, never reused */
+		offset = align_up(header->end, IMAGE_ALIGN);
+		capacity = align_up(size, IMAGE_ALIGN);
+		if(offset + capacity > map_size) {
+			fprintf(stderr, "chunk store is full\n");
+			goto out;
+		}
+		header->end = offset + capacity;
+	}
+
+	if(!e && !(e = find_entry(x, y, z, true))) {
+		fprintf(stderr, "chunk store table is full\n");
+		goto out;
+	}
+	if(capacity) {
+		BlockStorage *image = (BlockStorage *)(map + offset);
+		memcpy(image, s, size);
+		image->mapped = true;
+		image->retired = NULL;
+	}
+	/* the entry last, a reader never sees it point at a half copied image */
+	e->offset = offset;
+	e->capacity = capacity;
+
+out:
+	pthread_mutex_unlock(&store_mutex);
+}
+
+void
+mapstore_set_border(int x, int y, int z, int radius)
+{
+	pthread_mutex_lock(&border_mutex);
+	border = (Border){ .x = x, .y = y, .z = z, .radius = radius };
+	border_changed = true;
+	pthread_mutex_unlock(&border_mutex);
+	pthread_cond_signal(&border_cond);
+}
+
+void
+mapstore_get_stats(MapStoreStats *stats)
+{
+	struct rusage usage;
+	size_t used;
+
+	memset(stats, 0, sizeof(*stats));
+	if(!getrusage(RUSAGE_SELF, &usage)) {
+		stats->minor_faults = usage.ru_minflt;
+		stats->major_faults = usage.ru_majflt;
+	}
+	if(!enabled)
+		return;
+
+	pthread_mutex_lock(&store_mutex);
+	stats->chunks = header->chunks;
+	used = header->end;
+	pthread_mutex_unlock(&store_mutex);
+
+	/* of the images, the table is there whatever is loaded */
+	size_t images = images_offset();
+	size_t pages = align_up(used - images, PAGE) / PAGE;
+	unsigned char *vec = emalloc(pages + 1);
+	if(!mincore(map + images, pages * PAGE, vec))
+		for(size_t i = 0; i < pages; i++)
+			stats->resident_bytes += (vec[i] & 1) * PAGE;
+	efree(vec);
+	stats->used_bytes = used - images;
+}
+
+void *
+border_worker(void *arg)
+{
+	/* nothing advised yet */
+	Border done = { .radius = -1 };
+
+	(void)arg;
+	pthread_mutex_lock(&border_mutex);
+	for(;;) {
+		while(!closing && !border_changed)
+			pthread_cond_wait(&border_cond, &border_mutex);
+		if(closing)
+			break;
+
+		/* only the latest border matters, the ones in between are skipped */
+		Border now = border;
+		border_changed = false;
+		pthread_mutex_unlock(&border_mutex);
+
+		advise_box(done, now, ADVISE_LEFT);
+		advise_box(now, done, MADV_WILLNEED);
+		done = now;
+
+		pthread_mutex_lock(&border_mutex);
+	}
+	pthread_mutex_unlock(&border_mutex);
+	return NULL;
+}
+
+void
+advise_box(Border box, Border other, int advice)
+{
+	/* every image in box but not in other */
+	if(box.radius < 0)
+		return;
+
+	for(int z = (box.z - box.radius) & CHUNK_MASK; z <= box.z + box.radius; z += CHUNK_SIZE)
+	for(int y = (box.y - box.radius) & CHUNK_MASK; y <= box.y + box.radius; y += CHUNK_SIZE)
+	for(int x = (box.x - box.radius) & CHUNK_MASK; x <= box.x + box.radius; x += CHUNK_SIZE) {
+		if(!in_box(box, x, y, z) || in_box(other, x, y, z))
+			continue;
+
+		pthread_mutex_lock(&store_mutex);
+		MapStoreEntry *e = find_entry(x, y, z, false);
+		bool image = e && e->capacity && valid_range(e);
+		size_t offset = image ? e->offset : 0;
+		size_t capacity = image ? e->capacity : 0;
+		pthread_mutex_unlock(&store_mutex);
+		if(!capacity)
+			continue;
+
+		size_t begin = offset & ~(size_t)(PAGE - 1);
+		madvise(map + begin, align_up(offset + capacity, PAGE) - begin, advice);
+	}
+}
+
+bool
+in_box(Border box, int x, int y, int z)
+{
+	/* the same test as world_can_load() */
+	return box.radius >= 0 && abs(box.x - x) <= box.radius
+		&& abs(box.y - y) <= box.radius && abs(box.z - z) <= box.radius;
+}
+
+MapStoreEntry *
+find_entry(int x, int y, int z, bool create)
+{
+	/* store_mutex is held */
+	uint64_t key = chunk_coord_key(x, y, z);
+	size_t i;
+
+	for(i = hash_int64(key) & (TABLE_SLOTS - 1); table[i].key; i = (i + 1) & (TABLE_SLOTS - 1))
+		if(table[i].key == key)
+			return &table[i];
+
+	/* past half full probing gets long, the store is as big as it gets */
+	if(!create || (header->chunks + 1) * 2 > TABLE_SLOTS)
+		return NULL;
+	table[i].key = key;
+	table[i].offset = 0;
+	table[i].capacity = 0;
+	header->chunks++;
+	return &table[i];
+}
+
+bool
+valid_range(const MapStoreEntry *e)
+{
+	/* store_mutex is held, an image in the part of the file written so far */
+	return e->offset % IMAGE_ALIGN == 0 && e->offset >= images_offset() && e->offset <= header->end
+		&& e->capacity >= sizeof(BlockStorage) && e->capacity <= header->end - e->offset;
+}
+
+bool
+valid_image(const MapStoreEntry *e)
+{
+	/*
+	 * store_mutex is held. the image is used in place by the generator and
+	 * the renderer, so it has to look like one mapstore_store() copied, and
+	 * every index in it has to read a block
+	 */
+	const BlockStorage *s = (const BlockStorage *)(map + e->offset);
+
+	if(!valid_range(e))
+		return false;
+	if(s->bits != 1 && s->bits != 2 && s->bits != 4 && s->bits != BSTORE_DIRECT_BITS)
+		return false;
+	if(!s->mapped || s->retired || bstore_size(s) > e->capacity)
+		return false;
+
+	if(s->bits == BSTORE_DIRECT_BITS) {
+		const unsigned char *blocks = (const unsigned char *)s->data;
+		for(int i = 0; i < BSTORE_VOLUME; i++)
+			if(blocks[i] >= BLOCK_LAST)
+				return false;
+		return true;
+	}
+
+	/* indices past palette_len read the rest of the palette */
+	if(!s->palette_len || s->palette_len > 1 << s->bits)
+		return false;
+	for(int i = 0; i < 1 << s->bits; i++)
+		if(s->palette[i] >= BLOCK_LAST)
+			return false;
+	return true;
+}
+
+size_t
+images_offset()
+{
+	return align_up(TABLE_OFFSET + (size_t)TABLE_SLOTS * sizeof(MapStoreEntry), PAGE);
+}
+
+size_t
+align_up(size_t x, size_t a)
+{
+	return (x + a - 1) & ~(a - 1);
+}
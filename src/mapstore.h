@@ -0,0 +1,73 @@
+#ifndef MAPSTORE_H
+#define MAPSTORE_H
+
+#include "world.h"
+#include "blockstore.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * decorated chunks kept as BlockStorage images in one big shared mapping of
+ * a sparse file, so a chunk loaded from it uses the image in place and
+ * loading an evicted chunk again costs a page fault at most.
+ *
+ * the file is a MapStoreHeader page, a table of MapStoreEntry by
+ * chunk_coord_key() with linear probing, then the images, each 64 byte
+ * aligned. uniform chunks only take a table entry. writes to a mapped image
+ * go straight to the file, an image that has to grow is copied back to the
+ * end of the file when the chunk leaves memory. the images it replaces are
+ * never reused, the file only grows. everything is in host byte order.
+ *
+ * a thread follows the load border, asking the kernel to read ahead the
+ * images that came into it and to reclaim first the ones that left.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	/* wgen_version() and wgen_seed() when the store was made, a store of
+	 * other terrain is refused */
+	uint32_t generator;
+	uint32_t pad;
+	uint64_t seed;
+	uint64_t table_slots;
+	uint64_t chunks;
+	/* where the next image goes */
+	uint64_t end;
+} MapStoreHeader;
+
+typedef struct {
+	uint64_t key;
+	/* the offset of the image, the block itself for uniform chunks */
+	uint64_t offset;
+	/* 0 for uniform chunks */
+	uint32_t capacity;
+	uint32_t pad;
+} MapStoreEntry;
+
+typedef struct {
+	size_t chunks;
+	/* of the images, and of them in memory */
+	size_t used_bytes;
+	size_t resident_bytes;
+	/* of the whole process, the store is most of them */
+	size_t minor_faults;
+	size_t major_faults;
+} MapStoreStats;
+
+bool mapstore_open(const char *directory);
+/* syncs the mapping before returning */
+void mapstore_close();
+bool mapstore_enabled();
+
+/* an image in the mapping or a uniform storage, NULL if never stored or
+ * if what the file has for it doesn't hold up */
+BlockStorage *mapstore_load(int x, int y, int z);
+/* copies the storage in, unless it is already the image of the chunk */
+void          mapstore_store(int x, int y, int z, const BlockStorage *blocks);
+void          mapstore_set_border(int x, int y, int z, int radius);
+
+void mapstore_get_stats(MapStoreStats *stats);
+
+#endif
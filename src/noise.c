@@ -0,0 +1,615 @@
+#include "noise.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define HAVE_X86_KERNELS
+	#include <immintrin.h>
+#endif
+
+/* the scalar path is built without fma like the kernels below, whatever
+ * the flags, so every isa rounds the same */
+#if defined(__GNUC__) && !defined(__clang__)
+	#define NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+	#define NO_CONTRACT
+#endif
+
+#define FADE(T)       ((T) * (T) * (T) * ((T) * ((T) * 6 - 15) + 10))
+#define LERP(T, A, B) ((A) + (T) * ((B) - (A)))
+
+typedef void Batch2d(const Noise *n, const float *x, const float *y, float *out, size_t count);
+typedef void Batch3d(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count);
+
+static int   fast_floor(float x);
+static float grad_2d(int hash, float x, float y);
+static float grad_3d(int hash, float x, float y, float z);
+
+static Batch2d batch_2d_scalar;
+static Batch3d batch_3d_scalar;
+#ifdef HAVE_X86_KERNELS
+static Batch2d batch_2d_sse4, batch_2d_avx2, batch_2d_avx512;
+static Batch3d batch_3d_sse4, batch_3d_avx2, batch_3d_avx512;
+#endif
+
+static bool     isa_picked;
+static Batch2d *batch_2d = batch_2d_scalar;
+static Batch3d *batch_3d = batch_3d_scalar;
+
+void
+noise_seed(Noise *n, uint32_t seed)
+{
+	PCG32State state = seed;
+
+	if(!isa_picked)
+		noise_set_isa(NOISE_AVX512);
+
+	init_pcg32(&state);
+	for(int i = 0; i < 256; i++)
+		n->perm[i] = i;
+	for(int i = 255; i > 0; i--) {
+		int j = rand_pcg32(&state) % (i + 1);
+		unsigned char t = n->perm[i];
+		n->perm[i] = n->perm[j];
+		n->perm[j] = t;
+	}
+	for(int i = 0; i < 256; i++)
+		n->perm[i + 256] = n->perm[i];
+	memset(n->perm + 512, 0, 4);
+}
+
+NO_CONTRACT float
+noise_2d(const Noise *n, float x, float y)
+{
+	const unsigned char *p = n->perm;
+	int ix0 = fast_floor(x);
+	int iy0 = fast_floor(y);
+	float fx0 = x - ix0;
+	float fy0 = y - iy0;
+	float fx1 = fx0 - 1.0f;
+	float fy1 = fy0 - 1.0f;
+	int ix1 = (ix0 + 1) & 0xff;
+	int iy1 = (iy0 + 1) & 0xff;
+	ix0 &= 0xff;
+	iy0 &= 0xff;
+
+	float s = FADE(fx0);
+	float t = FADE(fy0);
+
+	float n0 = LERP(t, grad_2d(p[ix0 + p[iy0]], fx0, fy0), grad_2d(p[ix0 + p[iy1]], fx0, fy1));
+	float n1 = LERP(t, grad_2d(p[ix1 + p[iy0]], fx1, fy0), grad_2d(p[ix1 + p[iy1]], fx1, fy1));
+
+	return 0.936f * LERP(s, n0, n1);
+}
+
+NO_CONTRACT float
+noise_3d(const Noise *n, float x, float y, float z)
+{
+	const unsigned char *p = n->perm;
+	int ix0 = fast_floor(x);
+	int iy0 = fast_floor(y);
+	int iz0 = fast_floor(z);
+	float fx0 = x - ix0;
+	float fy0 = y - iy0;
+	float fz0 = z - iz0;
+	float fx1 = fx0 - 1.0f;
+	float fy1 = fy0 - 1.0f;
+	float fz1 = fz0 - 1.0f;
+	int ix1 = (ix0 + 1) & 0xff;
+	int iy1 = (iy0 + 1) & 0xff;
+	int iz1 = (iz0 + 1) & 0xff;
+	ix0 &= 0xff;
+	iy0 &= 0xff;
+	iz0 &= 0xff;
+
+	float r = FADE(fz0);
+	float t = FADE(fy0);
+	float s = FADE(fx0);
+
+	/* the four z columns of hashes, then down to x */
+	int h00 = p[ix0 + p[iy0]], h01 = p[ix0 + p[iy1]];
+	int h10 = p[ix1 + p[iy0]], h11 = p[ix1 + p[iy1]];
+
+	float nx0 = LERP(r, grad_3d(p[h00 + iz0], fx0, fy0, fz0), grad_3d(p[h00 + iz1], fx0, fy0, fz1));
+	float nx1 = LERP(r, grad_3d(p[h01 + iz0], fx0, fy1, fz0), grad_3d(p[h01 + iz1], fx0, fy1, fz1));
+	float n0 = LERP(t, nx0, nx1);
+
+	nx0 = LERP(r, grad_3d(p[h10 + iz0], fx1, fy0, fz0), grad_3d(p[h10 + iz1], fx1, fy0, fz1));
+	nx1 = LERP(r, grad_3d(p[h11 + iz0], fx1, fy1, fz0), grad_3d(p[h11 + iz1], fx1, fy1, fz1));
+	float n1 = LERP(t, nx0, nx1);
+
+	return 0.87f * LERP(s, n0, n1);
+}
+
+void
+noise_2d_batch(const Noise *n, const float *x, const float *y, float *out, size_t count)
+{
+	batch_2d(n, x, y, out, count);
+}
+
+void
+noise_3d_batch(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+	batch_3d(n, x, y, z, out, count);
+}
+
+NoiseIsa
+noise_set_isa(NoiseIsa isa)
+{
+	isa_picked = true;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(isa >= NOISE_AVX512 && __builtin_cpu_supports("avx512f")) {
+		batch_2d = batch_2d_avx512;
+		batch_3d = batch_3d_avx512;
+		return NOISE_AVX512;
+	}
+	if(isa >= NOISE_AVX2 && __builtin_cpu_supports("avx2")) {
+		batch_2d = batch_2d_avx2;
+		batch_3d = batch_3d_avx2;
+		return NOISE_AVX2;
+	}
+	if(isa >= NOISE_SSE4 && __builtin_cpu_supports("sse4.1")) {
+		batch_2d = batch_2d_sse4;
+		batch_3d = batch_3d_sse4;
+		return NOISE_SSE4;
+	}
+#else
+	(void)isa;
+#endif
+	batch_2d = batch_2d_scalar;
+	batch_3d = batch_3d_scalar;
+	return NOISE_SCALAR;
+}
+
+const char *
+noise_isa_name(NoiseIsa isa)
+{
+	static const char *names[] = { "scalar", "sse4.1", "avx2", "avx512f" };
+	return names[isa];
+}
+
+NO_CONTRACT int
+fast_floor(float x)
+{
+	int i = (int)x;
+	return i > x ? i - 1 : i;
+}
+
+NO_CONTRACT float
+grad_2d(int hash, float x, float y)
+{
+	/* the 16 cube edge gradients of noise3() at z = 0 */
+	int h = hash & 15;
+	float u = h < 8 ? x : y;
+	float v = h < 4 ? y : h == 12 || h == 14 ? x : 0;
+	return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+}
+
+NO_CONTRACT float
+grad_3d(int hash, float x, float y, float z)
+{
+	/* the 32 gradients of noise4() at w = 0, corners and edges of a cube */
+	int h = hash & 31;
+	float u = h < 24 ? x : y;
+	float v = h < 16 ? y : z;
+	float w = h < 8 ? z : 0;
+	return ((h & 1) ? -u : u) + ((h & 2) ? -v : v) + ((h & 4) ? -w : w);
+}
+
+NO_CONTRACT void
+batch_2d_scalar(const Noise *n, const float *x, const float *y, float *out, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+		out[i] = noise_2d(n, x[i], y[i]);
+}
+
+NO_CONTRACT void
+batch_3d_scalar(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+		out[i] = noise_3d(n, x[i], y[i], z[i]);
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * the kernels do what noise_2d() and noise_3d() do in the same order, a
+ * lane at a time, and the signs are flipped with xor like a negation does,
+ * so nothing differs in rounding. they are built without fma for the same
+ * reason. the perm lookups are gathers of the word at each index masked
+ * down to its first byte, or plain loads for sse4.1 which has no gather.
+ */
+#define SSE4   __attribute__((target("sse4.1"), optimize("fp-contract=off")))
+#define AVX2   __attribute__((target("avx2"), optimize("fp-contract=off")))
+#define AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+
+static inline SSE4 __m128
+fade_sse4(__m128 t)
+{
+	__m128 t3 = _mm_mul_ps(_mm_mul_ps(t, t), t);
+	__m128 inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6)), _mm_set1_ps(15))), _mm_set1_ps(10));
+	return _mm_mul_ps(t3, inner);
+}
+
+static inline SSE4 __m128
+lerp_sse4(__m128 t, __m128 a, __m128 b)
+{
+	return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+static inline SSE4 __m128i
+perm_sse4(const Noise *n, __m128i index)
+{
+	int i[4];
+
+	_mm_storeu_si128((__m128i *)i, index);
+	return _mm_setr_epi32(n->perm[i[0]], n->perm[i[1]], n->perm[i[2]], n->perm[i[3]]);
+}
+
+static inline SSE4 __m128
+flip_sse4(__m128 v, __m128i h, int bit)
+{
+	__m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1 << bit)), 31 - bit);
+	return _mm_xor_ps(v, _mm_castsi128_ps(sign));
+}
+
+static inline SSE4 __m128
+grad_2d_sse4(__m128i hash, __m128 x, __m128 y)
+{
+	__m128i h = _mm_and_si128(hash, _mm_set1_epi32(15));
+	__m128 lt8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+	__m128 lt4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+	__m128 use_x = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+			_mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+	__m128 u = _mm_blendv_ps(y, x, lt8);
+	__m128 v = _mm_blendv_ps(_mm_blendv_ps(_mm_setzero_ps(), x, use_x), y, lt4);
+	return _mm_add_ps(flip_sse4(u, h, 0), flip_sse4(v, h, 1));
+}
+
+static inline SSE4 __m128
+grad_3d_sse4(__m128i hash, __m128 x, __m128 y, __m128 z)
+{
+	__m128i h = _mm_and_si128(hash, _mm_set1_epi32(31));
+	__m128 u = _mm_blendv_ps(y, x, _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(24))));
+	__m128 v = _mm_blendv_ps(z, y, _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(16))));
+	__m128 w = _mm_blendv_ps(_mm_setzero_ps(), z, _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8))));
+	return _mm_add_ps(_mm_add_ps(flip_sse4(u, h, 0), flip_sse4(v, h, 1)), flip_sse4(w, h, 2));
+}
+
+SSE4 void
+batch_2d_sse4(const Noise *n, const float *x, const float *y, float *out, size_t count)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128 one = _mm_set1_ps(1);
+	size_t i;
+
+	for(i = 0; i + 4 <= count; i += 4) {
+		__m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i);
+		__m128 flx = _mm_floor_ps(vx), fly = _mm_floor_ps(vy);
+		__m128i ix0 = _mm_cvttps_epi32(flx), iy0 = _mm_cvttps_epi32(fly);
+		__m128 fx0 = _mm_sub_ps(vx, flx), fy0 = _mm_sub_ps(vy, fly);
+		__m128 fx1 = _mm_sub_ps(fx0, one), fy1 = _mm_sub_ps(fy0, one);
+		__m128i ix1 = _mm_and_si128(_mm_add_epi32(ix0, _mm_set1_epi32(1)), mask);
+		__m128i iy1 = _mm_and_si128(_mm_add_epi32(iy0, _mm_set1_epi32(1)), mask);
+		ix0 = _mm_and_si128(ix0, mask);
+		iy0 = _mm_and_si128(iy0, mask);
+
+		__m128 s = fade_sse4(fx0), t = fade_sse4(fy0);
+		__m128i py0 = perm_sse4(n, iy0), py1 = perm_sse4(n, iy1);
+
+		__m128 n0 = lerp_sse4(t, grad_2d_sse4(perm_sse4(n, _mm_add_epi32(ix0, py0)), fx0, fy0),
+				grad_2d_sse4(perm_sse4(n, _mm_add_epi32(ix0, py1)), fx0, fy1));
+		__m128 n1 = lerp_sse4(t, grad_2d_sse4(perm_sse4(n, _mm_add_epi32(ix1, py0)), fx1, fy0),
+				grad_2d_sse4(perm_sse4(n, _mm_add_epi32(ix1, py1)), fx1, fy1));
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_set1_ps(0.936f), lerp_sse4(s, n0, n1)));
+	}
+	batch_2d_scalar(n, x + i, y + i, out + i, count - i);
+}
+
+SSE4 void
+batch_3d_sse4(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128 one = _mm_set1_ps(1);
+	size_t i;
+
+	for(i = 0; i + 4 <= count; i += 4) {
+		__m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+		__m128 flx = _mm_floor_ps(vx), fly = _mm_floor_ps(vy), flz = _mm_floor_ps(vz);
+		__m128i ix0 = _mm_cvttps_epi32(flx), iy0 = _mm_cvttps_epi32(fly), iz0 = _mm_cvttps_epi32(flz);
+		__m128 fx0 = _mm_sub_ps(vx, flx), fy0 = _mm_sub_ps(vy, fly), fz0 = _mm_sub_ps(vz, flz);
+		__m128 fx1 = _mm_sub_ps(fx0, one), fy1 = _mm_sub_ps(fy0, one), fz1 = _mm_sub_ps(fz0, one);
+		__m128i ix1 = _mm_and_si128(_mm_add_epi32(ix0, _mm_set1_epi32(1)), mask);
+		__m128i iy1 = _mm_and_si128(_mm_add_epi32(iy0, _mm_set1_epi32(1)), mask);
+		__m128i iz1 = _mm_and_si128(_mm_add_epi32(iz0, _mm_set1_epi32(1)), mask);
+		ix0 = _mm_and_si128(ix0, mask);
+		iy0 = _mm_and_si128(iy0, mask);
+		iz0 = _mm_and_si128(iz0, mask);
+
+		__m128 r = fade_sse4(fz0), t = fade_sse4(fy0), s = fade_sse4(fx0);
+		__m128i py0 = perm_sse4(n, iy0), py1 = perm_sse4(n, iy1);
+		__m128i h00 = perm_sse4(n, _mm_add_epi32(ix0, py0)), h01 = perm_sse4(n, _mm_add_epi32(ix0, py1));
+		__m128i h10 = perm_sse4(n, _mm_add_epi32(ix1, py0)), h11 = perm_sse4(n, _mm_add_epi32(ix1, py1));
+
+		__m128 nx0 = lerp_sse4(r, grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h00, iz0)), fx0, fy0, fz0),
+				grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h00, iz1)), fx0, fy0, fz1));
+		__m128 nx1 = lerp_sse4(r, grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h01, iz0)), fx0, fy1, fz0),
+				grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h01, iz1)), fx0, fy1, fz1));
+		__m128 n0 = lerp_sse4(t, nx0, nx1);
+
+		nx0 = lerp_sse4(r, grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h10, iz0)), fx1, fy0, fz0),
+				grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h10, iz1)), fx1, fy0, fz1));
+		nx1 = lerp_sse4(r, grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h11, iz0)), fx1, fy1, fz0),
+				grad_3d_sse4(perm_sse4(n, _mm_add_epi32(h11, iz1)), fx1, fy1, fz1));
+		__m128 n1 = lerp_sse4(t, nx0, nx1);
+
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_set1_ps(0.87f), lerp_sse4(s, n0, n1)));
+	}
+	batch_3d_scalar(n, x + i, y + i, z + i, out + i, count - i);
+}
+
+static inline AVX2 __m256
+fade_avx2(__m256 t)
+{
+	__m256 t3 = _mm256_mul_ps(_mm256_mul_ps(t, t), t);
+	__m256 inner = _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6)),
+			_mm256_set1_ps(15))), _mm256_set1_ps(10));
+	return _mm256_mul_ps(t3, inner);
+}
+
+static inline AVX2 __m256
+lerp_avx2(__m256 t, __m256 a, __m256 b)
+{
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+static inline AVX2 __m256i
+perm_avx2(const Noise *n, __m256i index)
+{
+	__m256i word = _mm256_i32gather_epi32((const int *)n->perm, index, 1);
+	return _mm256_and_si256(word, _mm256_set1_epi32(0xff));
+}
+
+static inline AVX2 __m256
+flip_avx2(__m256 v, __m256i h, int bit)
+{
+	__m256i sign = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1 << bit)), 31 - bit);
+	return _mm256_xor_ps(v, _mm256_castsi256_ps(sign));
+}
+
+static inline AVX2 __m256
+lt_avx2(__m256i h, int bound)
+{
+	return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(bound), h));
+}
+
+static inline AVX2 __m256
+grad_2d_avx2(__m256i hash, __m256 x, __m256 y)
+{
+	__m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+	__m256 use_x = _mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)),
+			_mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+	__m256 u = _mm256_blendv_ps(y, x, lt_avx2(h, 8));
+	__m256 v = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_setzero_ps(), x, use_x), y, lt_avx2(h, 4));
+	return _mm256_add_ps(flip_avx2(u, h, 0), flip_avx2(v, h, 1));
+}
+
+static inline AVX2 __m256
+grad_3d_avx2(__m256i hash, __m256 x, __m256 y, __m256 z)
+{
+	__m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(31));
+	__m256 u = _mm256_blendv_ps(y, x, lt_avx2(h, 24));
+	__m256 v = _mm256_blendv_ps(z, y, lt_avx2(h, 16));
+	__m256 w = _mm256_blendv_ps(_mm256_setzero_ps(), z, lt_avx2(h, 8));
+	return _mm256_add_ps(_mm256_add_ps(flip_avx2(u, h, 0), flip_avx2(v, h, 1)), flip_avx2(w, h, 2));
+}
+
+AVX2 void
+batch_2d_avx2(const Noise *n, const float *x, const float *y, float *out, size_t count)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	const __m256 one = _mm256_set1_ps(1);
+	size_t i;
+
+	for(i = 0; i + 8 <= count; i += 8) {
+		__m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i);
+		__m256 flx = _mm256_floor_ps(vx), fly = _mm256_floor_ps(vy);
+		__m256i ix0 = _mm256_cvttps_epi32(flx), iy0 = _mm256_cvttps_epi32(fly);
+		__m256 fx0 = _mm256_sub_ps(vx, flx), fy0 = _mm256_sub_ps(vy, fly);
+		__m256 fx1 = _mm256_sub_ps(fx0, one), fy1 = _mm256_sub_ps(fy0, one);
+		__m256i ix1 = _mm256_and_si256(_mm256_add_epi32(ix0, _mm256_set1_epi32(1)), mask);
+		__m256i iy1 = _mm256_and_si256(_mm256_add_epi32(iy0, _mm256_set1_epi32(1)), mask);
+		ix0 = _mm256_and_si256(ix0, mask);
+		iy0 = _mm256_and_si256(iy0, mask);
+
+		__m256 s = fade_avx2(fx0), t = fade_avx2(fy0);
+		__m256i py0 = perm_avx2(n, iy0), py1 = perm_avx2(n, iy1);
+
+		__m256 n0 = lerp_avx2(t, grad_2d_avx2(perm_avx2(n, _mm256_add_epi32(ix0, py0)), fx0, fy0),
+				grad_2d_avx2(perm_avx2(n, _mm256_add_epi32(ix0, py1)), fx0, fy1));
+		__m256 n1 = lerp_avx2(t, grad_2d_avx2(perm_avx2(n, _mm256_add_epi32(ix1, py0)), fx1, fy0),
+				grad_2d_avx2(perm_avx2(n, _mm256_add_epi32(ix1, py1)), fx1, fy1));
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_set1_ps(0.936f), lerp_avx2(s, n0, n1)));
+	}
+	batch_2d_sse4(n, x + i, y + i, out + i, count - i);
+}
+
+AVX2 void
+batch_3d_avx2(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	const __m256 one = _mm256_set1_ps(1);
+	size_t i;
+
+	for(i = 0; i + 8 <= count; i += 8) {
+		__m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i), vz = _mm256_loadu_ps(z + i);
+		__m256 flx = _mm256_floor_ps(vx), fly = _mm256_floor_ps(vy), flz = _mm256_floor_ps(vz);
+		__m256i ix0 = _mm256_cvttps_epi32(flx), iy0 = _mm256_cvttps_epi32(fly), iz0 = _mm256_cvttps_epi32(flz);
+		__m256 fx0 = _mm256_sub_ps(vx, flx), fy0 = _mm256_sub_ps(vy, fly), fz0 = _mm256_sub_ps(vz, flz);
+		__m256 fx1 = _mm256_sub_ps(fx0, one), fy1 = _mm256_sub_ps(fy0, one), fz1 = _mm256_sub_ps(fz0, one);
+		__m256i ix1 = _mm256_and_si256(_mm256_add_epi32(ix0, _mm256_set1_epi32(1)), mask);
+		__m256i iy1 = _mm256_and_si256(_mm256_add_epi32(iy0, _mm256_set1_epi32(1)), mask);
+		__m256i iz1 = _mm256_and_si256(_mm256_add_epi32(iz0, _mm256_set1_epi32(1)), mask);
+		ix0 = _mm256_and_si256(ix0, mask);
+		iy0 = _mm256_and_si256(iy0, mask);
+		iz0 = _mm256_and_si256(iz0, mask);
+
+		__m256 r = fade_avx2(fz0), t = fade_avx2(fy0), s = fade_avx2(fx0);
+		__m256i py0 = perm_avx2(n, iy0), py1 = perm_avx2(n, iy1);
+		__m256i h00 = perm_avx2(n, _mm256_add_epi32(ix0, py0)), h01 = perm_avx2(n, _mm256_add_epi32(ix0, py1));
+		__m256i h10 = perm_avx2(n, _mm256_add_epi32(ix1, py0)), h11 = perm_avx2(n, _mm256_add_epi32(ix1, py1));
+
+		__m256 nx0 = lerp_avx2(r, grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h00, iz0)), fx0, fy0, fz0),
+				grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h00, iz1)), fx0, fy0, fz1));
+		__m256 nx1 = lerp_avx2(r, grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h01, iz0)), fx0, fy1, fz0),
+				grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h01, iz1)), fx0, fy1, fz1));
+		__m256 n0 = lerp_avx2(t, nx0, nx1);
+
+		nx0 = lerp_avx2(r, grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h10, iz0)), fx1, fy0, fz0),
+				grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h10, iz1)), fx1, fy0, fz1));
+		nx1 = lerp_avx2(r, grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h11, iz0)), fx1, fy1, fz0),
+				grad_3d_avx2(perm_avx2(n, _mm256_add_epi32(h11, iz1)), fx1, fy1, fz1));
+		__m256 n1 = lerp_avx2(t, nx0, nx1);
+
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_set1_ps(0.87f), lerp_avx2(s, n0, n1)));
+	}
+	batch_3d_sse4(n, x + i, y + i, z + i, out + i, count - i);
+}
+
+static inline AVX512 __m512
+fade_avx512(__m512 t)
+{
+	__m512 t3 = _mm512_mul_ps(_mm512_mul_ps(t, t), t);
+	__m512 inner = _mm512_add_ps(_mm512_mul_ps(t, _mm512_sub_ps(_mm512_mul_ps(t, _mm512_set1_ps(6)),
+			_mm512_set1_ps(15))), _mm512_set1_ps(10));
+	return _mm512_mul_ps(t3, inner);
+}
+
+static inline AVX512 __m512
+lerp_avx512(__m512 t, __m512 a, __m512 b)
+{
+	return _mm512_add_ps(a, _mm512_mul_ps(t, _mm512_sub_ps(b, a)));
+}
+
+static inline AVX512 __m512i
+perm_avx512(const Noise *n, __m512i index)
+{
+	__m512i word = _mm512_i32gather_epi32(index, (const void *)n->perm, 1);
+	return _mm512_and_si512(word, _mm512_set1_epi32(0xff));
+}
+
+static inline AVX512 __m512
+flip_avx512(__m512 v, __m512i h, int bit)
+{
+	/* avx512f has no float xor */
+	__m512i sign = _mm512_slli_epi32(_mm512_and_si512(h, _mm512_set1_epi32(1 << bit)), 31 - bit);
+	return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(v), sign));
+}
+
+static inline AVX512 __mmask16
+lt_avx512(__m512i h, int bound)
+{
+	return _mm512_cmplt_epi32_mask(h, _mm512_set1_epi32(bound));
+}
+
+static inline AVX512 __m512
+grad_2d_avx512(__m512i hash, __m512 x, __m512 y)
+{
+	__m512i h = _mm512_and_si512(hash, _mm512_set1_epi32(15));
+	__mmask16 use_x = _mm512_cmpeq_epi32_mask(h, _mm512_set1_epi32(12))
+		| _mm512_cmpeq_epi32_mask(h, _mm512_set1_epi32(14));
+	__m512 u = _mm512_mask_blend_ps(lt_avx512(h, 8), y, x);
+	__m512 v = _mm512_mask_blend_ps(lt_avx512(h, 4), _mm512_maskz_mov_ps(use_x, x), y);
+	return _mm512_add_ps(flip_avx512(u, h, 0), flip_avx512(v, h, 1));
+}
+
+static inline AVX512 __m512
+grad_3d_avx512(__m512i hash, __m512 x, __m512 y, __m512 z)
+{
+	__m512i h = _mm512_and_si512(hash, _mm512_set1_epi32(31));
+	__m512 u = _mm512_mask_blend_ps(lt_avx512(h, 24), y, x);
+	__m512 v = _mm512_mask_blend_ps(lt_avx512(h, 16), z, y);
+	__m512 w = _mm512_maskz_mov_ps(lt_avx512(h, 8), z);
+	return _mm512_add_ps(_mm512_add_ps(flip_avx512(u, h, 0), flip_avx512(v, h, 1)), flip_avx512(w, h, 2));
+}
+
+static inline AVX512 __m512
+floor_avx512(__m512 v)
+{
+	return _mm512_roundscale_ps(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+
+AVX512 void
+batch_2d_avx512(const Noise *n, const float *x, const float *y, float *out, size_t count)
+{
+	const __m512i mask = _mm512_set1_epi32(0xff);
+	const __m512 one = _mm512_set1_ps(1);
+	size_t i;
+
+	for(i = 0; i + 16 <= count; i += 16) {
+		__m512 vx = _mm512_loadu_ps(x + i), vy = _mm512_loadu_ps(y + i);
+		__m512 flx = floor_avx512(vx), fly = floor_avx512(vy);
+		__m512i ix0 = _mm512_cvttps_epi32(flx), iy0 = _mm512_cvttps_epi32(fly);
+		__m512 fx0 = _mm512_sub_ps(vx, flx), fy0 = _mm512_sub_ps(vy, fly);
+		__m512 fx1 = _mm512_sub_ps(fx0, one), fy1 = _mm512_sub_ps(fy0, one);
+		__m512i ix1 = _mm512_and_si512(_mm512_add_epi32(ix0, _mm512_set1_epi32(1)), mask);
+		__m512i iy1 = _mm512_and_si512(_mm512_add_epi32(iy0, _mm512_set1_epi32(1)), mask);
+		ix0 = _mm512_and_si512(ix0, mask);
+		iy0 = _mm512_and_si512(iy0, mask);
+
+		__m512 s = fade_avx512(fx0), t = fade_avx512(fy0);
+		__m512i py0 = perm_avx512(n, iy0), py1 = perm_avx512(n, iy1);
+
+		__m512 n0 = lerp_avx512(t, grad_2d_avx512(perm_avx512(n, _mm512_add_epi32(ix0, py0)), fx0, fy0),
+				grad_2d_avx512(perm_avx512(n, _mm512_add_epi32(ix0, py1)), fx0, fy1));
+		__m512 n1 = lerp_avx512(t, grad_2d_avx512(perm_avx512(n, _mm512_add_epi32(ix1, py0)), fx1, fy0),
+				grad_2d_avx512(perm_avx512(n, _mm512_add_epi32(ix1, py1)), fx1, fy1));
+		_mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_set1_ps(0.936f), lerp_avx512(s, n0, n1)));
+	}
+	batch_2d_avx2(n, x + i, y + i, out + i, count - i);
+}
+
+AVX512 void
+batch_3d_avx512(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+	const __m512i mask = _mm512_set1_epi32(0xff);
+	const __m512 one = _mm512_set1_ps(1);
+	size_t i;
+
+	for(i = 0; i + 16 <= count; i += 16) {
+		__m512 vx = _mm512_loadu_ps(x + i), vy = _mm512_loadu_ps(y + i), vz = _mm512_loadu_ps(z + i);
+		__m512 flx = floor_avx512(vx), fly = floor_avx512(vy), flz = floor_avx512(vz);
+		__m512i ix0 = _mm512_cvttps_epi32(flx), iy0 = _mm512_cvttps_epi32(fly), iz0 = _mm512_cvttps_epi32(flz);
+		__m512 fx0 = _mm512_sub_ps(vx, flx), fy0 = _mm512_sub_ps(vy, fly), fz0 = _mm512_sub_ps(vz, flz);
+		__m512 fx1 = _mm512_sub_ps(fx0, one), fy1 = _mm512_sub_ps(fy0, one), fz1 = _mm512_sub_ps(fz0, one);
+		__m512i ix1 = _mm512_and_si512(_mm512_add_epi32(ix0, _mm512_set1_epi32(1)), mask);
+		__m512i iy1 = _mm512_and_si512(_mm512_add_epi32(iy0, _mm512_set1_epi32(1)), mask);
+		__m512i iz1 = _mm512_and_si512(_mm512_add_epi32(iz0, _mm512_set1_epi32(1)), mask);
+		ix0 = _mm512_and_si512(ix0, mask);
+		iy0 = _mm512_and_si512(iy0, mask);
+		iz0 = _mm512_and_si512(iz0, mask);
+
+		__m512 r = fade_avx512(fz0), t = fade_avx512(fy0), s = fade_avx512(fx0);
+		__m512i py0 = perm_avx512(n, iy0), py1 = perm_avx512(n, iy1);
+		__m512i h00 = perm_avx512(n, _mm512_add_epi32(ix0, py0)), h01 = perm_avx512(n, _mm512_add_epi32(ix0, py1));
+		__m512i h10 = perm_avx512(n, _mm512_add_epi32(ix1, py0)), h11 = perm_avx512(n, _mm512_add_epi32(ix1, py1));
+
+		__m512 nx0 = lerp_avx512(r, grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h00, iz0)), fx0, fy0, fz0),
+				grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h00, iz1)), fx0, fy0, fz1));
+		__m512 nx1 = lerp_avx512(r, grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h01, iz0)), fx0, fy1, fz0),
+				grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h01, iz1)), fx0, fy1, fz1));
+		__m512 n0 = lerp_avx512(t, nx0, nx1);
+
+		nx0 = lerp_avx512(r, grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h10, iz0)), fx1, fy0, fz0),
+				grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h10, iz1)), fx1, fy0, fz1));
+		nx1 = lerp_avx512(r, grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h11, iz0)), fx1, fy1, fz0),
+				grad_3d_avx512(perm_avx512(n, _mm512_add_epi32(h11, iz1)), fx1, fy1, fz1));
+		__m512 n1 = lerp_avx512(t, nx0, nx1);
+
+		_mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_set1_ps(0.87f), lerp_avx512(s, n0, n1)));
+	}
+	batch_3d_avx2(n, x + i, y + i, z + i, out + i, count - i);
+}
+#endif
@@ -0,0 +1,45 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * improved perlin noise over a permutation shuffled from a seed, so a seed
+ * is a different world rather than one more dimension to evaluate.
+ *
+ * the gradients are the ones noise1234 ends up using when the seed is
+ * passed as an integer extra coordinate, the z = 0 slice of its 3D set for
+ * noise_2d() and the w = 0 slice of its 4D set for noise_3d(), scaled the
+ * same, so the values are distributed like before.
+ */
+typedef struct {
+	/* repeated twice, no index needs wrapping, and a word more for the
+	 * vector kernels gathering a whole word at each index */
+	unsigned char perm[512 + 4];
+} Noise;
+
+/* the batch kernels, all give the same results bit for bit */
+typedef enum {
+	NOISE_SCALAR,
+	NOISE_SSE4,
+	NOISE_AVX2,
+	NOISE_AVX512,
+} NoiseIsa;
+
+void  noise_seed(Noise *n, uint32_t seed);
+float noise_2d(const Noise *n, float x, float y);
+float noise_3d(const Noise *n, float x, float y, float z);
+
+/* out[i] is the noise at x[i], y[i] (and z[i]) */
+void noise_2d_batch(const Noise *n, const float *x, const float *y, float *out, size_t count);
+void noise_3d_batch(const Noise *n, const float *x, const float *y, const float *z, float *out, size_t count);
+
+/*
+ * the first noise_seed() picks the best kernels the CPU has, this picks the
+ * best up to isa instead, returning it. not to be called while a batch runs.
+ */
+NoiseIsa    noise_set_isa(NoiseIsa isa);
+const char *noise_isa_name(NoiseIsa isa);
+
+#endif
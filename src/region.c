@@ -0,0 +1,520 @@
+#include "region.h"
+#include "util.h"
+#include "worldgen.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* palette length, a full palette and a run per voxel */
+#define MAX_OPEN_REGIONS 16
+#define RECORD_ALIGN 32
+#define TABLE_OFFSET sizeof(RegionHeader)
+
+#define REGION_OF(C)    ((C) >> (BLOCK_BITS + REGION_BITS))
+#define REGION_INDEX(X, Y, Z) \
+	((((Z) >> BLOCK_BITS & (REGION_SIZE - 1)) << (REGION_BITS * 2)) | \
+	 (((Y) >> BLOCK_BITS & (REGION_SIZE - 1)) << REGION_BITS) | \
+	  ((X) >> BLOCK_BITS & (REGION_SIZE - 1)))
+
+typedef struct {
+	int x, y, z;
+	BlockStorage *blocks;
+} Store;
+
+typedef struct {
+	int x, y, z;
+	int last_use;
+	/* loads and writes going on without the lock, it stays open for them */
+	int users;
+	FileBuffer file;
+	/* where the next record that doesn't fit in place goes */
+	uint32_t end;
+	RegionEntry table[REGION_VOLUME];
+} Region;
+
+static void   *writer(void *arg);
+static Region *get_region(int x, int y, int z, bool create);
+static void    put_region(Region *r);
+static Region *open_region(int rx, int ry, int rz, bool create);
+static void    close_region(Region *r);
+static bool    saves_match(const char *dir);
+static bool    read_header(FileBuffer *file, const char *path);
+static void    write_record(int x, int y, int z, const unsigned char *data, size_t size);
+
+static bool enabled;
+static char *directory;
+
+/*
+ * protects the open regions and their tables, the records are read and
+ * written without it so loads overtake saves in the I/O queue
+ */
+static pthread_mutex_t region_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  region_cond = PTHREAD_COND_INITIALIZER;
+static Region *regions[MAX_OPEN_REGIONS];
+static int use_clock;
+
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  store_cond = PTHREAD_COND_INITIALIZER;
+/* in order, the first one is being written while writing is set */
+static ArrayBuffer store_queue;
+static bool writing, closing;
+static pthread_t writer_thread;
+static size_t loads, stores, bytes_written;
+
+bool
+region_open(const char *dir)
+{
+	region_close();
+	if(!dir)
+		return false;
+	if(mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "can't create save directory %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+	/* mixing them up would leave seams between the old and new terrain */
+	if(!saves_match(dir)) {
+		fprintf(stderr, "not saving to %s\n", dir);
+		return false;
+	}
+
+	directory = emalloc(strlen(dir) + 1);
+	strcpy(directory, dir);
+
+	arrbuf_init(&store_queue);
+	closing = false;
+	writing = false;
+	enabled = true;
+	pthread_create(&writer_thread, NULL, writer, NULL);
+	return true;
+}
+
+void
+region_close()
+{
+	if(!enabled)
+		return;
+
+	pthread_mutex_lock(&store_mutex);
+	closing = true;
+	pthread_mutex_unlock(&store_mutex);
+	pthread_cond_broadcast(&store_cond);
+	pthread_join(writer_thread, NULL);
+	arrbuf_free(&store_queue);
+
+	pthread_mutex_lock(&region_mutex);
+	for(int i = 0; i < MAX_OPEN_REGIONS; i++) {
+		if(!regions[i])
+			continue;
+		while(regions[i]->users)
+			pthread_cond_wait(&region_cond, &region_mutex);
+		close_region(regions[i]);
+		regions[i] = NULL;
+	}
+	pthread_mutex_unlock(&region_mutex);
+
+	efree(directory);
+	directory = NULL;
+	enabled = false;
+}
+
+bool
+region_enabled()
+{
+	return enabled;
+}
+
+void
+region_store(int x, int y, int z, BlockStorage *blocks)
+{
+	pthread_mutex_lock(&store_mutex);
+	Store *queue = store_queue.data;
+	size_t len = arrbuf_length(&store_queue, sizeof(Store));
+
+	/* an older store of the chunk not written yet is just replaced */
+	for(size_t i = writing ? 1 : 0; i < len; i++) {
+		if(queue[i].x == x && queue[i].y == y && queue[i].z == z) {
+			bstore_free(queue[i].blocks);
+			queue[i].blocks = blocks;
+			pthread_mutex_unlock(&store_mutex);
+			return;
+		}
+	}
+	arrbuf_insert(&store_queue, sizeof(Store), &(Store){ .x = x, .y = y, .z = z, .blocks = blocks });
+	stores++;
+	pthread_mutex_unlock(&store_mutex);
+	pthread_cond_signal(&store_cond);
+}
+
+BlockStorage *
+region_load(int x, int y, int z)
+{
+	unsigned char data[REGION_MAX_RECORD];
+	signed char blocks[BSTORE_VOLUME];
+	RegionEntry e = { 0 };
+	bool found = false;
+
+	if(!enabled)
+		return NULL;
+
+	pthread_mutex_lock(&store_mutex);
+	Store *queue = store_queue.data;
+	/* newest first, the one being written may have been stored again */
+	for(size_t i = arrbuf_length(&store_queue, sizeof(Store)); i-- > 0;) {
+		if(queue[i].x == x && queue[i].y == y && queue[i].z == z) {
+			BlockStorage *copy = bstore_compact(queue[i].blocks);
+			loads++;
+			pthread_mutex_unlock(&store_mutex);
+			return copy;
+		}
+	}
+	pthread_mutex_unlock(&store_mutex);
+
+	pthread_mutex_lock(&region_mutex);
+	Region *r = get_region(x, y, z, false);
+	if(r)
+		e = r->table[REGION_INDEX(x, y, z)];
+	pthread_mutex_unlock(&region_mutex);
+	if(!r)
+		return NULL;
+
+	/*
+	 * nothing is writing this record. a chunk is only stored while in
+	 * memory and loaded while it isn't, and its store stays queued, where
+	 * the load found it above, until the record and its entry are written
+	 */
+	if(e.size && fbuf_read_to(&r->file, data, e.size, e.offset) == e.size)
+		found = region_decode(data, e.size, blocks);
+
+	pthread_mutex_lock(&region_mutex);
+	put_region(r);
+	pthread_mutex_unlock(&region_mutex);
+	if(!found)
+		return NULL;
+
+	pthread_mutex_lock(&store_mutex);
+	loads++;
+	pthread_mutex_unlock(&store_mutex);
+	return bstore_encode(blocks);
+}
+
+size_t
+region_encode(const BlockStorage *s, unsigned char *out)
+{
+	signed char blocks[BSTORE_VOLUME];
+	int remap[256];
+	int palette_len = 0;
+	unsigned char *p = out + 1;
+
+	bstore_decode(s, blocks);
+	memset(remap, -1, sizeof(remap));
+	for(int i = 0; i < BSTORE_VOLUME; i++) {
+		unsigned char b = blocks[i];
+		if(remap[b] < 0) {
+			remap[b] = palette_len++;
+			*p++ = b;
+		}
+	}
+	out[0] = palette_len - 1;
+
+	int run_index = -1;
+	unsigned run = 0;
+	for(int y = 0; y < CHUNK_SIZE; y++)
+	for(int z = 0; z < CHUNK_SIZE; z++)
+	for(int x = 0; x < CHUNK_SIZE; x++) {
+		int index = remap[(unsigned char)blocks[BSTORE_INDEX(x, y, z)]];
+		if(index == run_index) {
+			run++;
+			continue;
+		}
+
+		if(run) {
+			*p++ = run_index;
+			for(; run >= 0x80; run >>= 7)
+				*p++ = (run & 0x7F) | 0x80;
+			*p++ = run;
+		}
+		run_index = index;
+		run = 1;
+	}
+	*p++ = run_index;
+	for(; run >= 0x80; run >>= 7)
+		*p++ = (run & 0x7F) | 0x80;
+	*p++ = run;
+
+	return p - out;
+}
+
+bool
+region_decode(const unsigned char *data, size_t size, signed char blocks[BSTORE_VOLUME])
+{
+	const unsigned char *p = data, *end = data + size;
+	int palette_len;
+	int i = 0;
+
+	if(p == end)
+		return false;
+	palette_len = *p++ + 1;
+	if(end - p < palette_len)
+		return false;
+	const unsigned char *palette = p;
+	p += palette_len;
+
+	while(i < BSTORE_VOLUME && p < end) {
+		int index = *p++;
+		unsigned run = 0;
+
+		for(int shift = 0; p < end && shift < 21; shift += 7) {
+			run |= (unsigned)(*p & 0x7F) << shift;
+			if(!(*p++ & 0x80))
+				break;
+		}
+		if(index >= palette_len || run > (unsigned)(BSTORE_VOLUME - i))
+			return false;
+
+		for(; run; run--, i++) {
+			int x = i & BLOCK_MASK;
+			int z = (i >> BLOCK_BITS) & BLOCK_MASK;
+			int y = i >> (BLOCK_BITS * 2);
+			blocks[BSTORE_INDEX(x, y, z)] = palette[index];
+		}
+	}
+	return i == BSTORE_VOLUME;
+}
+
+void
+region_get_stats(RegionStats *stats)
+{
+	pthread_mutex_lock(&store_mutex);
+	stats->loads         = loads;
+	stats->stores        = stores;
+	stats->bytes_written = bytes_written;
+	stats->queued        = enabled ? arrbuf_length(&store_queue, sizeof(Store)) : 0;
+	pthread_mutex_unlock(&store_mutex);
+}
+
+void *
+writer(void *arg)
+{
+	unsigned char data[REGION_MAX_RECORD];
+
+	(void)arg;
+	pthread_mutex_lock(&store_mutex);
+	for(;;) {
+		while(!closing && store_queue.size == 0)
+			pthread_cond_wait(&store_cond, &store_mutex);
+		if(store_queue.size == 0)
+			break;
+
+		/* stays queued while written, so loads still find it */
+		Store s = *(Store *)store_queue.data;
+		writing = true;
+		pthread_mutex_unlock(&store_mutex);
+
+		size_t size = region_encode(s.blocks, data);
+		write_record(s.x, s.y, s.z, data, size);
+
+		pthread_mutex_lock(&store_mutex);
+		bstore_free(((Store *)store_queue.data)->blocks);
+		arrbuf_remove(&store_queue, sizeof(Store), 0);
+		writing = false;
+		bytes_written += size;
+	}
+	pthread_mutex_unlock(&store_mutex);
+	return NULL;
+}
+
+void
+write_record(int x, int y, int z, const unsigned char *data, size_t size)
+{
+	pthread_mutex_lock(&region_mutex);
+	Region *r = get_region(x, y, z, true);
+	if(!r) {
+		pthread_mutex_unlock(&region_mutex);
+		return;
+	}
+
+	/* the space is taken now, the entry only changes once it is written */
+	size_t index = REGION_INDEX(x, y, z);
+	RegionEntry e = r->table[index];
+	if(!e.size || size > e.capacity) {
+		e.offset = r->end;
+		e.capacity = (size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+		r->end += e.capacity;
+	}
+	e.size = size;
+	pthread_mutex_unlock(&region_mutex);
+
+	/* the record goes first, so a table entry never points at garbage */
+	bool written = fbuf_write_at(&r->file, size, data, e.offset) == (int)size
+		&& fbuf_write_at(&r->file, sizeof(e), &e, TABLE_OFFSET + index * sizeof(RegionEntry)) == (int)sizeof(e);
+
+	pthread_mutex_lock(&region_mutex);
+	if(written)
+		r->table[index] = e;
+	else
+		fprintf(stderr, "can't save chunk %d %d %d\n", x, y, z);
+	put_region(r);
+	pthread_mutex_unlock(&region_mutex);
+}
+
+Region *
+get_region(int x, int y, int z, bool create)
+{
+	/* region_mutex is held, the region is the caller's until put_region() */
+	int rx = REGION_OF(x);
+	int ry = REGION_OF(y);
+	int rz = REGION_OF(z);
+	int oldest;
+
+	for(;;) {
+		oldest = -1;
+		for(int i = 0; i < MAX_OPEN_REGIONS; i++) {
+			Region *r = regions[i];
+			if(r && r->x == rx && r->y == ry && r->z == rz) {
+				r->last_use = ++use_clock;
+				r->users++;
+				return r;
+			}
+			/* one in use can't be closed under its user */
+			if(r && r->users)
+				continue;
+			if(oldest < 0 || (regions[oldest] && (!r || r->last_use < regions[oldest]->last_use)))
+				oldest = i;
+		}
+		if(oldest >= 0)
+			break;
+		/* more users than open regions, wait for one to be put back */
+		pthread_cond_wait(&region_cond, &region_mutex);
+	}
+
+	Region *r = open_region(rx, ry, rz, create);
+	if(!r)
+		return NULL;
+	if(regions[oldest])
+		close_region(regions[oldest]);
+	regions[oldest] = r;
+	r->last_use = ++use_clock;
+	r->users = 1;
+	return r;
+}
+
+void
+put_region(Region *r)
+{
+	/* region_mutex is held */
+	if(!--r->users)
+		pthread_cond_broadcast(&region_cond);
+}
+
+Region *
+open_region(int rx, int ry, int rz, bool create)
+{
+	ArrayBuffer path;
+	Region *r = emalloc(sizeof(*r));
+
+	arrbuf_init(&path);
+	arrbuf_printf(&path, "%s/r.%d.%d.%d.reg", directory, rx, ry, rz);
+	r->x = rx;
+	r->y = ry;
+	r->z = rz;
+	r->end = TABLE_OFFSET + sizeof(r->table);
+
+	if(!fbuf_open(&r->file, path.data, "r+b", allocator_default())) {
+		if(!read_header(&r->file, path.data)) {
+			fbuf_close(&r->file);
+			goto fail;
+		}
+		if(fbuf_read_at(&r->file, sizeof(r->table), TABLE_OFFSET) != sizeof(r->table)) {
+			fprintf(stderr, "%s: truncated region table\n", (char *)path.data);
+			fbuf_close(&r->file);
+			goto fail;
+		}
+		memcpy(r->table, fbuf_data(&r->file), sizeof(r->table));
+		for(int i = 0; i < REGION_VOLUME; i++)
+			if(r->table[i].size && r->table[i].offset + r->table[i].capacity > r->end)
+				r->end = r->table[i].offset + r->table[i].capacity;
+	} else if(!create) {
+		goto fail;
+	} else if(!fbuf_open(&r->file, path.data, "w+b", allocator_default())) {
+		RegionHeader header = { .magic = REGION_MAGIC, .generator = wgen_version(), .seed = wgen_seed() };
+
+		memset(r->table, 0, sizeof(r->table));
+		fbuf_write(&r->file, sizeof(header), &header);
+		fbuf_write(&r->file, sizeof(r->table), r->table);
+		if(fbuf_flush(&r->file) != 1) {
+			fbuf_close(&r->file);
+			goto fail;
+		}
+	} else {
+		fprintf(stderr, "can't open region %s\n", (char *)path.data);
+		goto fail;
+	}
+
+	arrbuf_free(&path);
+	return r;
+
+fail:
+	arrbuf_free(&path);
+	efree(r);
+	return NULL;
+}
+
+void
+close_region(Region *r)
+{
+	fbuf_close(&r->file);
+	efree(r);
+}
+
+bool
+saves_match(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	ArrayBuffer path;
+	bool match = true;
+
+	if(!d)
+		return true;
+	arrbuf_init(&path);
+	while(match && (e = readdir(d))) {
+		size_t len = strlen(e->d_name);
+		FileBuffer file;
+
+		if(strncmp(e->d_name, "r.", 2) || len < 4 || strcmp(e->d_name + len - 4, ".reg"))
+			continue;
+		arrbuf_clear(&path);
+		arrbuf_printf(&path, "%s/%s", dir, e->d_name);
+		if(fbuf_open(&file, path.data, "rb", allocator_default()))
+			continue;
+		match = read_header(&file, path.data);
+		fbuf_close(&file);
+	}
+	closedir(d);
+	arrbuf_free(&path);
+	return match;
+}
+
+bool
+read_header(FileBuffer *file, const char *path)
+{
+	RegionHeader header;
+
+	if(fbuf_read_at(file, sizeof(header), 0) != sizeof(header)) {
+		fprintf(stderr, "%s: truncated region header\n", path);
+		return false;
+	}
+	memcpy(&header, fbuf_data(file), sizeof(header));
+	if(header.magic != REGION_MAGIC) {
+		fprintf(stderr, "%s is not a region file\n", path);
+		return false;
+	}
+	if(header.generator != wgen_version() || header.seed != wgen_seed()) {
+		fprintf(stderr, "%s was saved from another seed or generator\n", path);
+		return false;
+	}
+	return true;
+}
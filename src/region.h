@@ -0,0 +1,72 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include "world.h"
+#include "blockstore.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REGION_BITS   5
+#define REGION_SIZE   (1 << REGION_BITS)
+#define REGION_VOLUME (REGION_SIZE * REGION_SIZE * REGION_SIZE)
+/* the most region_encode() writes */
+#define REGION_MAX_RECORD (1 + 256 + BSTORE_VOLUME * 3)
+
+/*
+ * decorated chunks saved to disk, 32^3 chunks per region file.
+ *
+ * a region file starts with a RegionHeader naming the terrain it was saved
+ * from, files of another seed or generator make region_open() refuse the
+ * directory. then comes a table of REGION_VOLUME entries indexed like
+ * blocks, z, y, x, each the offset, size and capacity of a chunk record or
+ * all zero if the chunk was never saved. a record is the palette length, the
+ * palette, then runs of palette index and varint length over the blocks in
+ * y, z, x order, so the horizontal layers terrain is made of become a few
+ * runs. a record rewritten bigger than its capacity moves to the end of the
+ * file and its old space is not reused. everything is in host byte order.
+ *
+ * stores are written back by a writer thread, a chunk loaded while its store
+ * is still queued comes from the queue.
+ */
+#define REGION_MAGIC 0x4E474552
+
+typedef struct {
+	uint32_t magic;
+	/* wgen_version() and wgen_seed() when the file was made */
+	uint32_t generator;
+	uint64_t seed;
+} RegionHeader;
+
+typedef struct {
+	uint32_t offset;
+	uint16_t size;
+	uint16_t capacity;
+} RegionEntry;
+
+typedef struct {
+	size_t loads;
+	size_t stores;
+	size_t bytes_written;
+	int    queued;
+} RegionStats;
+
+/* NULL, a directory that can't be created or one with regions of another
+ * seed or generator, see wgen_seed(), leaves saving disabled */
+bool region_open(const char *directory);
+/* writes everything queued before returning */
+void region_close();
+bool region_enabled();
+
+/* takes ownership of the storage */
+void          region_store(int x, int y, int z, BlockStorage *blocks);
+/* NULL if the chunk was never saved */
+BlockStorage *region_load(int x, int y, int z);
+
+size_t region_encode(const BlockStorage *blocks, unsigned char *out);
+bool   region_decode(const unsigned char *data, size_t size, signed char blocks[BSTORE_VOLUME]);
+
+void region_get_stats(RegionStats *stats);
+
+#endif
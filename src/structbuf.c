@@ -0,0 +1,201 @@
+#include "structbuf.h"
+#include "chunkmap.h"
+#include "util.h"
+
+#include <string.h>
+
+#define INITIAL_SLOTS 256
+
+typedef struct {
+	uint64_t key;
+	int x, y, z;
+	ArrayBuffer blocks;
+} Pending;
+
+static Pending **find_slot(uint64_t key);
+static void      insert_pending(Pending *p);
+static void      remove_pending(Pending *p);
+static int       distance(const Pending *p);
+static int       compare_distance(const void *a, const void *b);
+
+/* open addressing by chunk_coord_key(), grows at half full */
+static Pending **table;
+static size_t table_mask, table_used;
+static StructBufStats stats;
+/* where sbuf_flush() measures from, for compare_distance() */
+static int flush_x, flush_y, flush_z;
+
+void
+sbuf_init()
+{
+	table_mask = INITIAL_SLOTS - 1;
+	table_used = 0;
+	table = emalloc(sizeof(Pending *) * INITIAL_SLOTS);
+	memset(table, 0, sizeof(Pending *) * INITIAL_SLOTS);
+	memset(&stats, 0, sizeof(stats));
+}
+
+void
+sbuf_terminate()
+{
+	/* the chunks they were waiting for never came */
+	for(size_t i = 0; i <= table_mask; i++) {
+		if(!table[i])
+			continue;
+		arrbuf_free(&table[i]->blocks);
+		efree(table[i]);
+	}
+	efree(table);
+	table = NULL;
+}
+
+void
+sbuf_add(const StructureBlock *block)
+{
+	int x = block->x & CHUNK_MASK;
+	int y = block->y & CHUNK_MASK;
+	int z = block->z & CHUNK_MASK;
+	uint64_t key = chunk_coord_key(x, y, z);
+	Pending *p = *find_slot(key);
+
+	if(!p) {
+		p = emalloc(sizeof(*p));
+		p->key = key;
+		p->x = x;
+		p->y = y;
+		p->z = z;
+		arrbuf_init(&p->blocks);
+		insert_pending(p);
+	}
+	arrbuf_insert(&p->blocks, sizeof(StructureBlock), block);
+	stats.blocks++;
+}
+
+bool
+sbuf_take(int x, int y, int z, ArrayBuffer *out)
+{
+	Pending *p = table ? *find_slot(chunk_coord_key(x, y, z)) : NULL;
+
+	if(!p)
+		return false;
+	remove_pending(p);
+	stats.blocks -= arrbuf_length(&p->blocks, sizeof(StructureBlock));
+	arrbuf_free(out);
+	*out = p->blocks;
+	efree(p);
+	return true;
+}
+
+void
+sbuf_flush(int x, int y, int z, int radius, size_t max,
+           bool (*flush)(int x, int y, int z, const StructureBlock *blocks, size_t count))
+{
+	Pending **list;
+	size_t count = 0;
+
+	if(!table_used)
+		return;
+	list = emalloc(sizeof(Pending *) * table_used);
+	for(size_t i = 0; i <= table_mask; i++)
+		if(table[i])
+			list[count++] = table[i];
+	flush_x = x;
+	flush_y = y;
+	flush_z = z;
+	qsort(list, count, sizeof(Pending *), compare_distance);
+
+	for(size_t i = 0; i < count; i++) {
+		Pending *p = list[i];
+		bool out = distance(p) > radius;
+		size_t blocks = arrbuf_length(&p->blocks, sizeof(StructureBlock));
+
+		/* farthest first, the rest are closer and in */
+		if(!out && stats.blocks <= max)
+			break;
+		if(!flush(p->x, p->y, p->z, p->blocks.data, blocks))
+			continue;
+		remove_pending(p);
+		stats.blocks -= blocks;
+		stats.flushed++;
+		arrbuf_free(&p->blocks);
+		efree(p);
+	}
+	efree(list);
+}
+
+void
+sbuf_get_stats(StructBufStats *out)
+{
+	*out = stats;
+}
+
+Pending **
+find_slot(uint64_t key)
+{
+	size_t i;
+
+	for(i = hash_int64(key) & table_mask; table[i]; i = (i + 1) & table_mask)
+		if(table[i]->key == key)
+			break;
+	return &table[i];
+}
+
+void
+insert_pending(Pending *p)
+{
+	/* p is not in the table */
+	if((table_used + 1) * 2 > table_mask + 1) {
+		Pending **old = table;
+		size_t old_len = table_mask + 1;
+
+		table_mask = old_len * 2 - 1;
+		table = emalloc(sizeof(Pending *) * (table_mask + 1));
+		memset(table, 0, sizeof(Pending *) * (table_mask + 1));
+		for(size_t i = 0; i < old_len; i++)
+			if(old[i])
+				*find_slot(old[i]->key) = old[i];
+		efree(old);
+	}
+	*find_slot(p->key) = p;
+	table_used++;
+	stats.chunks++;
+}
+
+void
+remove_pending(Pending *p)
+{
+	size_t i = find_slot(p->key) - table;
+
+	/* linear probing, shift back the entries that probed past the hole */
+	for(size_t j = (i + 1) & table_mask; table[j]; j = (j + 1) & table_mask) {
+		size_t home = hash_int64(table[j]->key) & table_mask;
+		bool between = i <= j ? i < home && home <= j : i < home || home <= j;
+		if(between)
+			continue;
+		table[i] = table[j];
+		i = j;
+	}
+	table[i] = NULL;
+	table_used--;
+	stats.chunks--;
+}
+
+int
+distance(const Pending *p)
+{
+	/* along the farthest axis, the border is a cube */
+	int dx = abs(p->x - flush_x);
+	int dy = abs(p->y - flush_y);
+	int dz = abs(p->z - flush_z);
+
+	return dx > dy ? (dx > dz ? dx : dz) : (dy > dz ? dy : dz);
+}
+
+int
+compare_distance(const void *a, const void *b)
+{
+	int da = distance(*(Pending **)a);
+	int db = distance(*(Pending **)b);
+
+	return db < da ? -1 : db > da;
+}
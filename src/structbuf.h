@@ -0,0 +1,41 @@
+#ifndef STRUCTBUF_H
+#define STRUCTBUF_H
+
+#include "world.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * the structure blocks waiting for a chunk that isn't decorating yet, see
+ * world_place_structure(), kept by chunk until it decorates or is loaded,
+ * or until sbuf_flush() hands them over to go in its save instead.
+ * not locked, the world only touches it under its structure lock.
+ */
+typedef struct {
+	size_t chunks;
+	size_t blocks;
+	/* chunks whose blocks were handed to a flush */
+	size_t flushed;
+} StructBufStats;
+
+void sbuf_init();
+void sbuf_terminate();
+
+void sbuf_add(const StructureBlock *block);
+/* moves the blocks waiting for the chunk at x, y, z to an initialized out,
+ * which is the caller's to free. false if there were none */
+bool sbuf_take(int x, int y, int z, ArrayBuffer *out);
+/*
+ * hands the blocks of every chunk farther than radius from x, y, z to
+ * flush, then those of the farthest left while there are more than max
+ * blocks. the ones flush() takes are dropped, it returns false to keep
+ * them, as when the chunk is in memory and will take them itself
+ */
+void sbuf_flush(int x, int y, int z, int radius, size_t max,
+                bool (*flush)(int x, int y, int z, const StructureBlock *blocks, size_t count));
+
+void sbuf_get_stats(StructBufStats *stats);
+
+#endif
@@ -5,8 +5,13 @@
 #include <ctype.h>
 #include <assert.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.h"
+#include "ioqueue.h"
 
 #define UTF8_TWO_BYTES 0xC0
 #define UTF8_THREE_BYTES 0xE0
@@ -56,6 +61,33 @@ static void new_obj_page(ObjectPool *pool)
 	}
 }
 
+static void new_slab(SlabPool *pool)
+{
+	void *slab = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if(pool->huge_pages)
+		slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if(slab == MAP_FAILED) {
+		/* no reserved huge pages, transparent ones are the next best thing */
+		slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(slab == MAP_FAILED)
+			die("cannot map a %zu bytes slab\n", pool->slab_size);
+#ifdef MADV_HUGEPAGE
+		if(pool->huge_pages)
+			madvise(slab, pool->slab_size, MADV_HUGEPAGE);
+#endif
+	}
+	arrbuf_insert(&pool->slabs, sizeof(void*), &slab);
+
+	size_t count = pool->slab_size / pool->obj_size;
+	for(size_t i = count; i > 0; i--) {
+		void *object = (unsigned char*)slab + (i - 1) * pool->obj_size;
+		arrbuf_insert(&pool->free_stack, sizeof(void*), &object);
+	}
+}
+
 static void insert_obj_node(ObjectPool *pool, void *data)
 {
 	ObjectNode *node = data_to_node(data);
@@ -250,6 +282,7 @@ fbuf_open(FileBuffer *buffer, const char *path, const char *mode, Allocator allo
 	if(!buffer->file_handle)
 		return 1;
 	arrbuf_init_allocator(&buffer->data_buffer, alloc);
+	buffer->dirty = false;
 	return 0;
 }
 
@@ -259,28 +292,79 @@ fbuf_read(FileBuffer *buffer, size_t size)
 	void *ptr;
 	int count;
 
+	if(buffer->dirty)
+		fbuf_flush(buffer);
 	arrbuf_clear(&buffer->data_buffer);
 	ptr = arrbuf_newptr(&buffer->data_buffer, size);
 	
 	count = fread(ptr, 1, size, buffer->file_handle);
+	buffer->data_buffer.size = count;
 	return count;
 }
 
+int
+fbuf_read_at(FileBuffer *buffer, size_t size, long offset)
+{
+	void *ptr;
+	ssize_t count;
+
+	if(buffer->dirty)
+		fbuf_flush(buffer);
+	arrbuf_clear(&buffer->data_buffer);
+	ptr = arrbuf_newptr(&buffer->data_buffer, size);
+
+	count = ioq_pread(fileno(buffer->file_handle), ptr, size, offset, IOQ_HIGH);
+	buffer->data_buffer.size = count > 0 ? count : 0;
+	return count;
+}
+
+int
+fbuf_read_to(FileBuffer *buffer, void *ptr, size_t size, long offset)
+{
+	return ioq_pread(fileno(buffer->file_handle), ptr, size, offset, IOQ_HIGH);
+}
+
+int
+fbuf_write_at(FileBuffer *buffer, size_t size, const void *ptr, long offset)
+{
+	/* what was written through stdio goes first */
+	if(fbuf_flush(buffer) != 1)
+		return -1;
+	return ioq_pwrite(fileno(buffer->file_handle), ptr, size, offset, IOQ_LOW);
+}
+
 int
 fbuf_write(FileBuffer *buffer, size_t size, void *ptr)
 {
-	arrbuf_insert(buffer->data_buffer.data, size, ptr);
+	if(!buffer->dirty)
+		arrbuf_clear(&buffer->data_buffer);
+	arrbuf_insert(&buffer->data_buffer, size, ptr);
+	buffer->dirty = true;
 	return 0;
 }
 
 int
 fbuf_flush(FileBuffer *buffer)
 {
-	int count = fwrite(buffer->data_buffer.data, buffer->data_buffer.size, 1, buffer->file_handle);
+	int count = 1;
+
+	/* data that was read is just dropped */
+	if(buffer->dirty && buffer->data_buffer.size > 0)
+		count = fwrite(buffer->data_buffer.data, buffer->data_buffer.size, 1, buffer->file_handle);
 	fflush(buffer->file_handle);
+	arrbuf_clear(&buffer->data_buffer);
+	buffer->dirty = false;
 	return count;
 }
 
+int
+fbuf_seek(FileBuffer *buffer, long offset)
+{
+	if(fbuf_flush(buffer) != 1)
+		return 1;
+	return fseek(buffer->file_handle, offset, SEEK_SET) != 0;
+}
+
 char *
 fbuf_data(FileBuffer *buffer)
 {
@@ -297,6 +381,8 @@ int
 fbuf_read_line(FileBuffer *buffer, int delim)
 {
 	int c;
+	if(buffer->dirty)
+		fbuf_flush(buffer);
 	arrbuf_clear(&buffer->data_buffer);
 	while((c = fgetc(buffer->file_handle)) != EOF) {
 		if(c == delim) {
@@ -494,18 +580,25 @@ char *
 read_file(const char *path, size_t *s)
 {
 	char *result;
-	size_t size;
-	FILE *fp = fopen(path, "r");
-	if(!fp)
+	struct stat st;
+	ssize_t size;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
 		return NULL;
 
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	if(fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
 
-	result = malloc(size);
-	(void)!fread(result, 1, size, fp);
-	fclose(fp);
+	result = malloc(st.st_size + 1);
+	size = ioq_pread(fd, result, st.st_size, 0, IOQ_NORMAL);
+	close(fd);
+	if(size < 0) {
+		free(result);
+		return NULL;
+	}
+	result[size] = 0;
 
 	if(s)
 		*s = size;
@@ -649,6 +742,54 @@ objpool_is_dead(void *object_ptr)
 	return data_to_node(object_ptr)->dead;
 }
 
+void
+slab_init(SlabPool *pool, size_t object_size, size_t slab_size, bool huge_pages)
+{
+	arrbuf_init(&pool->slabs);
+	arrbuf_init(&pool->free_stack);
+	pool->obj_size   = align_memory(object_size, DEFAULT_ALIGNMENT);
+	pool->slab_size  = slab_size;
+	pool->live       = 0;
+	pool->huge_pages = huge_pages;
+}
+
+void
+slab_terminate(SlabPool *pool)
+{
+	Span span = arrbuf_span(&pool->slabs);
+	SPAN_FOR(span, slab, void*) {
+		munmap(*slab, pool->slab_size);
+	}
+	arrbuf_free(&pool->slabs);
+	arrbuf_free(&pool->free_stack);
+}
+
+void *
+slab_alloc(SlabPool *pool)
+{
+	void **object = arrbuf_peektop(&pool->free_stack, sizeof(void*));
+	if(!object) {
+		new_slab(pool);
+		object = arrbuf_peektop(&pool->free_stack, sizeof(void*));
+	}
+	arrbuf_poptop(&pool->free_stack, sizeof(void*));
+	pool->live++;
+	return *object;
+}
+
+void
+slab_free(SlabPool *pool, void *object_ptr)
+{
+	arrbuf_insert(&pool->free_stack, sizeof(void*), &object_ptr);
+	pool->live--;
+}
+
+size_t
+slab_reserved_bytes(SlabPool *pool)
+{
+	return arrbuf_length(&pool->slabs, sizeof(void*)) * pool->slab_size;
+}
+
 void *
 alloct_allocate(Allocator *a, size_t s)
 {
@@ -13,6 +13,7 @@ typedef struct ArrayBuffer ArrayBuffer;
 typedef struct StrView StrView;
 typedef struct Span Span;
 typedef struct ObjectPool ObjectPool;
+typedef struct SlabPool SlabPool;
 typedef struct RelPtr RelPtr;
 typedef struct Allocator Allocator;
 typedef struct FileBuffer FileBuffer;
@@ -67,9 +68,20 @@ struct ObjectPool {
 	void (*clean_cbk)(ObjectPool *, void*);
 };
 
+struct SlabPool {
+	ArrayBuffer slabs;
+	ArrayBuffer free_stack;
+	size_t obj_size;
+	size_t slab_size;
+	size_t live;
+	bool huge_pages;
+};
+
 struct FileBuffer {
 	void *file_handle;
 	ArrayBuffer data_buffer;
+	/* data_buffer holds writes not flushed yet rather than what was read */
+	bool dirty;
 };
 
 struct Span {
@@ -130,7 +142,13 @@ void *arrbuf_newptr_at(ArrayBuffer *buffer, size_t element_size, size_t pos);
 int   fbuf_open(FileBuffer *buffer, const char *path, const char *mode, Allocator alloc);
 int   fbuf_read(FileBuffer *buffer, size_t size);
 int   fbuf_write(FileBuffer *buffer, size_t size, void *ptr);
+/* positional and through the I/O queue, the stream position is left alone */
+int   fbuf_read_at(FileBuffer *buffer, size_t size, long offset);
+/* the same into ptr, the buffer is left alone so threads can share the file */
+int   fbuf_read_to(FileBuffer *buffer, void *ptr, size_t size, long offset);
+int   fbuf_write_at(FileBuffer *buffer, size_t size, const void *ptr, long offset);
 int   fbuf_flush(FileBuffer *buffer);
+int   fbuf_seek(FileBuffer *buffer, long offset);
 void  fbuf_close(FileBuffer *buffer);
 char *fbuf_data(FileBuffer *buffer);
 int   fbuf_data_size(FileBuffer *buffer);
@@ -171,6 +189,18 @@ void *objpool_new(ObjectPool *pool);
 void  objpool_free(void *object_ptr);
 bool  objpool_is_dead(void *object_ptr);
 
+/*
+ * fixed size objects carved out of big mmap'ed slabs, memory is never given
+ * back to the system until slab_terminate() and freeing does not touch the
+ * object, so a stale pointer still reads whatever was left there.
+ * not thread safe.
+ */
+void   slab_init(SlabPool *pool, size_t object_size, size_t slab_size, bool huge_pages);
+void   slab_terminate(SlabPool *pool);
+void  *slab_alloc(SlabPool *pool);
+void   slab_free(SlabPool *pool, void *object_ptr);
+size_t slab_reserved_bytes(SlabPool *pool);
+
 Allocator allocator_default(void);
 
 void *alloct_allocate(Allocator *, size_t size);
@@ -226,6 +256,15 @@ static inline uint32_t hash_int3(uint32_t x, uint32_t y, uint32_t z) {
 	return h;
 }
 
+static inline uint64_t hash_int64(uint64_t i) {
+	i ^= i >> 33;
+	i *= UINT64_C(0xff51afd7ed558ccd);
+	i ^= i >> 33;
+	i *= UINT64_C(0xc4ceb9fe1a85ec53);
+	i ^= i >> 33;
+	return i;
+}
+
 #define DEFAULT_ALIGNMENT (sizeof(void*))
 
 #endif
@@ -1,32 +1,137 @@
-#include "glutil.h"
 #include "util.h"
 #include "world.h"
-#include "chunk_renderer.h"
+#include "chunkmap.h"
+#include "blockstore.h"
+#include "region.h"
+#include "journal.h"
+#include "mapstore.h"
+#include "chunkcache.h"
+#include "structbuf.h"
+#include "ioqueue.h"
 #include "worldgen.h"
 
 #include <assert.h>
 #include <math.h>
-#include <GL/glew.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <limits.h>
+#include <string.h>
+#include <time.h>
 
 typedef struct {
 	int x, y, z;
 	ChunkState state;
+	/* squared distance to the border center, smallest is loaded first */
+	long priority;
 } Work;
 
+typedef struct {
+	int x, y, z;
+} ChunkCoord;
+
+/* the blocks of a chunk freed, for the warm tier once chunk_mutex is let go */
+typedef struct {
+	int x, y, z;
+	bool dirty;
+	/* NULL when there is nothing to keep */
+	BlockStorage *blocks;
+} FreedChunk;
+
+struct ChunkScratch {
+	short density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	ChunkScratch *next_free;
+};
+
 #define MAX_BLOCKS 512
 #define CHUNK_MAX_BLOCKS (MAX_BLOCKS / CHUNK_SIZE)
 #define MAX_CHUNKS (CHUNK_MAX_BLOCKS * CHUNK_MAX_BLOCKS * CHUNK_MAX_BLOCKS)
 
+#define SLAB_SIZE (2 << 20)
+#define DEFAULT_MEMORY_BUDGET ((size_t)256 << 20)
+#define DEFAULT_WARM_BUDGET   ((size_t)32 << 20)
+/* how far from the LRU tail an eviction looks for a chunk out of the border */
+#define EVICT_SCAN 64
+/* structure blocks kept for chunks not in memory before they go in saves,
+ * about a megabyte */
+#define MAX_PENDING_BLOCKS (1 << 16)
+
+#define LOAD_WORKERS 4
+/* the most chunks of a column a worker shapes in one go */
+#define SHAPE_COLUMN 4
+/* condition variables shared by the chunks waited on, see world_wait_chunk() */
+#define WAIT_STRIPES 64
+
+#define IS_GENERATING(STATE) \
+	((STATE) == CSTATE_SHAPING || (STATE) == CSTATE_SURFACING || (STATE) == CSTATE_DECORATING)
+
 static volatile Chunk *find_chunk(int x, int y, int z, ChunkState state);
-static volatile Chunk *chunk_gen(int x, int y, int z, ChunkState state);
+static void run_stage(volatile Chunk *c, ChunkState queued);
+static bool install_saved(volatile Chunk *c);
+static int  claim_column(volatile Chunk *c, volatile Chunk **column);
+static void shape_column(volatile Chunk **column, int count);
+static void request_state(volatile Chunk *c, ChunkState target);
+static void try_schedule(volatile Chunk *c);
+static bool require_shaped(int x, int y, int z);
+static void schedule_dependents(int x, int y, int z);
 static volatile Chunk *allocate_chunk(int x, int y, int z);
 
-static void insert_chunk(Chunk *c);
-static void remove_chunk(Chunk *c);
+static bool claim_state(volatile Chunk *c, ChunkState from, ChunkState to);
+static void publish_state(volatile Chunk *c, ChunkState state);
+static void notify_chunk(volatile Chunk *c);
+static void notify_all();
+
+static void *load_worker(void *arg);
+static void  load_push(Work *w);
+static bool  load_pop(Work *w);
+static void  load_sift_up(Work *heap, size_t i);
+static void  load_sift_down(Work *heap, size_t len, size_t i);
+static void  load_reprioritize();
+static long  load_priority(int x, int y, int z);
+
+static void lru_push(Chunk *c);
+static void lru_unlink(Chunk *c);
+static void touch_chunk(volatile Chunk *c);
+static bool evict_chunk(FreedChunk *freed);
+static void free_chunk(Chunk *c, FreedChunk *freed);
+static void keep_freed(FreedChunk *freed);
+static size_t memory_usage();
+static void compact_chunk(volatile Chunk *c);
+static BlockStorage *load_saved(int x, int y, int z, bool *dirty);
+static void          begin_saving(int x, int y, int z);
+static bool          is_saving(int x, int y, int z);
+static void          end_saving(int x, int y, int z);
+static void          wait_saved(int x, int y, int z);
+static void          spill_chunk(int x, int y, int z, BlockStorage *blocks);
+static Block raycast_block(RaycastWorld *rw);
+
+static volatile Chunk *cursor_chunk(BlockCursor *cur, int x, int y, int z);
+static volatile Chunk *pin_chunk(int x, int y, int z, ChunkState state);
+static void            unpin_chunk(volatile Chunk *c);
+static Block           chunk_get_block(volatile Chunk *ch, int x, int y, int z);
+static void            chunk_set_block(volatile Chunk *ch, int x, int y, int z, Block block);
+static bool            chunk_place_block(volatile Chunk *ch, const StructureBlock *b);
+static void            chunk_store_block(volatile Chunk *ch, int index, Block block);
+static BlockStorage   *chunk_swap_blocks(volatile Chunk *ch, BlockStorage *s);
+static float           chunk_get_density(volatile Chunk *ch, int x, int y, int z);
+static void            chunk_copy_box(volatile Chunk *ch, int x0, int y0, int z0, int x1, int y1, int z1,
+                                      signed char *out, int w, int h);
+static void            chunk_set_density(volatile Chunk *ch, int x, int y, int z, float r);
+static short pack_density(float r);
+
+static ChunkScratch *scratch_alloc();
+static void          scratch_free(ChunkScratch *s);
+static ChunkScratch *chunk_scratch(volatile Chunk *c);
+static void          release_scratch_around(int x, int y, int z);
+static bool          density_read(int x, int y, int z);
+
+static uint64_t stage_clock();
+
+static void take_pending(int x, int y, int z);
+static bool flush_saved(int x, int y, int z, const StructureBlock *blocks, size_t count);
+static void place_blocks(volatile Chunk *c, const StructureBlock *blocks, size_t count);
+static bool structure_replaces(const StructureBlock *b, Block current);
+static int  compare_structure_blocks(const void *a, const void *b);
 
 static BlockProperties bprop[] = {
 	[BLOCK_NULL]  = { .is_transparent = true, .is_ghost = true, .replaceable = true},
@@ -34,139 +139,753 @@ static BlockProperties bprop[] = {
 	[BLOCK_WATER] = { .is_transparent = true }, 
 	[BLOCK_GRASS_BLADES] = {
 		.is_transparent = true, 
-		.is_ghost = true
+		.is_ghost = true,
+		.structure_rank = 3
 	},
 	[BLOCK_ROSE] = {
 		.is_transparent = true,
 		.is_ghost = true,
 		.replaceable = true,	
+		.structure_rank = 1
 	},
+	[BLOCK_WOOD] = { .structure_rank = 4 },
 	[BLOCK_LEAVES] = {
 		.is_transparent = true,
-		.replaceable = true
+		.replaceable = true,
+		.structure_rank = 2
 	}
 };
 
 static int running;
 
-static Chunk *chunkmap[0x10000];
-static Chunk *chunks;
+static ChunkMap chunkmap;
 static int cx, cy, cz, cradius;
 static pthread_mutex_t chunk_mutex;
 
-static Chunk *chunks, *last_chunk;
+/* most recently touched first, protected by chunk_mutex */
+static Chunk *lru_head, *lru_tail;
+static SlabPool chunk_slab;
 static volatile int chunk_count;
+static atomic_int border_epoch;
+static size_t memory_budget;
+static size_t evictions, budget_overruns;
+/* ChunkCoord of the chunks out of memory whose saves are being rewritten,
+ * protected by chunk_mutex. loading one waits for its save to be done */
+static ArrayBuffer saving;
+static pthread_cond_t saved_cond;
+
+/* every *ING transition and pin, so eviction never frees a chunk in use */
+static pthread_mutex_t state_mutex;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+} wait_stripes[WAIT_STRIPES];
+
+/*
+ * binary min heap of Work by priority, the lock also protects the target and
+ * scheduled fields of every chunk
+ */
+static pthread_mutex_t load_mutex;
+static pthread_cond_t  load_cond;
+static ArrayBuffer load_queue;
+static int load_epoch;
+static pthread_t load_workers[LOAD_WORKERS];
+static void (*load_callback)(int x, int y, int z);
+
+/*
+ * taken to place structure blocks and to take a chunk from decorating to
+ * decorated, so a block either waits for the chunk or lands in it with the
+ * chunk knowing whether the journal went over it already
+ */
+static pthread_mutex_t structure_mutex;
+/* the border the pending blocks were last flushed for */
+static int pending_epoch;
+static void (*change_callback)(int x, int y, int z);
+
+/* chunks through each generator stage and the nanoseconds of worker CPU
+ * time they took, summed */
+static atomic_size_t shape_count, surface_count, decorate_count;
+static atomic_size_t shape_ns, surface_ns, decorate_ns;
+/* chunks in memory on a shared uniform storage, see chunk_swap_blocks() */
+static atomic_int uniform_chunks;
+
+static pthread_mutex_t scratch_mutex;
+static SlabPool scratch_slab;
+static ChunkScratch *scratch_pool;
+static int scratch_count, scratch_pooled;
 
 void
 world_init()
 {
 	running = true;
 
-	chunks = NULL;
-	memset(chunkmap, 0, sizeof(chunkmap));
+	lru_head = lru_tail = NULL;
+	chunk_count = 0;
+	evictions = budget_overruns = 0;
+	shape_count = surface_count = decorate_count = 0;
+	shape_ns = surface_ns = decorate_ns = 0;
+	uniform_chunks = 0;
+	/* the pool of a previous world went with its slabs */
+	scratch_pool = NULL;
+	scratch_count = scratch_pooled = 0;
+	memory_budget = DEFAULT_MEMORY_BUDGET;
+	ccache_init(DEFAULT_WARM_BUDGET, spill_chunk);
+	chunkmap_init(&chunkmap, MAX_CHUNKS * 2);
+	slab_init(&chunk_slab, sizeof(Chunk), SLAB_SIZE, false);
+	slab_init(&scratch_slab, sizeof(ChunkScratch), SLAB_SIZE, false);
 	pthread_mutex_init(&chunk_mutex, NULL);
+	pthread_cond_init(&saved_cond, NULL);
+	arrbuf_init(&saving);
+	pthread_mutex_init(&scratch_mutex, NULL);
+	pthread_mutex_init(&state_mutex, NULL);
+	pthread_mutex_init(&structure_mutex, NULL);
+	sbuf_init();
+	pending_epoch = atomic_load(&border_epoch);
+	for(int i = 0; i < WAIT_STRIPES; i++) {
+		pthread_mutex_init(&wait_stripes[i].mutex, NULL);
+		pthread_cond_init(&wait_stripes[i].cond, NULL);
+	}
+
+	arrbuf_init(&load_queue);
+	pthread_mutex_init(&load_mutex, NULL);
+	pthread_cond_init(&load_cond, NULL);
+	for(int i = 0; i < LOAD_WORKERS; i++)
+		pthread_create(&load_workers[i], NULL, load_worker, NULL);
 }
 
 void
 world_terminate()
 {
+	pthread_mutex_lock(&load_mutex);
 	running = false;
-	free(chunks);
+	pthread_mutex_unlock(&load_mutex);
+	pthread_cond_broadcast(&load_cond);
+	notify_all();
+	for(int i = 0; i < LOAD_WORKERS; i++)
+		pthread_join(load_workers[i], NULL);
+	arrbuf_free(&load_queue);
+
+	while(lru_head) {
+		FreedChunk freed;
+		free_chunk(lru_head, &freed);
+		keep_freed(&freed);
+	}
+	/* what still waits goes in the saves of its chunks with the rest */
+	pthread_mutex_lock(&structure_mutex);
+	sbuf_flush(cx, cy, cz, -1, 0, flush_saved);
+	pthread_mutex_unlock(&structure_mutex);
+	/* after the chunks, their saves are written before it returns */
+	ccache_terminate();
+	region_close();
+	journal_close();
+	mapstore_close();
+	ioq_terminate();
+	sbuf_terminate();
+	arrbuf_free(&saving);
+	chunkmap_terminate(&chunkmap);
+	slab_terminate(&chunk_slab);
+	slab_terminate(&scratch_slab);
 }
 
-Block
-world_get_block(int x, int y, int z)
+void
+world_enqueue_load(int x, int y, int z)
+{
+	x &= CHUNK_MASK;
+	y &= CHUNK_MASK;
+	z &= CHUNK_MASK;
+
+	if(!world_can_load(x, y, z))
+		return;
+
+	volatile Chunk *c = find_chunk(x, y, z, 0);
+	if(!c)
+		c = allocate_chunk(x, y, z);
+	if(atomic_load_explicit(&c->state, memory_order_acquire) == CSTATE_DECORATED)
+		return;
+
+	pthread_mutex_lock(&load_mutex);
+	request_state(c, CSTATE_DECORATED);
+	pthread_mutex_unlock(&load_mutex);
+}
+
+bool
+world_wait_chunk(int x, int y, int z, ChunkState state)
 {
-	return world_get(x, y, z, CSTATE_DECORATED);
+	x &= CHUNK_MASK;
+	y &= CHUNK_MASK;
+	z &= CHUNK_MASK;
+
+	for(;;) {
+		if(!running || !world_can_load(x, y, z))
+			return false;
+
+		volatile Chunk *c = find_chunk(x, y, z, 0);
+		if(c && atomic_load_explicit(&c->state, memory_order_acquire) >= state)
+			return true;
+		world_enqueue_load(x, y, z);
+		if(!(c = find_chunk(x, y, z, 0)))
+			continue;
+
+		/*
+		 * the waiter count goes up before the state is checked again, and
+		 * publish_state() stores the state before looking at the count, so
+		 * either we see the new state or the publisher sees us waiting
+		 */
+		size_t stripe = ((uintptr_t)c / sizeof(Chunk)) % WAIT_STRIPES;
+		pthread_mutex_lock(&wait_stripes[stripe].mutex);
+		atomic_fetch_add(&c->waiters, 1);
+		while(running && !c->free && world_can_load(x, y, z)
+				&& c->x == x && c->y == y && c->z == z
+				&& atomic_load(&c->state) < state)
+			pthread_cond_wait(&wait_stripes[stripe].cond, &wait_stripes[stripe].mutex);
+		atomic_fetch_sub(&c->waiters, 1);
+		pthread_mutex_unlock(&wait_stripes[stripe].mutex);
+	}
 }
 
 void
-world_set_block(int x, int y, int z, Block block)
+world_enqueue_unload(int x, int y, int z)
+{
+	x &= CHUNK_MASK;
+	y &= CHUNK_MASK;
+	z &= CHUNK_MASK;
+
+	pthread_mutex_lock(&load_mutex);
+	Work *heap = load_queue.data;
+	size_t len = arrbuf_length(&load_queue, sizeof(Work));
+	for(size_t i = 0; i < len; i++) {
+		if(heap[i].x != x || heap[i].y != y || heap[i].z != z)
+			continue;
+		heap[i] = heap[--len];
+		arrbuf_poptop(&load_queue, sizeof(Work));
+		if(i < len) {
+			load_sift_down(heap, len, i);
+			load_sift_up(heap, i);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&load_mutex);
+
+	FreedChunk freed = { .blocks = NULL };
+	pthread_mutex_lock(&chunk_mutex);
+	Chunk *c = chunkmap_find(&chunkmap, x, y, z);
+	if(c && !c->free) {
+		/* a chunk being generated is left for the LRU to pick up later */
+		pthread_mutex_lock(&state_mutex);
+		bool idle = !IS_GENERATING(c->state) && !c->pins;
+		if(idle)
+			c->free = true;
+		pthread_mutex_unlock(&state_mutex);
+		if(idle)
+			free_chunk(c, &freed);
+	}
+	pthread_mutex_unlock(&chunk_mutex);
+	keep_freed(&freed);
+}
+
+void
+world_set_load_callback(void (*callback)(int x, int y, int z))
+{
+	load_callback = callback;
+}
+
+void
+world_set_change_callback(void (*callback)(int x, int y, int z))
 {
-	world_set(x, y, z, CSTATE_ALLOCATED, block);
+	change_callback = callback;
 }
 
 Block
-world_get(int x, int y, int z, ChunkState state)
+world_get_block(int x, int y, int z)
+{
+	/* pinned, eviction frees the storage of a chunk right away */
+	volatile Chunk *ch = pin_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, CSTATE_DECORATED);
+	if(!ch) {
+		world_enqueue_load(x, y, z);
+		return BLOCK_UNLOADED;
+	}
+	Block b = chunk_get_block(ch, x, y, z);
+	unpin_chunk(ch);
+	return b;
+}
+
+bool
+world_chunk_state(int x, int y, int z, ChunkState *state)
 {
 	int chunk_x = x & CHUNK_MASK;
 	int chunk_y = y & CHUNK_MASK;
 	int chunk_z = z & CHUNK_MASK;
+	volatile Chunk *c = find_chunk(chunk_x, chunk_y, chunk_z, CSTATE_FREE);
+	bool found = false;
+
+	if(!c)
+		return false;
+	/* not pinned, nor touched, just still the same chunk under the lock
+	 * eviction frees it under */
+	pthread_mutex_lock(&state_mutex);
+	if(!c->free && c->x == chunk_x && c->y == chunk_y && c->z == chunk_z) {
+		*state = atomic_load_explicit(&c->state, memory_order_acquire);
+		found = true;
+	}
+	pthread_mutex_unlock(&state_mutex);
+	return found;
+}
+
+bool
+world_chunk_uniform(int x, int y, int z, Block *block)
+{
+	volatile Chunk *ch = pin_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, CSTATE_DECORATED);
+	if(!ch)
+		return false;
+
+	const BlockStorage *s = atomic_load_explicit(&ch->blocks, memory_order_acquire);
+	bool uniform = bstore_is_uniform(s);
+	if(uniform)
+		*block = s->palette[0];
+	unpin_chunk(ch);
+	return uniform;
+}
+
+void
+world_set_block(int x, int y, int z, Block block)
+{
+	/* only what is already loaded, generating here would stall the caller */
+	if(!find_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, CSTATE_DECORATED))
+		return;
+	world_set(x, y, z, CSTATE_DECORATED, block);
+	if(journal_enabled())
+		journal_record(x, y, z, block);
+}
 
+Block
+world_get(int x, int y, int z, ChunkState state)
+{
 	volatile Chunk *ch;
-	if(!(ch = chunk_gen(chunk_x, chunk_y, chunk_z, state))) {
+	if(!(ch = pin_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, state))) {
 		return BLOCK_UNLOADED;
 	}
-	
-
-	x &= BLOCK_MASK;
-	y &= BLOCK_MASK;
-	z &= BLOCK_MASK;
-
-	return ch->blocks[z][y][x];
+	Block b = chunk_get_block(ch, x, y, z);
+	unpin_chunk(ch);
+	return b;
 }
 
 float
 world_get_density(int x, int y, int z, ChunkState state)
 {
-	int chunk_x = x & CHUNK_MASK;
-	int chunk_y = y & CHUNK_MASK;
-	int chunk_z = z & CHUNK_MASK;
-
 	volatile Chunk *ch;
-	if(!(ch = chunk_gen(chunk_x, chunk_y, chunk_z, state))) {
+	if(!(ch = pin_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, state))) {
 		return NAN;
 	}
+	float r = chunk_get_density(ch, x, y, z);
+	unpin_chunk(ch);
+	return r;
+}
+
+void
+world_set_density(int x, int y, int z, ChunkState state, float r)
+{
+	volatile Chunk *ch;
+	if(!(ch = pin_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, state))) {
+		return;
+	}
+	chunk_set_density(ch, x, y, z, r);
+	unpin_chunk(ch);
+}
 
-	x &= BLOCK_MASK;
-	y &= BLOCK_MASK;
-	z &= BLOCK_MASK;
+void
+world_set(int x, int y, int z, ChunkState state, Block block)
+{
+	volatile Chunk *ch;
+	if(!(ch = pin_chunk(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK, state))) {
+		return;
+	}
+	chunk_set_block(ch, x, y, z, block);
+	unpin_chunk(ch);
+}
+
+int
+world_copy_region(int x, int y, int z, int w, int h, int d, signed char *out, int *missing, int max_missing)
+{
+	int nmissing = 0;
+
+	for(int chunk_z = z & CHUNK_MASK; chunk_z < z + d; chunk_z += CHUNK_SIZE)
+	for(int chunk_y = y & CHUNK_MASK; chunk_y < y + h; chunk_y += CHUNK_SIZE)
+	for(int chunk_x = x & CHUNK_MASK; chunk_x < x + w; chunk_x += CHUNK_SIZE) {
+		/* the part of the box inside this chunk, relative to the box */
+		int x0 = (chunk_x > x ? chunk_x : x) - x;
+		int y0 = (chunk_y > y ? chunk_y : y) - y;
+		int z0 = (chunk_z > z ? chunk_z : z) - z;
+		int x1 = (chunk_x + CHUNK_SIZE < x + w ? chunk_x + CHUNK_SIZE : x + w) - x;
+		int y1 = (chunk_y + CHUNK_SIZE < y + h ? chunk_y + CHUNK_SIZE : y + h) - y;
+		int z1 = (chunk_z + CHUNK_SIZE < z + d ? chunk_z + CHUNK_SIZE : z + d) - z;
+
+		volatile Chunk *c = pin_chunk(chunk_x, chunk_y, chunk_z, CSTATE_DECORATED);
+		if(c) {
+			chunk_copy_box(c, x0 + x, y0 + y, z0 + z, x1 + x, y1 + y, z1 + z,
+					out + ((size_t)z0 * h + y0) * w + x0, w, h);
+			unpin_chunk(c);
+			continue;
+		}
 
-	return (float)ch->density[z][y][x] / 1024.0;
+		for(int zz = z0; zz < z1; zz++)
+		for(int yy = y0; yy < y1; yy++)
+			memset(out + ((size_t)zz * h + yy) * w + x0, BLOCK_UNLOADED, x1 - x0);
+
+		if(nmissing < max_missing) {
+			missing[nmissing * 3 + 0] = chunk_x;
+			missing[nmissing * 3 + 1] = chunk_y;
+			missing[nmissing * 3 + 2] = chunk_z;
+		}
+		nmissing++;
+		world_enqueue_load(chunk_x, chunk_y, chunk_z);
+	}
+	return nmissing;
 }
 
 void
-world_set_density(int x, int y, int z, ChunkState state, float r)
+world_place_structure(const StructureBlock *blocks, size_t count)
+{
+	StructureBlock *sorted = emalloc(sizeof(StructureBlock) * (count ? count : 1));
+	StructBufStats pending;
+	size_t next;
+
+	/* by chunk, each one is pinned once */
+	memcpy(sorted, blocks, sizeof(StructureBlock) * count);
+	qsort(sorted, count, sizeof(StructureBlock), compare_structure_blocks);
+
+	pthread_mutex_lock(&structure_mutex);
+	for(size_t i = 0; i < count; i = next) {
+		int chunk_x = sorted[i].x & CHUNK_MASK;
+		int chunk_y = sorted[i].y & CHUNK_MASK;
+		int chunk_z = sorted[i].z & CHUNK_MASK;
+
+		for(next = i + 1; next < count; next++) {
+			if((sorted[next].x & CHUNK_MASK) != chunk_x
+			|| (sorted[next].y & CHUNK_MASK) != chunk_y
+			|| (sorted[next].z & CHUNK_MASK) != chunk_z)
+				break;
+		}
+
+		volatile Chunk *c = pin_chunk(chunk_x, chunk_y, chunk_z, CSTATE_DECORATING);
+		if(!c) {
+			for(size_t j = i; j < next; j++)
+				sbuf_add(&sorted[j]);
+			continue;
+		}
+		place_blocks(c, sorted + i, next - i);
+		unpin_chunk(c);
+	}
+	/* the chunks the border left behind won't take theirs any time soon,
+	 * and only so many are kept for the ones it didn't */
+	sbuf_get_stats(&pending);
+	if(pending_epoch != atomic_load(&border_epoch) || pending.blocks > MAX_PENDING_BLOCKS) {
+		pending_epoch = atomic_load(&border_epoch);
+		sbuf_flush(cx, cy, cz, cradius, MAX_PENDING_BLOCKS, flush_saved);
+	}
+	pthread_mutex_unlock(&structure_mutex);
+	efree(sorted);
+}
+
+void
+cursor_init(BlockCursor *cur, ChunkState state)
+{
+	cur->state = state;
+	for(int i = 0; i < CURSOR_SLOTS; i++)
+		cur->slots[i].valid = false;
+}
+
+void
+cursor_release(BlockCursor *cur)
+{
+	for(int i = 0; i < CURSOR_SLOTS; i++) {
+		if(cur->slots[i].valid && cur->slots[i].chunk)
+			unpin_chunk(cur->slots[i].chunk);
+		cur->slots[i].valid = false;
+	}
+}
+
+Block
+cursor_get(BlockCursor *cur, int x, int y, int z)
+{
+	volatile Chunk *ch = cursor_chunk(cur, x, y, z);
+	return ch ? chunk_get_block(ch, x, y, z) : BLOCK_UNLOADED;
+}
+
+void
+cursor_set(BlockCursor *cur, int x, int y, int z, Block block)
+{
+	volatile Chunk *ch = cursor_chunk(cur, x, y, z);
+	if(ch)
+		chunk_set_block(ch, x, y, z, block);
+}
+
+float
+cursor_get_density(BlockCursor *cur, int x, int y, int z)
+{
+	volatile Chunk *ch = cursor_chunk(cur, x, y, z);
+	return ch ? chunk_get_density(ch, x, y, z) : NAN;
+}
+
+void
+cursor_set_density(BlockCursor *cur, int x, int y, int z, float r)
+{
+	volatile Chunk *ch = cursor_chunk(cur, x, y, z);
+	if(ch)
+		chunk_set_density(ch, x, y, z, r);
+}
+
+volatile Chunk *
+cursor_chunk(BlockCursor *cur, int x, int y, int z)
 {
 	int chunk_x = x & CHUNK_MASK;
 	int chunk_y = y & CHUNK_MASK;
 	int chunk_z = z & CHUNK_MASK;
+	CursorSlot *slot = &cur->slots[CURSOR_SLOT(x, y, z)];
+
+	if(slot->valid && slot->x == chunk_x && slot->y == chunk_y && slot->z == chunk_z)
+		return slot->chunk;
+
+	if(slot->valid && slot->chunk)
+		unpin_chunk(slot->chunk);
+
+	slot->valid = true;
+	slot->x = chunk_x;
+	slot->y = chunk_y;
+	slot->z = chunk_z;
+	slot->chunk = pin_chunk(chunk_x, chunk_y, chunk_z, cur->state);
+	/* consumers want it loaded, generator stages had it scheduled already */
+	if(!slot->chunk && cur->state == CSTATE_DECORATED)
+		world_enqueue_load(chunk_x, chunk_y, chunk_z);
+	return slot->chunk;
+}
 
-	volatile Chunk *ch;
-	if(!(ch = chunk_gen(chunk_x, chunk_y, chunk_z, state))) {
-		return;
-	}
+volatile Chunk *
+pin_chunk(int x, int y, int z, ChunkState state)
+{
+	volatile Chunk *c = find_chunk(x, y, z, state);
+	if(!c)
+		return NULL;
+
+	/* taken with the same lock eviction checks the pins under */
+	pthread_mutex_lock(&state_mutex);
+	bool pinned = !c->free && c->x == x && c->y == y && c->z == z;
+	if(pinned)
+		atomic_fetch_add(&c->pins, 1);
+	pthread_mutex_unlock(&state_mutex);
+
+	if(!pinned)
+		return NULL;
+	touch_chunk(c);
+	return c;
+}
+
+void
+unpin_chunk(volatile Chunk *c)
+{
+	atomic_fetch_sub(&c->pins, 1);
+}
+
+Block
+chunk_get_block(volatile Chunk *ch, int x, int y, int z)
+{
+	x &= BLOCK_MASK;
+	y &= BLOCK_MASK;
+	z &= BLOCK_MASK;
+	return bstore_get(atomic_load_explicit(&ch->blocks, memory_order_acquire), BSTORE_INDEX(x, y, z));
+}
 
+void
+chunk_set_block(volatile Chunk *ch, int x, int y, int z, Block block)
+{
 	x &= BLOCK_MASK;
 	y &= BLOCK_MASK;
 	z &= BLOCK_MASK;
 
-	r *= 1024.0;
-	if(r > SHRT_MAX)
-		r = SHRT_MAX;
-	if(r < SHRT_MIN)
-		r = SHRT_MIN;
+	pthread_mutex_lock((pthread_mutex_t *)&ch->lock);
+	chunk_store_block(ch, BSTORE_INDEX(x, y, z), block);
+	pthread_mutex_unlock((pthread_mutex_t *)&ch->lock);
+}
 
-	ch->density[z][y][x] = (short)r;
+bool
+chunk_place_block(volatile Chunk *ch, const StructureBlock *b)
+{
+	/* by rank, so the blocks of overlapping structures end up the same
+	 * whatever order they are placed in */
+	int index = BSTORE_INDEX(b->x & BLOCK_MASK, b->y & BLOCK_MASK, b->z & BLOCK_MASK);
+	bool place;
+
+	pthread_mutex_lock((pthread_mutex_t *)&ch->lock);
+	Block current = bstore_get(atomic_load_explicit(&ch->blocks, memory_order_relaxed), index);
+	if((place = structure_replaces(b, current)))
+		chunk_store_block(ch, index, b->block);
+	pthread_mutex_unlock((pthread_mutex_t *)&ch->lock);
+	return place;
 }
 
 void
-world_set(int x, int y, int z, ChunkState state, Block block)
+chunk_store_block(volatile Chunk *ch, int index, Block block)
 {
-	int chunk_x = x & CHUNK_MASK;
-	int chunk_y = y & CHUNK_MASK;
-	int chunk_z = z & CHUNK_MASK;
+	/* ch->lock is held */
+	BlockStorage *s = atomic_load_explicit(&ch->blocks, memory_order_relaxed);
+	BlockStorage *ns = bstore_set(s, index, block);
+	ch->dirty = true;
+	if(ns != s) {
+		chunk_swap_blocks(ch, ns);
+		/* nobody but the generator looks at a chunk before it is decorated */
+		if(ch->state < CSTATE_DECORATED)
+			bstore_free_retired(ns);
+	}
+}
 
-	volatile Chunk *ch;
-	if(!(ch = chunk_gen(chunk_x, chunk_y, chunk_z, state))) {
-		return;
+BlockStorage *
+chunk_swap_blocks(volatile Chunk *ch, BlockStorage *s)
+{
+	/* ch->lock is held or ch is claimed, returns the storage replaced */
+	BlockStorage *old = atomic_load_explicit(&ch->blocks, memory_order_relaxed);
+	uniform_chunks += bstore_is_uniform(s) - bstore_is_uniform(old);
+	atomic_store_explicit(&ch->blocks, s, memory_order_release);
+	return old;
+}
+
+float
+chunk_get_density(volatile Chunk *ch, int x, int y, int z)
+{
+	x &= BLOCK_MASK;
+	y &= BLOCK_MASK;
+	z &= BLOCK_MASK;
+
+	pthread_mutex_lock((pthread_mutex_t *)&ch->lock);
+	float r = (float)chunk_scratch(ch)->density[z][y][x] / 1024.0;
+	pthread_mutex_unlock((pthread_mutex_t *)&ch->lock);
+	return r;
+}
+
+void
+chunk_copy_box(volatile Chunk *ch, int x0, int y0, int z0, int x1, int y1, int z1, signed char *out, int w, int h)
+{
+	/* out points at (x0, y0, z0) of a w * h * d box */
+	int sx = x1 - x0;
+	int sy = y1 - y0;
+	int sz = z1 - z0;
+
+	x0 &= BLOCK_MASK;
+	y0 &= BLOCK_MASK;
+	z0 &= BLOCK_MASK;
+
+	/* writers hold the lock, so every chunk is copied as of one instant */
+	pthread_mutex_lock((pthread_mutex_t *)&ch->lock);
+	const BlockStorage *s = atomic_load_explicit(&ch->blocks, memory_order_acquire);
+	if(bstore_is_uniform(s)) {
+		for(int z = 0; z < sz; z++)
+		for(int y = 0; y < sy; y++)
+			memset(out + ((size_t)z * h + y) * w, s->palette[0], sx);
+	} else if(sx * sy * sz * 4 >= BSTORE_VOLUME) {
+		signed char blocks[BSTORE_VOLUME];
+
+		bstore_decode(s, blocks);
+		for(int z = 0; z < sz; z++)
+		for(int y = 0; y < sy; y++)
+			memcpy(out + ((size_t)z * h + y) * w, blocks + BSTORE_INDEX(x0, y0 + y, z0 + z), sx);
+	} else {
+		/* a sliver of halo, not worth decoding the whole chunk */
+		for(int z = 0; z < sz; z++)
+		for(int y = 0; y < sy; y++)
+		for(int x = 0; x < sx; x++)
+			out[((size_t)z * h + y) * w + x] = bstore_get(s, BSTORE_INDEX(x0 + x, y0 + y, z0 + z));
 	}
+	pthread_mutex_unlock((pthread_mutex_t *)&ch->lock);
+}
 
+void
+chunk_set_density(volatile Chunk *ch, int x, int y, int z, float r)
+{
 	x &= BLOCK_MASK;
 	y &= BLOCK_MASK;
 	z &= BLOCK_MASK;
 
-	ch->blocks[z][y][x] = block;
+	pthread_mutex_lock((pthread_mutex_t *)&ch->lock);
+	chunk_scratch(ch)->density[z][y][x] = pack_density(r);
+	pthread_mutex_unlock((pthread_mutex_t *)&ch->lock);
+}
+
+void
+chunk_read(volatile Chunk *c, signed char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+           float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE])
+{
+	pthread_mutex_lock((pthread_mutex_t *)&c->lock);
+	if(blocks)
+		bstore_decode(atomic_load_explicit(&c->blocks, memory_order_relaxed), (signed char *)blocks);
+	if(density) {
+		const short *in = (short *)chunk_scratch(c)->density;
+		float *out = (float *)density;
+
+		for(int i = 0; i < BSTORE_VOLUME; i++)
+			out[i] = in[i] / 1024.0f;
+	}
+	pthread_mutex_unlock((pthread_mutex_t *)&c->lock);
+}
+
+void
+chunk_write(volatile Chunk *c, signed char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+            float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE])
+{
+	/* encoded outside the lock, the chunk is claimed by the caller */
+	BlockStorage *ns = blocks ? bstore_encode((signed char *)blocks) : NULL;
+
+	pthread_mutex_lock((pthread_mutex_t *)&c->lock);
+	if(ns) {
+		/* nobody but the generator looks at a chunk before it is decorated */
+		bstore_free(chunk_swap_blocks(c, ns));
+		c->dirty = true;
+	}
+	if(density) {
+		const float *in = (float *)density;
+		short *out = (short *)chunk_scratch(c)->density;
+
+		for(int i = 0; i < BSTORE_VOLUME; i++)
+			out[i] = pack_density(in[i]);
+	}
+	pthread_mutex_unlock((pthread_mutex_t *)&c->lock);
+}
+
+bool
+chunk_read_rows(int x, int y, int z, ChunkState state, int y0, int y1,
+                float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE])
+{
+	volatile Chunk *c = pin_chunk(x, y, z, state);
+
+	if(!c)
+		return false;
+	pthread_mutex_lock((pthread_mutex_t *)&c->lock);
+	ChunkScratch *scratch = chunk_scratch(c);
+	for(int zz = 0; zz < CHUNK_SIZE; zz++)
+	for(int yy = y0; yy <= y1; yy++)
+	for(int xx = 0; xx < CHUNK_SIZE; xx++)
+		density[zz][yy][xx] = scratch->density[zz][yy][xx] / 1024.0f;
+	pthread_mutex_unlock((pthread_mutex_t *)&c->lock);
+	unpin_chunk(c);
+	return true;
+}
+
+void
+chunk_fill(volatile Chunk *ch, Block block, float r)
+{
+	short packed = pack_density(r);
+
+	pthread_mutex_lock((pthread_mutex_t *)&ch->lock);
+	/* nobody but the generator looks at a chunk before it is decorated */
+	BlockStorage *s = chunk_swap_blocks(ch, bstore_uniform(block));
+	if(ch->state < CSTATE_DECORATED)
+		bstore_free(s);
+	ch->dirty = true;
+
+	ChunkScratch *scratch = chunk_scratch(ch);
+	for(int z = 0; z < CHUNK_SIZE; z++)
+	for(int y = 0; y < CHUNK_SIZE; y++)
+	for(int x = 0; x < CHUNK_SIZE; x++)
+		scratch->density[z][y][x] = packed;
+	pthread_mutex_unlock((pthread_mutex_t *)&ch->lock);
 }
 
 RaycastWorld
@@ -181,6 +900,7 @@ world_begin_raycast(vec3 position, vec3 direction, float max_distance)
 	vec3_nextint(r.tmax, position, direction);
 	vec3_div(r.tdelta, r.step, direction);
 	r.state = 0;
+	r.chunk_known = false;
 
 	return r;
 }
@@ -195,7 +915,7 @@ world_raycast(RaycastWorld *rw)
 		switch(rw->state) {
 		case 0:
 			rw->state = 1;
-			if((rw->block = world_get_block(rw->position[0], rw->position[1], rw->position[2])) > 0) {
+			if((rw->block = raycast_block(rw)) > 0) {
 				return 1;
 			}
 			/* fallthrough */
@@ -250,6 +970,29 @@ world_raycast(RaycastWorld *rw)
 	}
 }
 
+Block
+raycast_block(RaycastWorld *rw)
+{
+	int x = rw->position[0];
+	int y = rw->position[1];
+	int z = rw->position[2];
+
+	/* uniform chunks are crossed without looking up every voxel */
+	if(!rw->chunk_known || rw->chunk_x != (x & CHUNK_MASK) || rw->chunk_y != (y & CHUNK_MASK)
+			|| rw->chunk_z != (z & CHUNK_MASK)) {
+		rw->chunk_known = true;
+		rw->chunk_x = x & CHUNK_MASK;
+		rw->chunk_y = y & CHUNK_MASK;
+		rw->chunk_z = z & CHUNK_MASK;
+		if(!world_chunk_uniform(x, y, z, &rw->chunk_block))
+			rw->chunk_block = BLOCK_UNLOADED;
+	}
+
+	if(rw->chunk_block != BLOCK_UNLOADED)
+		return rw->chunk_block;
+	return world_get_block(x, y, z);
+}
+
 void
 block_face_to_dir(Direction dir, vec3 out)
 {
@@ -276,6 +1019,56 @@ world_set_load_border(int x, int y, int z, int radius)
 	cy = y;
 	cz = z;
 	cradius = radius;
+	atomic_fetch_add(&border_epoch, 1);
+	if(mapstore_enabled())
+		mapstore_set_border(x, y, z, radius);
+	/* waiters on chunks now out of the border give up */
+	notify_all();
+}
+
+void
+world_set_memory_budget(size_t bytes)
+{
+	pthread_mutex_lock(&chunk_mutex);
+	memory_budget = bytes;
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
+void
+world_set_warm_budget(size_t bytes)
+{
+	ccache_set_budget(bytes);
+}
+
+bool
+world_set_save_directory(const char *path, SaveMode mode)
+{
+	region_close();
+	journal_close();
+	mapstore_close();
+	switch(mode) {
+	case SAVE_REGIONS:
+		return region_open(path);
+	case SAVE_EDITS:
+		return journal_open(path);
+	case SAVE_MAPPED:
+		return mapstore_open(path);
+	default:
+		return true;
+	}
+}
+
+void
+world_use_huge_pages(bool enable)
+{
+	/* only affects the slabs mapped from now on */
+	pthread_mutex_lock(&chunk_mutex);
+	chunk_slab.huge_pages = enable;
+	pthread_mutex_unlock(&chunk_mutex);
+
+	pthread_mutex_lock(&scratch_mutex);
+	scratch_slab.huge_pages = enable;
+	pthread_mutex_unlock(&scratch_mutex);
 }
 
 uint32_t
@@ -286,111 +1079,556 @@ chunk_coord_hash(int x, int y, int z)
 }
 
 void
-insert_chunk(Chunk *c)
+lru_push(Chunk *c)
 {
-	uint32_t hash = chunk_coord_hash(c->x, c->y, c->z);
-	c->prev = NULL;
-	c->next = chunkmap[hash];
-	if(chunkmap[hash])
-		chunkmap[hash]->prev = c;
-	chunkmap[hash] = c;
+	c->lru_prev = NULL;
+	c->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = c;
+	else
+		lru_tail = c;
+	lru_head = c;
+}
 
-	c->prev_alloc = NULL;
-	c->next_alloc = chunks;
-	if(chunks)
-		chunks->prev_alloc = c;
-	if(!last_chunk)
-		last_chunk = c;
-	chunks = c;
+void
+lru_unlink(Chunk *c)
+{
+	if(c->lru_prev)
+		c->lru_prev->lru_next = c->lru_next;
+	else
+		lru_head = c->lru_next;
+
+	if(c->lru_next)
+		c->lru_next->lru_prev = c->lru_prev;
+	else
+		lru_tail = c->lru_prev;
 }
 
 void
-remove_chunk(Chunk *c)
+touch_chunk(volatile Chunk *c)
 {
-	uint32_t hash = chunk_coord_hash(c->x, c->y, c->z);
-	if(c->prev)
-		c->prev->next = c->next;
-	if(c->next)
-		c->next->prev = c->prev;
-	if(chunkmap[hash] == c)
-		chunkmap[hash] = c->next;
+	/* chunks only move to the head once per border change, so the ones
+	 * sitting at the tail are the ones the player left behind the longest */
+	int epoch = atomic_load_explicit(&border_epoch, memory_order_relaxed);
+	if(c->lru_epoch == epoch)
+		return;
 
-	if(c->prev_alloc)
-		c->prev_alloc->next_alloc = c->next_alloc;
-	if(c->next_alloc)
-		c->next_alloc->prev_alloc = c->prev_alloc;
-	if(c == chunks)
-		chunks = c->next_alloc;
-	if(c == last_chunk)
-		last_chunk = c->prev_alloc;
+	pthread_mutex_lock(&chunk_mutex);
+	if(!c->free) {
+		lru_unlink((Chunk *)c);
+		lru_push((Chunk *)c);
+		c->lru_epoch = epoch;
+	}
+	pthread_mutex_unlock(&chunk_mutex);
 }
 
-volatile Chunk *
-chunk_gen(int x, int y, int z, ChunkState target_state)
+bool
+evict_chunk(FreedChunk *freed)
 {
-	if(!world_can_load(x, y, z))
-		return NULL;
+	/* chunk_mutex is held */
+	Chunk *c = lru_tail;
+	for(int i = 0; c && i < EVICT_SCAN; i++) {
+		Chunk *prev = c->lru_prev;
+
+		if(!world_can_load(c->x, c->y, c->z)) {
+			pthread_mutex_lock(&state_mutex);
+			bool idle = !IS_GENERATING(c->state) && !c->pins;
+			if(idle)
+				c->free = true;
+			pthread_mutex_unlock(&state_mutex);
+
+			if(idle) {
+				free_chunk(c, freed);
+				evictions++;
+				return true;
+			}
+		}
 
-	volatile Chunk *c = find_chunk(x, y, z, 0);
-	if(!c) {
-		c = allocate_chunk(x, y, z);
+		/* still inside the border, it will be back soon enough */
+		lru_unlink(c);
+		lru_push(c);
+		c = prev;
 	}
+	return false;
+}
 
-	#define MAKE_STATE(STATE) \
-		case STATE: \
-			if(target_state <= STATE) \
-				break;
-	
-	#define MAKE_ING_STATE(STATE) \
-		case STATE: \
-			if(target_state <= STATE) \
-				return c; \
-			else \
-			 	return NULL;
+void
+free_chunk(Chunk *c, FreedChunk *freed)
+{
+	/*
+	 * chunk_mutex is held. the blocks are handed to keep_freed() rather
+	 * than compressed into the warm tier here, the chunk is marked saving
+	 * until they are so it isn't loaded again from an older save
+	 */
+	chunkmap_remove(&chunkmap, c);
+	lru_unlink(c);
+
+	pthread_mutex_lock(&c->lock);
+	BlockStorage *s = atomic_load(&c->blocks);
+	uniform_chunks -= bstore_is_uniform(s);
+	freed->blocks = NULL;
+	/* a mapped image has its edits in the file and the page cache already */
+	if(c->state == CSTATE_DECORATED && !s->mapped) {
+		freed->x = c->x;
+		freed->y = c->y;
+		freed->z = c->z;
+		freed->dirty = c->dirty;
+		freed->blocks = s;
+		begin_saving(c->x, c->y, c->z);
+	} else {
+		bstore_free(s);
+	}
+	if(c->scratch) {
+		scratch_free(c->scratch);
+		c->scratch = NULL;
+	}
+	c->free = true;
+	pthread_mutex_unlock(&c->lock);
+	if(atomic_load(&c->waiters))
+		notify_chunk(c);
+
+	slab_free(&chunk_slab, c);
+	chunk_count--;
+}
+
+void
+keep_freed(FreedChunk *freed)
+{
+	/* chunk_mutex is not held */
+	if(!freed->blocks)
+		return;
+	ccache_put(freed->x, freed->y, freed->z, freed->blocks, freed->dirty);
+	bstore_free(freed->blocks);
+	end_saving(freed->x, freed->y, freed->z);
+}
+
+size_t
+memory_usage()
+{
+	size_t scratch_bytes;
+
+	pthread_mutex_lock(&scratch_mutex);
+	scratch_bytes = (scratch_count - scratch_pooled) * sizeof(ChunkScratch);
+	pthread_mutex_unlock(&scratch_mutex);
+
+	return chunk_count * sizeof(Chunk) + bstore_allocated_bytes() + scratch_bytes;
+}
+
+void
+run_stage(volatile Chunk *c, ChunkState queued)
+{
+	ChunkState state = atomic_load_explicit(&c->state, memory_order_acquire);
+	volatile Chunk *column[SHAPE_COLUMN];
+	int shaped = 0;
+	bool saved = false;
+
+	/* shaped along with a chunk below since it was queued, whether its
+	 * next stage is ready is left to the rescheduling below */
+	if(queued <= CSTATE_ALLOCATED && state > CSTATE_ALLOCATED)
+		state = CSTATE_DECORATED;
+
+	switch(state) {
+	case CSTATE_FREE:
+	case CSTATE_ALLOCATED:
+		if(!claim_state(c, state, CSTATE_SHAPING))
+			break;
+		if((saved = install_saved(c)))
+			break;
+		shaped = claim_column(c, column);
+		shape_column(column, shaped);
+		break;
+
+	case CSTATE_SHAPED:
+		if(claim_state(c, state, CSTATE_SURFACING)) {
+			uint64_t start = stage_clock();
+			wgen_surface(c);
+			surface_ns += stage_clock() - start;
+			surface_count++;
+			publish_state(c, CSTATE_SURFACED);
+			release_scratch_around(c->x, c->y, c->z);
+		}
+		break;
+
+	case CSTATE_SURFACED:
+		if(claim_state(c, state, CSTATE_DECORATING)) {
+			uint64_t start = stage_clock();
+			wgen_decorate(c);
+			decorate_ns += stage_clock() - start;
+			decorate_count++;
+			/* with what other chunks left for it, and the edits over
+			 * all of it before anything else lands */
+			pthread_mutex_lock(&structure_mutex);
+			take_pending(c->x, c->y, c->z);
+			if(journal_enabled()) {
+				/* the replay frees the storage it replaces, unless it
+				 * is a shared uniform one, and never makes one uniform */
+				pthread_mutex_lock((pthread_mutex_t *)&c->lock);
+				BlockStorage *s = atomic_load(&c->blocks);
+				if(bstore_is_uniform(s))
+					chunk_swap_blocks(c, journal_replay(c->x, c->y, c->z, s));
+				else
+					atomic_store(&c->blocks, journal_replay(c->x, c->y, c->z, s));
+				pthread_mutex_unlock((pthread_mutex_t *)&c->lock);
+			}
+			compact_chunk(c);
+			publish_state(c, CSTATE_DECORATED);
+			pthread_mutex_unlock(&structure_mutex);
+			release_scratch_around(c->x, c->y, c->z);
+			if(load_callback)
+				load_callback(c->x, c->y, c->z);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_lock(&load_mutex);
+	c->scheduled = false;
+	if(!c->free) {
+		try_schedule(c);
+		if(c->state == CSTATE_SHAPED || saved)
+			schedule_dependents(c->x, c->y, c->z);
+	}
+	/* the rest of the column still has its work queued */
+	for(int i = 1; i < shaped; i++) {
+		if(column[i]->free)
+			continue;
+		try_schedule(column[i]);
+		schedule_dependents(column[i]->x, column[i]->y, column[i]->z);
+	}
+	pthread_mutex_unlock(&load_mutex);
+}
+
+bool
+install_saved(volatile Chunk *c)
+{
+	/* c is claimed for shaping */
+	BlockStorage *saved;
+	bool dirty;
+
+	wait_saved(c->x, c->y, c->z);
+	if(!(saved = load_saved(c->x, c->y, c->z, &dirty)))
+		return false;
+
+	/* straight to decorated, the density is remade if a neighbour still
+	 * generating asks for it */
+	pthread_mutex_lock((pthread_mutex_t *)&c->lock);
+	bstore_free(chunk_swap_blocks(c, saved));
+	c->dirty = dirty;
+	pthread_mutex_unlock((pthread_mutex_t *)&c->lock);
+	publish_state(c, CSTATE_DECORATED);
+	/* structures decorated after it was saved */
+	pthread_mutex_lock(&structure_mutex);
+	take_pending(c->x, c->y, c->z);
+	pthread_mutex_unlock(&structure_mutex);
+	release_scratch_around(c->x, c->y, c->z);
+	if(load_callback)
+		load_callback(c->x, c->y, c->z);
+	return true;
+}
+
+int
+claim_column(volatile Chunk *c, volatile Chunk **column)
+{
+	/*
+	 * c is claimed for shaping. the chunks right above it that are waiting
+	 * to be shaped too are claimed along with it so they share the
+	 * heightmap, their queued work finds them shaped already. the chunk
+	 * lock keeps them from being evicted under us.
+	 */
+	int count = 1;
+
+	column[0] = c;
+	pthread_mutex_lock(&load_mutex);
+	pthread_mutex_lock(&chunk_mutex);
+	for(; count < SHAPE_COLUMN; count++) {
+		int y = c->y + count * CHUNK_SIZE;
+		volatile Chunk *n = find_chunk(c->x, y, c->z, 0);
+		if(!n || n->target < CSTATE_SHAPED || !world_can_load(c->x, y, c->z))
+			break;
+
+		ChunkState state = atomic_load_explicit(&n->state, memory_order_acquire);
+		if(state > CSTATE_ALLOCATED || !claim_state(n, state, CSTATE_SHAPING))
+			break;
+		column[count] = n;
+	}
+	pthread_mutex_unlock(&chunk_mutex);
+	pthread_mutex_unlock(&load_mutex);
+	return count;
+}
+
+void
+shape_column(volatile Chunk **column, int count)
+{
+	/* the chunks are claimed and stacked from column[0] up, the first has
+	 * no saved copy. one with a saved copy splits the column in two */
+	int start = 0;
+
+	for(int i = 1; i <= count; i++) {
+		if(i < count && !install_saved(column[i]))
+			continue;
+
+		if(i > start) {
+			uint64_t begin = stage_clock();
+			wgen_shape_column(column + start, i - start);
+			shape_ns += stage_clock() - begin;
+			shape_count += i - start;
+			for(int j = start; j < i; j++)
+				publish_state(column[j], CSTATE_SHAPED);
+		}
+		start = i + 1;
+	}
+}
+
+void
+request_state(volatile Chunk *c, ChunkState target)
+{
+	/* load_mutex is held */
+	if(c->free)
+		return;
+	if(c->target < target)
+		c->target = target;
+	try_schedule(c);
+}
+
+void
+try_schedule(volatile Chunk *c)
+{
+	/*
+	 * load_mutex is held. a stage is only queued once everything it reads
+	 * is there, so stages never generate or wait on each other:
+	 *   shaping    reads nothing
+	 *   surfacing  reads the density up to 3 blocks above, the chunk above
+	 *   decorating reads the density of the chunk and one block below it,
+	 *              the chunk below. what its structures put in the chunks
+	 *              around waits for them, see world_place_structure()
+	 * neighbours outside the load border are never generated and read as
+	 * unloaded, like before.
+	 */
+	bool ready = true;
+
+	if(c->scheduled || c->state >= c->target || IS_GENERATING(c->state))
+		return;
 
 	switch(c->state) {
-	MAKE_STATE(CSTATE_FREE)
-		c->state = CSTATE_ALLOCATED;
-
-	MAKE_STATE(CSTATE_ALLOCATED)
-		c->state = CSTATE_SHAPING;
-		wgen_shape(c->x, c->y, c->z);
-		c->state = CSTATE_SHAPED;
-
-	MAKE_STATE(CSTATE_SHAPED)
-		c->state = CSTATE_SURFACING;
-		wgen_surface(c->x, c->y, c->z);
-		c->state = CSTATE_SURFACED;
-		
-	MAKE_STATE(CSTATE_SURFACED)
-		c->state = CSTATE_DECORATING;
-		wgen_decorate(c->x, c->y, c->z);
-		c->state = CSTATE_DECORATED;
-
-	MAKE_STATE(CSTATE_DECORATED)
+	case CSTATE_SHAPED:
+		ready = require_shaped(c->x, c->y + CHUNK_SIZE, c->z);
+		break;
+
+	case CSTATE_SURFACED:
+		ready = require_shaped(c->x, c->y - CHUNK_SIZE, c->z);
+		break;
+
+	default:
 		break;
-	
-	MAKE_ING_STATE(CSTATE_SHAPING);
-	MAKE_ING_STATE(CSTATE_SURFACING);
-	MAKE_ING_STATE(CSTATE_DECORATING);
 	}
 
-	return c;
+	if(!ready)
+		return;
+
+	c->scheduled = true;
+	load_push(&(Work){ .x = c->x, .y = c->y, .z = c->z, .state = c->state });
+	pthread_cond_signal(&load_cond);
 }
 
-volatile Chunk *
-find_chunk(int x, int y, int z, ChunkState state)
+bool
+require_shaped(int x, int y, int z)
+{
+	/* load_mutex is held */
+	if(!world_can_load(x, y, z))
+		return true;
+
+	volatile Chunk *c = find_chunk(x, y, z, 0);
+	if(!c)
+		c = allocate_chunk(x, y, z);
+
+	if(c->state >= CSTATE_SHAPED)
+		return true;
+	/* only ever schedules shaping, which needs nothing, so no recursion */
+	request_state(c, CSTATE_SHAPED);
+	return false;
+}
+
+void
+schedule_dependents(int x, int y, int z)
 {
+	/* load_mutex is held, the inverse of the neighbourhoods in try_schedule */
 	volatile Chunk *c;
-	uint32_t hash = chunk_coord_hash(x, y, z);
-	c = chunkmap[hash];
-	while(c) {
-		if(!c->free && c->state >= state && c->x == x && c->y == y && c->z == z) {
-			return c;
+
+	for(int dy = -CHUNK_SIZE; dy <= CHUNK_SIZE; dy += CHUNK_SIZE) {
+		if((c = find_chunk(x, y + dy, z, 0)))
+			try_schedule(c);
+	}
+}
+
+bool
+claim_state(volatile Chunk *c, ChunkState from, ChunkState to)
+{
+	bool claimed = false;
+
+	/* the lock only orders claims against eviction, readers never take it */
+	pthread_mutex_lock(&state_mutex);
+	if(!c->free)
+		claimed = atomic_compare_exchange_strong(&c->state, &from, to);
+	pthread_mutex_unlock(&state_mutex);
+	return claimed;
+}
+
+void
+publish_state(volatile Chunk *c, ChunkState state)
+{
+	/* releases every block and density the stage wrote */
+	atomic_store_explicit(&c->state, state, memory_order_release);
+	if(atomic_load(&c->waiters))
+		notify_chunk(c);
+}
+
+void
+notify_chunk(volatile Chunk *c)
+{
+	size_t stripe = ((uintptr_t)c / sizeof(Chunk)) % WAIT_STRIPES;
+
+	pthread_mutex_lock(&wait_stripes[stripe].mutex);
+	pthread_cond_broadcast(&wait_stripes[stripe].cond);
+	pthread_mutex_unlock(&wait_stripes[stripe].mutex);
+}
+
+void
+notify_all()
+{
+	for(int i = 0; i < WAIT_STRIPES; i++) {
+		pthread_mutex_lock(&wait_stripes[i].mutex);
+		pthread_cond_broadcast(&wait_stripes[i].cond);
+		pthread_mutex_unlock(&wait_stripes[i].mutex);
+	}
+}
+
+void *
+load_worker(void *arg)
+{
+	Work w;
+
+	(void)arg;
+	while(load_pop(&w)) {
+		volatile Chunk *c = find_chunk(w.x, w.y, w.z, 0);
+		if(c)
+			run_stage(c, w.state);
+	}
+	return NULL;
+}
+
+void
+load_push(Work *w)
+{
+	/* load_mutex is held */
+	w->priority = load_priority(w->x, w->y, w->z);
+	arrbuf_insert(&load_queue, sizeof(Work), w);
+	load_sift_up(load_queue.data, arrbuf_length(&load_queue, sizeof(Work)) - 1);
+}
+
+bool
+load_pop(Work *w)
+{
+	pthread_mutex_lock(&load_mutex);
+	for(;;) {
+		while(running && arrbuf_length(&load_queue, sizeof(Work)) == 0)
+			pthread_cond_wait(&load_cond, &load_mutex);
+		if(!running) {
+			pthread_mutex_unlock(&load_mutex);
+			return false;
 		}
-		c = c->next;
+
+		if(load_epoch != atomic_load(&border_epoch))
+			load_reprioritize();
+
+		Work *heap = load_queue.data;
+		size_t len = arrbuf_length(&load_queue, sizeof(Work));
+		*w = heap[0];
+		heap[0] = heap[len - 1];
+		arrbuf_poptop(&load_queue, sizeof(Work));
+		load_sift_down(heap, len - 1, 0);
+
+		/* the player walked away before we got to it */
+		if(world_can_load(w->x, w->y, w->z))
+			break;
+
+		volatile Chunk *c = find_chunk(w->x, w->y, w->z, 0);
+		if(c)
+			c->scheduled = false;
 	}
-	return c;
+	pthread_mutex_unlock(&load_mutex);
+	return true;
+}
+
+void
+load_sift_up(Work *heap, size_t i)
+{
+	while(i > 0) {
+		size_t parent = (i - 1) / 2;
+		if(heap[parent].priority <= heap[i].priority)
+			break;
+
+		Work tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = tmp;
+		i = parent;
+	}
+}
+
+void
+load_sift_down(Work *heap, size_t len, size_t i)
+{
+	for(;;) {
+		size_t smallest = i;
+		size_t l = i * 2 + 1;
+		size_t r = i * 2 + 2;
+
+		if(l < len && heap[l].priority < heap[smallest].priority)
+			smallest = l;
+		if(r < len && heap[r].priority < heap[smallest].priority)
+			smallest = r;
+		if(smallest == i)
+			break;
+
+		Work tmp = heap[smallest];
+		heap[smallest] = heap[i];
+		heap[i] = tmp;
+		i = smallest;
+	}
+}
+
+void
+load_reprioritize()
+{
+	/* load_mutex is held, the border moved so the whole order changed */
+	Work *heap = load_queue.data;
+	size_t len = arrbuf_length(&load_queue, sizeof(Work));
+
+	load_epoch = atomic_load(&border_epoch);
+	for(size_t i = 0; i < len; i++)
+		heap[i].priority = load_priority(heap[i].x, heap[i].y, heap[i].z);
+	for(size_t i = len / 2; i-- > 0;)
+		load_sift_down(heap, len, i);
+}
+
+long
+load_priority(int x, int y, int z)
+{
+	long dx = x - cx;
+	long dy = y - cy;
+	long dz = z - cz;
+	return dx * dx + dy * dy + dz * dz;
+}
+
+volatile Chunk *
+find_chunk(int x, int y, int z, ChunkState state)
+{
+	volatile Chunk *c = chunkmap_find(&chunkmap, x, y, z);
+	if(c && !c->free && atomic_load_explicit(&c->state, memory_order_acquire) >= state
+			&& c->x == x && c->y == y && c->z == z)
+		return c;
+	return NULL;
 }
 
 volatile Chunk *
@@ -399,33 +1637,47 @@ allocate_chunk(int x, int y, int z)
 	Chunk *c;
 
 	pthread_mutex_lock(&chunk_mutex);
-	c = NULL;
-	if(chunk_count > MAX_CHUNKS)
-		for(c = last_chunk; c; c = c->prev_alloc) {
-			if(c->free) {
-				break;
-			}
+	for(;;) {
+		FreedChunk freed;
 
-			int dx = abs(cx - c->x);
-			int dy = abs(cy - c->y);
-			int dz = abs(cz - c->z);
-			if(dx > cradius || dy > cradius || dz > cradius) {
-				remove_chunk(c);
-				break;
-			}
+		/* someone else may have allocated it while we waited for the lock */
+		if((c = chunkmap_find(&chunkmap, x, y, z))) {
+			pthread_mutex_unlock(&chunk_mutex);
+			return c;
+		}
+		if(memory_usage() <= memory_budget)
+			break;
+		if(!evict_chunk(&freed)) {
+			budget_overruns++;
+			break;
+		}
+		if(freed.blocks) {
+			pthread_mutex_unlock(&chunk_mutex);
+			keep_freed(&freed);
+			pthread_mutex_lock(&chunk_mutex);
 		}
-		
-	if(c == NULL) {
-		c = malloc(sizeof(*c));
-		chunk_count ++;
 	}
 
-	c->free = false;
+	c = slab_alloc(&chunk_slab);
+	pthread_mutex_init(&c->lock, NULL);
+	atomic_init(&c->blocks, bstore_new(BLOCK_NULL));
+	uniform_chunks++;
+	c->scratch = NULL;
+	c->dirty = false;
+	c->target = CSTATE_FREE;
+	c->scheduled = false;
+	c->lru_epoch = atomic_load(&border_epoch);
+	chunk_count++;
+
+	/* waiters is left alone, someone may still be leaving a wait on the
+	 * chunk this memory held before */
 	c->x = x;
 	c->y = y;
 	c->z = z;
-	c->state = CSTATE_FREE;
-	insert_chunk(c);
+	atomic_store_explicit(&c->state, CSTATE_FREE, memory_order_relaxed);
+	atomic_store_explicit(&c->free, false, memory_order_release);
+	lru_push(c);
+	chunkmap_insert(&chunkmap, c);
 	pthread_mutex_unlock(&chunk_mutex);
 	return c;
 }
@@ -445,3 +1697,371 @@ world_allocated_chunks_count()
 	return chunk_count;
 }
 
+void
+world_get_stats(WorldStats *stats)
+{
+	RegionStats region;
+	JournalStats journal;
+	MapStoreStats store;
+	ChunkCacheStats warm;
+	WorldGenStats gen;
+	StructBufStats pending;
+
+	region_get_stats(&region);
+	journal_get_stats(&journal);
+	mapstore_get_stats(&store);
+	ccache_get_stats(&warm);
+	wgen_get_stats(&gen);
+	pthread_mutex_lock(&structure_mutex);
+	sbuf_get_stats(&pending);
+	pthread_mutex_unlock(&structure_mutex);
+	pthread_mutex_lock(&scratch_mutex);
+	stats->scratch_count = scratch_count - scratch_pooled;
+	pthread_mutex_unlock(&scratch_mutex);
+
+	pthread_mutex_lock(&load_mutex);
+	stats->load_queue = arrbuf_length(&load_queue, sizeof(Work));
+	pthread_mutex_unlock(&load_mutex);
+
+	pthread_mutex_lock(&chunk_mutex);
+	stats->chunk_count     = chunk_count;
+	stats->chunk_bytes     = chunk_count * sizeof(Chunk);
+	stats->block_bytes     = bstore_allocated_bytes();
+	stats->scratch_bytes   = stats->scratch_count * sizeof(ChunkScratch);
+	stats->unsplit_bytes   = chunk_count * (sizeof(Chunk) + sizeof(ChunkScratch) + 2 * BSTORE_VOLUME);
+	stats->slab_bytes      = slab_reserved_bytes(&chunk_slab) + slab_reserved_bytes(&scratch_slab);
+	stats->memory_budget   = memory_budget;
+	stats->evictions       = evictions;
+	stats->budget_overruns = budget_overruns;
+	stats->uniform_count   = uniform_chunks;
+	stats->save_mode       = region_enabled() ? SAVE_REGIONS : journal_enabled() ? SAVE_EDITS
+	                       : mapstore_enabled() ? SAVE_MAPPED : SAVE_NONE;
+	stats->chunks_loaded   = region.loads;
+	stats->chunks_saved    = region.stores;
+	stats->save_bytes      = region.bytes_written;
+	stats->save_queue      = region.queued;
+	stats->journal_edits   = journal.edits;
+	stats->journal_commits = journal.commits;
+	stats->compactions     = journal.compactions;
+	stats->store_bytes     = store.used_bytes;
+	stats->store_resident  = store.resident_bytes;
+	stats->minor_faults    = store.minor_faults;
+	stats->major_faults    = store.major_faults;
+	stats->warm_count      = warm.chunks;
+	stats->warm_bytes      = warm.bytes;
+	stats->warm_budget     = warm.budget;
+	stats->warm_hits       = warm.hits;
+	stats->warm_spills     = warm.spills;
+	stats->column_count    = gen.columns;
+	stats->column_hits     = gen.column_hits;
+	stats->column_misses   = gen.column_misses;
+	stats->skipped_chunks  = gen.skipped_chunks;
+	stats->shape_count     = shape_count;
+	stats->surface_count   = surface_count;
+	stats->decorate_count  = decorate_count;
+	stats->shape_time      = shape_ns / 1e9;
+	stats->surface_time    = surface_ns / 1e9;
+	stats->decorate_time   = decorate_ns / 1e9;
+	stats->pending_chunks  = pending.chunks;
+	stats->pending_blocks  = pending.blocks;
+	stats->pending_flushed = pending.flushed;
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
+void
+compact_chunk(volatile Chunk *c)
+{
+	/* palettes only grow while generating, drop what got overwritten since */
+	BlockStorage *s = atomic_load(&c->blocks);
+	chunk_swap_blocks(c, bstore_compact(s));
+	bstore_free(s);
+}
+
+
+BlockStorage *
+load_saved(int x, int y, int z, bool *dirty)
+{
+	BlockStorage *s = ccache_take(x, y, z, dirty);
+
+	if(s)
+		return s;
+	*dirty = false;
+	if(region_enabled())
+		return region_load(x, y, z);
+	if(mapstore_enabled())
+		return mapstore_load(x, y, z);
+	return NULL;
+}
+
+void
+begin_saving(int x, int y, int z)
+{
+	/* chunk_mutex is held, and the chunk is not in memory */
+	arrbuf_insert(&saving, sizeof(ChunkCoord), &(ChunkCoord){ x, y, z });
+}
+
+bool
+is_saving(int x, int y, int z)
+{
+	/* chunk_mutex is held */
+	SPAN_FOR(arrbuf_span(&saving), s, ChunkCoord)
+		if(s->x == x && s->y == y && s->z == z)
+			return true;
+	return false;
+}
+
+void
+end_saving(int x, int y, int z)
+{
+	ChunkCoord *coords;
+	size_t len;
+
+	pthread_mutex_lock(&chunk_mutex);
+	coords = saving.data;
+	len = arrbuf_length(&saving, sizeof(ChunkCoord));
+	for(size_t i = 0; i < len; i++) {
+		if(coords[i].x != x || coords[i].y != y || coords[i].z != z)
+			continue;
+		coords[i] = coords[len - 1];
+		arrbuf_poptop(&saving, sizeof(ChunkCoord));
+		break;
+	}
+	pthread_cond_broadcast(&saved_cond);
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
+void
+wait_saved(int x, int y, int z)
+{
+	pthread_mutex_lock(&chunk_mutex);
+	while(is_saving(x, y, z))
+		pthread_cond_wait(&saved_cond, &chunk_mutex);
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
+void
+spill_chunk(int x, int y, int z, BlockStorage *s)
+{
+	/* out of the warm tier with blocks the save directory doesn't have */
+	if(region_enabled()) {
+		/* the writer takes the blocks */
+		region_store(x, y, z, s);
+	} else {
+		/* the journal has the edits already, and without a save directory
+		 * they are lost like any evicted chunk used to be */
+		if(mapstore_enabled())
+			mapstore_store(x, y, z, s);
+		bstore_free(s);
+	}
+}
+
+short
+pack_density(float r)
+{
+	r *= 1024.0;
+	if(r > SHRT_MAX)
+		r = SHRT_MAX;
+	if(r < SHRT_MIN)
+		r = SHRT_MIN;
+	return (short)r;
+}
+
+uint64_t
+stage_clock()
+{
+	struct timespec ts;
+
+	/* of the worker alone, waiting for the CPU isn't the stage's */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ChunkScratch *
+scratch_alloc()
+{
+	ChunkScratch *s;
+
+	pthread_mutex_lock(&scratch_mutex);
+	if((s = scratch_pool)) {
+		scratch_pool = s->next_free;
+		scratch_pooled--;
+	} else {
+		s = slab_alloc(&scratch_slab);
+		scratch_count++;
+	}
+	pthread_mutex_unlock(&scratch_mutex);
+	return s;
+}
+
+void
+scratch_free(ChunkScratch *s)
+{
+	pthread_mutex_lock(&scratch_mutex);
+	s->next_free = scratch_pool;
+	scratch_pool = s;
+	scratch_pooled++;
+	pthread_mutex_unlock(&scratch_mutex);
+}
+
+ChunkScratch *
+chunk_scratch(volatile Chunk *c)
+{
+	/* c->lock is held */
+	if(c->scratch)
+		return c->scratch;
+
+	c->scratch = scratch_alloc();
+	if(c->state >= CSTATE_SHAPED) {
+		/* released already, but a neighbour that got evicted and is
+		 * generating again still wants it */
+		float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+
+		wgen_density(c->x, c->y, c->z, density);
+		for(int z = 0; z < CHUNK_SIZE; z++)
+		for(int y = 0; y < CHUNK_SIZE; y++)
+		for(int x = 0; x < CHUNK_SIZE; x++)
+			c->scratch->density[z][y][x] = pack_density(density[z][y][x]);
+	}
+	return c->scratch;
+}
+
+void
+release_scratch_around(int x, int y, int z)
+{
+	/* a density is read by the decoration of the chunk, the surfacing of
+	 * the one below and the decoration of the one above, so it can only go
+	 * once all of them are done */
+	for(int dy = -CHUNK_SIZE; dy <= CHUNK_SIZE; dy += CHUNK_SIZE) {
+		volatile Chunk *c = pin_chunk(x, y + dy, z, CSTATE_DECORATED);
+		if(!c)
+			continue;
+
+		if(c->scratch && density_read(c->x, c->y, c->z)) {
+			pthread_mutex_lock((pthread_mutex_t *)&c->lock);
+			if(c->scratch) {
+				scratch_free(c->scratch);
+				c->scratch = NULL;
+			}
+			pthread_mutex_unlock((pthread_mutex_t *)&c->lock);
+		}
+		unpin_chunk(c);
+	}
+}
+
+bool
+density_read(int x, int y, int z)
+{
+	/* the ones outside the border were never waited for */
+	if(world_can_load(x, y - CHUNK_SIZE, z) && !find_chunk(x, y - CHUNK_SIZE, z, CSTATE_SURFACED))
+		return false;
+	if(world_can_load(x, y + CHUNK_SIZE, z) && !find_chunk(x, y + CHUNK_SIZE, z, CSTATE_DECORATED))
+		return false;
+	return true;
+}
+
+void
+take_pending(int x, int y, int z)
+{
+	/* structure_mutex is held, the chunk just got to decorating or was
+	 * loaded. it stays waiting if the chunk is gone already */
+	volatile Chunk *c = pin_chunk(x, y, z, CSTATE_DECORATING);
+	ArrayBuffer blocks;
+
+	if(!c)
+		return;
+	arrbuf_init(&blocks);
+	if(sbuf_take(x, y, z, &blocks))
+		place_blocks(c, blocks.data, arrbuf_length(&blocks, sizeof(StructureBlock)));
+	arrbuf_free(&blocks);
+	unpin_chunk(c);
+}
+
+bool
+flush_saved(int x, int y, int z, const StructureBlock *blocks, size_t count)
+{
+	/* structure_mutex is held. the chunk marked saving can be allocated
+	 * again meanwhile but it won't load its save until this is done, see
+	 * install_saved() */
+	signed char data[BSTORE_VOLUME];
+	BlockStorage *s;
+	bool dirty, changed = false;
+
+	pthread_mutex_lock(&chunk_mutex);
+	if(chunkmap_find(&chunkmap, x, y, z) || is_saving(x, y, z)) {
+		pthread_mutex_unlock(&chunk_mutex);
+		return false;
+	}
+	begin_saving(x, y, z);
+	pthread_mutex_unlock(&chunk_mutex);
+
+	/* never saved, it generates again with these blocks from the
+	 * decoration of its neighbours, see wgen_decorate() */
+	if(!(s = load_saved(x, y, z, &dirty))) {
+		end_saving(x, y, z);
+		return true;
+	}
+
+	/* as place_blocks() would on the chunk decorated */
+	bstore_decode(s, data);
+	for(size_t i = 0; i < count; i++) {
+		const StructureBlock *b = &blocks[i];
+		int index = BSTORE_INDEX(b->x & BLOCK_MASK, b->y & BLOCK_MASK, b->z & BLOCK_MASK);
+
+		if(journal_enabled() && journal_edited(b->x, b->y, b->z))
+			continue;
+		if(structure_replaces(b, data[index])) {
+			data[index] = b->block;
+			changed = true;
+		}
+	}
+
+	/* back through the warm tier, which writes it with the rest. a mapped
+	 * image not changed is in its file still */
+	if(changed) {
+		BlockStorage *merged = bstore_encode(data);
+		ccache_put(x, y, z, merged, true);
+		bstore_free(merged);
+	} else if(!s->mapped) {
+		ccache_put(x, y, z, s, dirty);
+	}
+	bstore_free(s);
+	end_saving(x, y, z);
+	return true;
+}
+
+void
+place_blocks(volatile Chunk *c, const StructureBlock *blocks, size_t count)
+{
+	/* structure_mutex is held, c is pinned and decorating or decorated.
+	 * the journal went over a decorated chunk already, its edits are kept
+	 * from here */
+	bool decorated = atomic_load_explicit(&c->state, memory_order_acquire) == CSTATE_DECORATED;
+	bool changed = false;
+
+	for(size_t i = 0; i < count; i++) {
+		if(decorated && journal_enabled() && journal_edited(blocks[i].x, blocks[i].y, blocks[i].z))
+			continue;
+		changed |= chunk_place_block(c, &blocks[i]);
+	}
+	if(decorated && changed && change_callback)
+		change_callback(c->x, c->y, c->z);
+}
+
+bool
+structure_replaces(const StructureBlock *b, Block current)
+{
+	if(b->force)
+		return current != b->block;
+	return bprop[b->block].structure_rank > bprop[current].structure_rank
+	    && (bprop[current].replaceable || bprop[current].structure_rank);
+}
+
+int
+compare_structure_blocks(const void *a, const void *b)
+{
+	const StructureBlock *ba = a, *bb = b;
+	uint64_t ka = chunk_coord_key(ba->x & CHUNK_MASK, ba->y & CHUNK_MASK, ba->z & CHUNK_MASK);
+	uint64_t kb = chunk_coord_key(bb->x & CHUNK_MASK, bb->y & CHUNK_MASK, bb->z & CHUNK_MASK);
+
+	return ka < kb ? -1 : ka > kb;
+}
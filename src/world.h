@@ -9,6 +9,8 @@
 
 #include "util.h"
 #include <linmath.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 typedef enum {
@@ -49,18 +51,69 @@ typedef enum {
 	CSTATE_DECORATED,
 } ChunkState;
 
+/* what a save directory keeps */
+typedef enum {
+	SAVE_NONE,
+	/* every decorated chunk, see region.h */
+	SAVE_REGIONS,
+	/* only the edits, replayed on the generated chunks, see journal.h */
+	SAVE_EDITS,
+	/* every decorated chunk, used in place from a mapped file, see mapstore.h */
+	SAVE_MAPPED,
+} SaveMode;
+
+typedef struct BlockStorage BlockStorage;
+typedef struct ChunkScratch ChunkScratch;
+
 typedef struct Chunk Chunk;
 struct Chunk {
-	short density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
-	char surface[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
-	char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
-	ChunkState state;
+	_Atomic(BlockStorage *) blocks;
+	/* generation only data, recycled once the neighbourhood is decorated */
+	ChunkScratch *scratch;
+	/* serializes writers of blocks and every scratch access */
+	pthread_mutex_t lock;
+	/* stores are release, the blocks and densities of a stage are visible
+	 * to whoever loads the state it published with acquire */
+	_Atomic(ChunkState) state;
 	int x, y, z;
-	bool free;
-	Chunk *next, *prev;
-	Chunk *next_alloc, *prev_alloc;
+	atomic_bool free;
+	/* threads sleeping in world_wait_chunk() on this chunk */
+	atomic_int waiters;
+	/* cursors holding the chunk, it is not evicted while pinned */
+	atomic_int pins;
+	/* the state asked for and whether its next stage is in the load queue,
+	 * both protected by the load queue mutex */
+	ChunkState target;
+	bool scheduled;
+	/* the blocks are not what the save directory has, protected by lock */
+	bool dirty;
+	/* border epoch of the last access, see touch_chunk() */
+	int lru_epoch;
+	Chunk *lru_next, *lru_prev;
 };
 
+/*
+ * caches the chunks it touched, pinned, in a 4x4x4 chunk window indexed by
+ * the low bits of the chunk coordinates, so anything spanning up to 4 chunks
+ * a side (a graphics chunk and its halo) is looked up once per chunk.
+ * only sees chunks at least at the given state, a DECORATED cursor enqueues
+ * the ones missing like world_get_block(). cursor_release() unpins them.
+ */
+#define CURSOR_SLOTS 64
+#define CURSOR_SLOT(X, Y, Z) \
+	((((X) >> BLOCK_BITS) & 3) | ((((Y) >> BLOCK_BITS) & 3) << 2) | ((((Z) >> BLOCK_BITS) & 3) << 4))
+
+typedef struct {
+	int x, y, z;
+	bool valid;
+	volatile Chunk *chunk;
+} CursorSlot;
+
+typedef struct {
+	ChunkState state;
+	CursorSlot slots[CURSOR_SLOTS];
+} BlockCursor;
+
 typedef struct RaycastWorld RaycastWorld;
 struct RaycastWorld {
 	vec3 direction, sign, position;
@@ -69,22 +122,112 @@ struct RaycastWorld {
 	int state;
 	Block block;
 	Direction face;
+	/* the chunk the ray is in, chunk_block is BLOCK_UNLOADED unless uniform */
+	bool chunk_known;
+	int chunk_x, chunk_y, chunk_z;
+	Block chunk_block;
 };
 
+typedef struct {
+	int chunk_count;
+	int scratch_count;
+	size_t chunk_bytes;
+	size_t block_bytes;
+	size_t scratch_bytes;
+	/* what the same chunks cost with density, surface and blocks inline */
+	size_t unsplit_bytes;
+	size_t slab_bytes;
+	size_t memory_budget;
+	size_t evictions;
+	/* allocations that went over the budget as nothing could be evicted */
+	size_t budget_overruns;
+	int load_queue;
+	/* chunks sharing a single block storage */
+	int uniform_count;
+	SaveMode save_mode;
+	size_t chunks_loaded;
+	size_t chunks_saved;
+	size_t save_bytes;
+	int save_queue;
+	size_t journal_edits;
+	size_t journal_commits;
+	/* rewrites of the journal down to the live edits */
+	size_t compactions;
+	size_t store_bytes;
+	size_t store_resident;
+	size_t minor_faults;
+	size_t major_faults;
+	/* chunks compressed in memory, see chunkcache.h */
+	size_t warm_count;
+	size_t warm_bytes;
+	size_t warm_budget;
+	size_t warm_hits;
+	/* warm chunks written to the save directory to stay under the budget */
+	size_t warm_spills;
+	/* heightmaps shared by the chunks of a column, see worldgen.h */
+	size_t column_count;
+	size_t column_hits;
+	size_t column_misses;
+	/* chunks shaped without sampling the noise */
+	size_t skipped_chunks;
+	/* chunks through each generator stage, and the CPU seconds the
+	 * workers spent on them all together */
+	size_t shape_count;
+	size_t surface_count;
+	size_t decorate_count;
+	double shape_time;
+	double surface_time;
+	double decorate_time;
+	/* structure blocks waiting for their chunk to decorate */
+	size_t pending_chunks;
+	size_t pending_blocks;
+	/* chunks whose waiting blocks went in their save instead, or were
+	 * dropped to be made again when they generate */
+	size_t pending_flushed;
+} WorldStats;
+
 typedef struct {
 	bool is_transparent;
 	bool is_ghost;
 	bool replaceable;
+	/* structure blocks go over lower ranked ones, 0 is not a structure */
+	int structure_rank;
 } BlockProperties;
 
+/* a block of a structure, see world_place_structure() */
+typedef struct {
+	int x, y, z;
+	Block block;
+	/* over anything, otherwise over replaceable and lower ranked blocks */
+	bool force;
+} StructureBlock;
+
 void world_init();
 void world_terminate();
 
+/*
+ * chunks are generated by a pool of load workers, closest to the load border
+ * center first. the callback runs on the worker once a chunk is decorated.
+ */
 void world_enqueue_load(int x, int y, int z);
 void world_enqueue_unload(int x, int y, int z);
+void world_set_load_callback(void (*callback)(int x, int y, int z));
+/* runs on a worker once structures landed in a chunk decorated already */
+void world_set_change_callback(void (*callback)(int x, int y, int z));
 
+/*
+ * sleeps until the chunk holding the block reaches the state, enqueuing it if
+ * needed. false if it left the load border or the world is terminating.
+ */
+bool world_wait_chunk(int x, int y, int z, ChunkState state);
+
+/* never generates, an unloaded chunk is enqueued and BLOCK_UNLOADED returned */
 Block world_get_block(int x, int y, int z);
 void  world_set_block(int x, int y, int z, Block block);
+/* true if the decorated chunk holding the block is a single block type */
+bool  world_chunk_uniform(int x, int y, int z, Block *block);
+/* the state of the chunk holding the block, false if it isn't in memory */
+bool  world_chunk_state(int x, int y, int z, ChunkState *state);
 
 Block world_get(int x, int y, int z, ChunkState state);
 void  world_set(int x, int y, int z, ChunkState state, Block block);
@@ -92,6 +235,48 @@ void  world_set(int x, int y, int z, ChunkState state, Block block);
 float world_get_density(int x, int y, int z, ChunkState state);
 void  world_set_density(int x, int y, int z, ChunkState state, float r);
 
+/*
+ * copies the w * h * d box of decorated blocks at x, y, z into out, laid out
+ * out[(z * h + y) * w + x]. every chunk is copied under its lock, so it is
+ * consistent with itself. the blocks of chunks not loaded yet are set to
+ * BLOCK_UNLOADED, and the chunks are enqueued. returns how many there were,
+ * with the first max_missing chunk origins written as x, y, z triples.
+ */
+int world_copy_region(int x, int y, int z, int w, int h, int d, signed char *out, int *missing, int max_missing);
+
+/*
+ * places the blocks of structures decorating put down, wherever they are.
+ * the ones in chunks decorating or decorated go in now, the rest wait for
+ * their chunk to get there, or go in its save once it is out of the border
+ * or too many wait. every block is merged the same way whatever
+ * order they come in, so the result doesn't depend on which chunk went
+ * first. edits made with world_set_block() win over late blocks.
+ */
+void world_place_structure(const StructureBlock *blocks, size_t count);
+
+void  cursor_init(BlockCursor *cur, ChunkState state);
+void  cursor_release(BlockCursor *cur);
+Block cursor_get(BlockCursor *cur, int x, int y, int z);
+void  cursor_set(BlockCursor *cur, int x, int y, int z, Block block);
+float cursor_get_density(BlockCursor *cur, int x, int y, int z);
+void  cursor_set_density(BlockCursor *cur, int x, int y, int z, float r);
+
+/*
+ * the generator stages work on the chunk they claimed, its blocks and its
+ * density as [z][y][x] arrays like wgen_density() fills, read and written
+ * in one go under the chunk lock, either can be NULL. the density reads
+ * back as it is kept, to 1/1024. a neighbour is only read, the rows y0 to
+ * y1 of its density, if it is at least at the state, false otherwise.
+ */
+void chunk_read(volatile Chunk *c, signed char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+                float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE]);
+void chunk_write(volatile Chunk *c, signed char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+                 float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE]);
+/* sets every block and density of the chunk */
+void chunk_fill(volatile Chunk *c, Block block, float r);
+bool chunk_read_rows(int x, int y, int z, ChunkState state, int y0, int y1,
+                     float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE]);
+
 RaycastWorld world_begin_raycast(vec3 position, vec3 direction, float max_distance);
 int          world_raycast(RaycastWorld *rw);
 
@@ -99,10 +284,22 @@ void block_face_to_dir(Direction dir, vec3 out);
 const BlockProperties *block_properties(Block block);
 
 void world_set_load_border(int x, int y, int z, int radius);
+/* of the chunks in memory, and of the ones compressed once they leave it */
+void world_set_memory_budget(size_t bytes);
+void world_set_warm_budget(size_t bytes);
+/*
+ * SAVE_REGIONS and SAVE_MAPPED save decorated chunks there when they leave
+ * the warm tier and load them back instead of generating, SAVE_EDITS only
+ * journals what world_set_block() does. call it before any chunk is loaded
+ * and after wgen_set_seed(), saves of other terrain are refused.
+ */
+bool world_set_save_directory(const char *path, SaveMode mode);
+void world_use_huge_pages(bool enable);
 bool world_can_load(int x, int y, int z);
 
 uint32_t chunk_coord_hash(int x, int y, int z);
 
 int world_allocated_chunks_count();
+void world_get_stats(WorldStats *stats);
 
 #endif
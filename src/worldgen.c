@@ -1,11 +1,15 @@
 #include "worldgen.h"
 #include "util.h"
 #include "world.h"
+#include "noise.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include <linmath.h>
-#include <noise1234.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
 
 #define X_SCALE (0.0625 / 16)
 #define Y_SCALE (0.0625 / 16)
@@ -17,164 +21,745 @@
 
 #define GROUND_HEIGHT 64
 
+/* the most points octaved2() takes, and octaved3(), the finest lattice */
+#define MAX_BATCH  (CHUNK_SIZE + 1)
+#define MAX_POINTS (MAX_BATCH * MAX_BATCH * MAX_BATCH)
+#define OCTAVES 8
+/* |noise_3d()| <= 0.87 * 1.5: each corner contributes at most the L1 norm
+ * of its offset, and the faded weights make that at most 0.5 per axis */
+#define NOISE_3D_MAX (0.87f * 1.5f)
+/* the most octaved3() returns, the octaves add up to 8 - 8 / 2^OCTAVES */
+#define DENSITY_NOISE_MAX (NOISE_3D_MAX * (8.0f - 8.0f / (1 << OCTAVES)) / 4)
+#define DEFAULT_LATTICE_XZ 4
+#define DEFAULT_LATTICE_Y  4
+
+/* heightmaps kept around, a set of columns per hash of the coordinates */
+#define COLUMN_SETS 256
+#define COLUMN_WAYS 4
+/* feature lists kept around, the same way by chunk */
+#define FEATURE_SETS 1024
+#define FEATURE_WAYS 4
+
 typedef struct {
 	float x, y;
 } SplinePoint;
 
-static float octaved2(vec2 v, int seed);
-static float octaved3(vec3 v, int seed);
+typedef struct {
+	float height[CHUNK_SIZE][CHUNK_SIZE];
+	float min, max;
+} Column;
+
+typedef struct {
+	int x, z;
+	bool valid;
+	/* the least recently used of a set goes first */
+	uint32_t used;
+	Column column;
+} ColumnSlot;
+
+typedef enum {
+	FEATURE_TREE,
+	FEATURE_GRASS,
+	FEATURE_ROSE,
+} FeatureKind;
+
+typedef struct {
+	int x, y, z;
+	FeatureKind kind;
+} Feature;
+
+typedef struct {
+	int x, y, z;
+	bool valid;
+	uint32_t used;
+	int count;
+	Feature *features;
+} FeatureSlot;
+
+static void  octaved2(const float *x, const float *y, float *out, int count, const Noise *n);
+static void  octaved3(const float *x, const float *y, const float *z, float *out, int count, const Noise *n,
+                      float lo, float hi);
+static void  density_noise_exact(int cx, int cy, int cz, float out[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+                                 float lo, float hi);
+static void  density_noise_lattice(int cx, int cy, int cz, float out[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+                                   float lo, float hi);
+static void  get_column(int cx, int cz, Column *out);
+static void  make_column(int cx, int cz, Column *out);
+static void  column_density(int cx, int cy, int cz, const Column *col,
+                            float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE]);
+static void  shape_chunk(volatile Chunk *c, const Column *col);
+static int   classify_chunk(int cy, const Column *col, float *r);
+static void  get_features(volatile Chunk *c, ArrayBuffer *out);
+static bool  cached_features(int cx, int cy, int cz, ArrayBuffer *out);
+static void  keep_features(int cx, int cy, int cz, const Feature *f, size_t count);
+static void  neighbour_features(int cx, int cy, int cz, ArrayBuffer *out);
+static void  kept_density(int cx, int cy, int cz, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE]);
+static bool  find_features(int cx, int cy, int cz, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+                           float below[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE], ArrayBuffer *out);
+static void  generate_features(const Feature *f, size_t count, ArrayBuffer *out);
+static int   lattice_step(int step);
 static int   hash_coord(uint32_t s, int x, int y, int z);
 
-static void generate_block(int cx, int cy, int cz, int x, int y, int z, ChunkState state, bool force, Block block);
-static void generate_tree(int cx, int cy, int cz, int x, int y, int z);
+static void generate_block(ArrayBuffer *out, int x, int y, int z, bool force, Block block);
+static void generate_tree(ArrayBuffer *out, int x, int y, int z);
 
 static float spline(float in, size_t nsplines, SplinePoint *splines);
 static float map(float l, float xmin, float xmax, float ymin, float ymax);
 
-static float heightmap(vec2 v, int seed);
+static void  heightmap(const float *x, const float *z, float *out, int count, const Noise *n);
 
 static PCG32State basic_seed;
-static uint32_t   heightmap_seed;
-static uint32_t   density_seed;
+static uint64_t   seed_hash;
+static Noise      heightmap_noise;
+static Noise      density_noise;
 static uint32_t   coord_hash;
 static uint32_t   grass_flower_hash;
+static int        lattice_xz = DEFAULT_LATTICE_XZ;
+static int        lattice_y = DEFAULT_LATTICE_Y;
+
+static pthread_mutex_t column_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ColumnSlot      columns[COLUMN_SETS][COLUMN_WAYS];
+static uint32_t        column_clock;
+/* protected by column_mutex too */
+static WorldGenStats   gen_stats;
+
+static pthread_mutex_t feature_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FeatureSlot     feature_slots[FEATURE_SETS][FEATURE_WAYS];
+static uint32_t        feature_clock;
 
 void 
 wgen_set_seed(const char *seed)
 {
-	basic_seed = hash_string(seed);
+	seed_hash = basic_seed = hash_string(seed);
 	init_pcg32(&basic_seed);
 
-	heightmap_seed    = rand_pcg32(&basic_seed);
-	density_seed      = rand_pcg32(&basic_seed);
+	noise_seed(&heightmap_noise, rand_pcg32(&basic_seed));
+	noise_seed(&density_noise, rand_pcg32(&basic_seed));
 	coord_hash        = rand_pcg32(&basic_seed);
 	grass_flower_hash = rand_pcg32(&basic_seed);
+
+	/* the heightmaps were of the old seed */
+	pthread_mutex_lock(&column_mutex);
+	memset(columns, 0, sizeof(columns));
+	gen_stats.columns = 0;
+	pthread_mutex_unlock(&column_mutex);
+
+	pthread_mutex_lock(&feature_mutex);
+	for(int i = 0; i < FEATURE_SETS; i++)
+	for(int j = 0; j < FEATURE_WAYS; j++) {
+		if(feature_slots[i][j].valid)
+			efree(feature_slots[i][j].features);
+		feature_slots[i][j].valid = false;
+	}
+	pthread_mutex_unlock(&feature_mutex);
 }
 
 void
-wgen_shape(int cx, int cy, int cz)
-{
-	for(int x = 0; x < CHUNK_SIZE; x++)
-	for(int z = 0; z < CHUNK_SIZE; z++) 
-	{
-		int xx = x + cx;
-		int zz = z + cz;
-
-		vec2 v;
-		vec2_mul(v, (vec2){ xx, zz }, HEIGHT_SCALE);
-		
-		float height = heightmap(v, heightmap_seed);
-		for(int y = 0; y < CHUNK_SIZE; y++) {
-			vec3 vv;
-			int yy = y + cy;
+wgen_set_lattice(int horizontal, int vertical)
+{
+	lattice_xz = lattice_step(horizontal);
+	lattice_y = lattice_step(vertical);
+}
+
+uint64_t
+wgen_seed()
+{
+	return seed_hash;
+}
+
+uint32_t
+wgen_version()
+{
+	return WGEN_VERSION << 16 | lattice_xz << 8 | lattice_y;
+}
+
+void
+wgen_density(int cx, int cy, int cz, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE])
+{
+	Column col;
+
+	get_column(cx, cz, &col);
+	column_density(cx, cy, cz, &col, density);
+}
+
+void
+wgen_shape_column(volatile Chunk **column, int count)
+{
+	Column col;
+
+	/* the chunks of a column share the heightmap, fetched once for all */
+	get_column(column[0]->x, column[0]->z, &col);
+	for(int i = 0; i < count; i++)
+		shape_chunk(column[i], &col);
+}
+
+void
+wgen_surface(volatile Chunk *c)
+{
+	signed char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	float above[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	/* solid blocks right over each block of the row, counted up to 3 */
+	unsigned char depth[CHUNK_SIZE][CHUNK_SIZE];
+	bool changed = false;
+
+	/* nothing to do without stone, as in the sky or under water */
+	chunk_read(c, blocks, NULL);
+	if(!memchr(blocks, BLOCK_STONE, sizeof(blocks)))
+		return;
+
+	/* the bottom rows of the one above start the count. it is shaped at
+	 * least, unless it is out of the border, where it reads as solid */
+	chunk_read(c, NULL, density);
+	if(chunk_read_rows(c->x, c->y + CHUNK_SIZE, c->z, CSTATE_SHAPED, 0, 2, above)) {
+		for(int z = 0; z < CHUNK_SIZE; z++)
+		for(int x = 0; x < CHUNK_SIZE; x++) {
+			int d = 0;
+			while(d < 3 && !(above[z][d][x] <= 0))
+				d++;
+			depth[z][x] = d;
+		}
+	} else {
+		memset(depth, 3, sizeof(depth));
+	}
+
+	/* every column top down once: stone right under air is the surface,
+	 * the 2 blocks under that dirt */
+	for(int y = LAST_BLOCK; y >= 0; y--) {
+		Block top = c->y + y >= GROUND_HEIGHT ? BLOCK_GRASS : BLOCK_SAND;
 
-			vec3_mul(vv, (vec3){ xx, yy, zz }, NOISE3_SCALE);
-			float density = octaved3(vv, density_seed) + (height - yy) * HEIGHT_AMPL / GROUND_HEIGHT;
-			world_set_density(xx, yy, zz, CSTATE_SHAPING, density);
+		for(int z = 0; z < CHUNK_SIZE; z++)
+		for(int x = 0; x < CHUNK_SIZE; x++) {
+			int d = depth[z][x];
 
-			if(density > 0) {
-				world_set(xx, yy, zz, CSTATE_SHAPING, BLOCK_STONE);
-			} else {
-				world_set(xx, yy, zz, CSTATE_SHAPING, yy < GROUND_HEIGHT ? BLOCK_WATER : BLOCK_NULL);
+			if(blocks[z][y][x] == BLOCK_STONE && d < 3) {
+				blocks[z][y][x] = d ? BLOCK_DIRT : top;
+				changed = true;
 			}
+			depth[z][x] = density[z][y][x] <= 0 ? 0 : d < 3 ? d + 1 : 3;
 		}
 	}
+	if(changed)
+		chunk_write(c, blocks, NULL);
 }
 
 void
-wgen_surface(int cx, int cy, int cz)
+wgen_decorate(volatile Chunk *c)
 {
+	int cx = c->x, cy = c->y, cz = c->z;
+	ArrayBuffer features, blocks, around;
+
+	arrbuf_init(&features);
+	arrbuf_init(&blocks);
+	arrbuf_init(&around);
+	get_features(c, &features);
+	generate_features(features.data, arrbuf_length(&features, sizeof(Feature)), &blocks);
+
+	/*
+	 * the chunks around left their blocks here when they were decorated,
+	 * which a copy of this chunk generated again doesn't have. a feature
+	 * reaches at most 2 blocks sideways, 6 up and 1 down, so the ones of
+	 * the chunks around are placed again, they merge with themselves
+	 */
+	for(int dz = -CHUNK_SIZE; dz <= CHUNK_SIZE; dz += CHUNK_SIZE)
+	for(int dy = -CHUNK_SIZE; dy <= CHUNK_SIZE; dy += CHUNK_SIZE)
+	for(int dx = -CHUNK_SIZE; dx <= CHUNK_SIZE; dx += CHUNK_SIZE) {
+		if(dx == 0 && dy == 0 && dz == 0)
+			continue;
+		arrbuf_clear(&features);
+		neighbour_features(cx + dx, cy + dy, cz + dz, &features);
+		generate_features(features.data, arrbuf_length(&features, sizeof(Feature)), &around);
+	}
+	SPAN_FOR(arrbuf_span(&around), b, StructureBlock) {
+		if((b->x & CHUNK_MASK) == cx && (b->y & CHUNK_MASK) == cy && (b->z & CHUNK_MASK) == cz)
+			arrbuf_insert(&blocks, sizeof(StructureBlock), b);
+	}
+
+	/* the rest of the structures wait for the chunks they reach into */
+	world_place_structure(blocks.data, arrbuf_length(&blocks, sizeof(StructureBlock)));
+	arrbuf_free(&features);
+	arrbuf_free(&blocks);
+	arrbuf_free(&around);
+}
+
+void
+wgen_get_stats(WorldGenStats *stats)
+{
+	pthread_mutex_lock(&column_mutex);
+	*stats = gen_stats;
+	pthread_mutex_unlock(&column_mutex);
+}
+
+void
+get_features(volatile Chunk *c, ArrayBuffer *out)
+{
+	int cx = c->x, cy = c->y, cz = c->z;
+	ArrayBuffer list;
+	float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	float below[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+
+	if(cached_features(cx, cy, cz, out))
+		return;
+
+	/* the chunk is decorating, the one below is shaped at least */
+	chunk_read(c, NULL, density);
+	bool have_below = chunk_read_rows(cx, cy - CHUNK_SIZE, cz, CSTATE_SHAPED, LAST_BLOCK, LAST_BLOCK, below);
+
+	arrbuf_init(&list);
+	bool complete = find_features(cx, cy, cz, density, have_below ? below : NULL, &list);
+	size_t count = arrbuf_length(&list, sizeof(Feature));
+	for(size_t i = 0; i < count; i++)
+		arrbuf_insert(out, sizeof(Feature), (Feature *)list.data + i);
+	/* decided with a neighbour missing, it may come out different later */
+	if(complete)
+		keep_features(cx, cy, cz, list.data, count);
+	arrbuf_free(&list);
+}
+
+void
+keep_features(int cx, int cy, int cz, const Feature *f, size_t count)
+{
+	FeatureSlot *set = feature_slots[hash_int3(cx, cy, cz) % FEATURE_SETS];
+	FeatureSlot *slot;
+
+	pthread_mutex_lock(&feature_mutex);
+	slot = &set[0];
+	for(int i = 0; i < FEATURE_WAYS; i++) {
+		if(set[i].valid && set[i].x == cx && set[i].y == cy && set[i].z == cz) {
+			slot = &set[i];
+			break;
+		}
+		if(!set[i].valid || (slot->valid && set[i].used < slot->used))
+			slot = &set[i];
+	}
+	if(slot->valid)
+		efree(slot->features);
+	slot->x = cx;
+	slot->y = cy;
+	slot->z = cz;
+	slot->valid = true;
+	slot->used = ++feature_clock;
+	slot->count = count;
+	slot->features = emalloc(sizeof(Feature) * (count ? count : 1));
+	memcpy(slot->features, f, sizeof(Feature) * count);
+	pthread_mutex_unlock(&feature_mutex);
+}
+
+void
+neighbour_features(int cx, int cy, int cz, ArrayBuffer *out)
+{
+	float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	float below[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	ArrayBuffer list;
+
+	if(cached_features(cx, cy, cz, out))
+		return;
+	/* find_features() looks at nothing under the water */
+	if(cy + LAST_BLOCK <= GROUND_HEIGHT)
+		return;
+	/* one in memory and not decorated yet places its own when it is */
+	ChunkState state;
+	if(world_chunk_state(cx, cy, cz, &state) && state < CSTATE_DECORATED)
+		return;
+
+	/*
+	 * out of the cache, found again from the density the chunk had when
+	 * it was shaped, whether it is loaded or not. it only reads the row
+	 * below when it starts at the bottom of the chunk
+	 */
+	kept_density(cx, cy, cz, density);
+	if(cy > GROUND_HEIGHT)
+		kept_density(cx, cy - CHUNK_SIZE, cz, below);
+
+	arrbuf_init(&list);
+	find_features(cx, cy, cz, density, cy > GROUND_HEIGHT ? below : NULL, &list);
+	size_t count = arrbuf_length(&list, sizeof(Feature));
+	for(size_t i = 0; i < count; i++)
+		arrbuf_insert(out, sizeof(Feature), (Feature *)list.data + i);
+	keep_features(cx, cy, cz, list.data, count);
+	arrbuf_free(&list);
+}
+
+void
+kept_density(int cx, int cy, int cz, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE])
+{
+	/* to 1/1024 like a chunk keeps it, or a sign may come out different
+	 * from what chunk_read() gives get_features() */
+	wgen_density(cx, cy, cz, density);
+	for(int z = 0; z < CHUNK_SIZE; z++)
+	for(int y = 0; y < CHUNK_SIZE; y++)
+	for(int x = 0; x < CHUNK_SIZE; x++) {
+		float r = density[z][y][x] * 1024.0f;
+		r = r > SHRT_MAX ? SHRT_MAX : r < SHRT_MIN ? SHRT_MIN : r;
+		density[z][y][x] = (short)r / 1024.0f;
+	}
+}
+
+bool
+cached_features(int cx, int cy, int cz, ArrayBuffer *out)
+{
+	FeatureSlot *set = feature_slots[hash_int3(cx, cy, cz) % FEATURE_SETS];
+	bool found = false;
+
+	pthread_mutex_lock(&feature_mutex);
+	for(int i = 0; i < FEATURE_WAYS; i++) {
+		if(set[i].valid && set[i].x == cx && set[i].y == cy && set[i].z == cz) {
+			set[i].used = ++feature_clock;
+			for(int j = 0; j < set[i].count; j++)
+				arrbuf_insert(out, sizeof(Feature), &set[i].features[j]);
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&feature_mutex);
+	return found;
+}
+
+bool
+find_features(int cx, int cy, int cz, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE],
+              float below[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE], ArrayBuffer *out)
+{
+	/* one voxel in 16 by the hash, over ground and above the water. below
+	 * has the top row of the chunk below, NULL if it isn't there, and false
+	 * is returned if it was needed */
+	bool complete = true;
+
 	for(int z = cz; z < cz + CHUNK_SIZE; z++)
-	for(int y = cy; y < cy + CHUNK_SIZE; y++)
+	for(int y = cy > GROUND_HEIGHT ? cy : GROUND_HEIGHT + 1; y < cy + CHUNK_SIZE; y++)
 	for(int x = cx; x < cx + CHUNK_SIZE; x++) {
+		if((hash_coord(coord_hash, x, y, z) & 15) != 0)
+			continue;
 
-		if(world_get(x, y, z, CSTATE_SURFACING) == BLOCK_STONE) {
-			int i;
-			for(i = 1; i < 4; i++) {
-				float den = world_get_density(x, y + i, z, CSTATE_SHAPED);
-				if(den == NAN)
-					return;
+		if(!(density[z - cz][y - cy][x - cx] < 0))
+			continue;
 
-				if(den <= 0)
-					break;
-			}
-			
-			switch(i) {
-			case 1:
-				world_set(x, y, z, CSTATE_SURFACING, y >= GROUND_HEIGHT ? BLOCK_GRASS : BLOCK_SAND);
-				break;
-			case 2:
-			case 3:
-				world_set(x, y, z, CSTATE_SURFACING, BLOCK_DIRT);
-				break;
-			}
+		float den;
+		if(y > cy)
+			den = density[z - cz][y - cy - 1][x - cx];
+		else if(below)
+			den = below[z - cz][LAST_BLOCK][x - cx];
+		else
+			den = NAN;
+		if(isnan(den))
+			complete = false;
+		if(den < 0)
+			continue;
+
+		int hash = hash_coord(grass_flower_hash, x, y, z);
+		Feature f = { x, y, z, !(hash & 7) ? FEATURE_TREE : (hash & 1) ? FEATURE_ROSE : FEATURE_GRASS };
+		arrbuf_insert(out, sizeof(Feature), &f);
+	}
+	return complete;
+}
+
+void
+generate_features(const Feature *f, size_t count, ArrayBuffer *out)
+{
+	for(size_t i = 0; i < count; i++) {
+		switch(f[i].kind) {
+		case FEATURE_TREE:
+			generate_tree(out, f[i].x, f[i].y, f[i].z);
+			break;
+		case FEATURE_GRASS:
+			generate_block(out, f[i].x, f[i].y, f[i].z, false, BLOCK_GRASS_BLADES);
+			break;
+		case FEATURE_ROSE:
+			generate_block(out, f[i].x, f[i].y, f[i].z, false, BLOCK_ROSE);
+			break;
 		}
 	}
 }
 
 void
-wgen_decorate(int cx, int cy, int cz)
+get_column(int cx, int cz, Column *out)
 {
-	for(int z = cz - CHUNK_SIZE; z < cz + CHUNK_SIZE * 2; z++)
-	for(int y = cy - CHUNK_SIZE; y < cy + CHUNK_SIZE * 2; y++)
-	for(int x = cx - CHUNK_SIZE; x < cx + CHUNK_SIZE * 2; x++) {
+	ColumnSlot *set = columns[hash_int3(cx, 0, cz) % COLUMN_SETS];
+	ColumnSlot *slot;
+
+	pthread_mutex_lock(&column_mutex);
+	for(int i = 0; i < COLUMN_WAYS; i++) {
+		if(set[i].valid && set[i].x == cx && set[i].z == cz) {
+			set[i].used = ++column_clock;
+			*out = set[i].column;
+			gen_stats.column_hits++;
+			pthread_mutex_unlock(&column_mutex);
+			return;
+		}
+	}
+	gen_stats.column_misses++;
+	pthread_mutex_unlock(&column_mutex);
+
+	/* made without the lock, two workers may make the same column at once
+	 * but they make the same heightmap */
+	make_column(cx, cz, out);
+
+	pthread_mutex_lock(&column_mutex);
+	slot = &set[0];
+	for(int i = 0; i < COLUMN_WAYS; i++) {
+		if(set[i].valid && set[i].x == cx && set[i].z == cz) {
+			slot = &set[i];
+			break;
+		}
+		if(!set[i].valid || (slot->valid && set[i].used < slot->used))
+			slot = &set[i];
+	}
+	if(!slot->valid)
+		gen_stats.columns++;
+	else if(slot->x != cx || slot->z != cz)
+		gen_stats.column_evictions++;
+	slot->x = cx;
+	slot->z = cz;
+	slot->valid = true;
+	slot->used = ++column_clock;
+	slot->column = *out;
+	pthread_mutex_unlock(&column_mutex);
+}
 
-		if((hash_coord(coord_hash, x, y, z) & 15) != 0) {
-			continue;
+void
+make_column(int cx, int cz, Column *out)
+{
+	out->min = INFINITY;
+	out->max = -INFINITY;
+
+	/* a row at a time through the batch kernels */
+	for(int z = 0; z < CHUNK_SIZE; z++) {
+		float hx[CHUNK_SIZE], hz[CHUNK_SIZE];
+
+		for(int x = 0; x < CHUNK_SIZE; x++) {
+			hx[x] = (x + cx) * HEIGHT_SCALE[0];
+			hz[x] = (z + cz) * HEIGHT_SCALE[1];
+		}
+		heightmap(hx, hz, out->height[z], CHUNK_SIZE, &heightmap_noise);
+		for(int x = 0; x < CHUNK_SIZE; x++) {
+			out->min = out->height[z][x] < out->min ? out->height[z][x] : out->min;
+			out->max = out->height[z][x] > out->max ? out->height[z][x] : out->max;
 		}
+	}
+}
 
-		if(world_get_density(x, y, z, CSTATE_SHAPED) < 0) {
-			float den = world_get_density(x, y - 1, z, CSTATE_SHAPED);
-			if(den == NAN)
-				return;
-
-			if(den < 0)
-				continue;
-			
-			if(y > GROUND_HEIGHT) {
-				int hash = hash_coord(grass_flower_hash, x, y, z);
-				if(!(hash & 7))
-					generate_tree(cx, cy, cz, x, y, z);
-				else
-					switch(hash & 1) {
-					case 0:
-						generate_block(cx, cy, cz, x, y, z, CSTATE_DECORATING, false, BLOCK_GRASS_BLADES);
-						break;
-					case 1:
-						generate_block(cx, cy, cz, x, y, z, CSTATE_DECORATING, false, BLOCK_ROSE);
-						break;
-					}
-			}
+void
+column_density(int cx, int cy, int cz, const Column *col, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE])
+{
+	/* what the height term adds to the noise somewhere in the chunk */
+	float lo = (col->min - (cy + LAST_BLOCK)) * HEIGHT_AMPL / GROUND_HEIGHT;
+	float hi = (col->max - cy) * HEIGHT_AMPL / GROUND_HEIGHT;
+	float r;
+
+	/* only the sign is ever read, one that is certain does for the chunk */
+	if(classify_chunk(cy, col, &r)) {
+		for(int z = 0; z < CHUNK_SIZE; z++)
+		for(int y = 0; y < CHUNK_SIZE; y++)
+		for(int x = 0; x < CHUNK_SIZE; x++)
+			density[z][y][x] = r;
+		return;
+	}
+
+	if(lattice_xz == 1 && lattice_y == 1)
+		density_noise_exact(cx, cy, cz, density, lo, hi);
+	else
+		density_noise_lattice(cx, cy, cz, density, lo, hi);
+
+	for(int z = 0; z < CHUNK_SIZE; z++)
+	for(int y = 0; y < CHUNK_SIZE; y++)
+	for(int x = 0; x < CHUNK_SIZE; x++) {
+		int yy = y + cy;
+		density[z][y][x] += (col->height[z][x] - yy) * HEIGHT_AMPL / GROUND_HEIGHT;
+	}
+}
+
+void
+shape_chunk(volatile Chunk *c, const Column *col)
+{
+	float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	signed char blocks[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE];
+	int cx = c->x, cy = c->y, cz = c->z;
+	int sign;
+	float r;
+
+	/* GROUND_HEIGHT is on a chunk boundary, so these are one block */
+	if((sign = classify_chunk(cy, col, &r))) {
+		chunk_fill(c, sign > 0 ? BLOCK_STONE : cy < GROUND_HEIGHT ? BLOCK_WATER : BLOCK_NULL, r);
+
+		pthread_mutex_lock(&column_mutex);
+		gen_stats.skipped_chunks++;
+		pthread_mutex_unlock(&column_mutex);
+		return;
+	}
+
+	column_density(cx, cy, cz, col, density);
+	for(int z = 0; z < CHUNK_SIZE; z++)
+	for(int y = 0; y < CHUNK_SIZE; y++) {
+		signed char empty = cy + y < GROUND_HEIGHT ? BLOCK_WATER : BLOCK_NULL;
+		for(int x = 0; x < CHUNK_SIZE; x++)
+			blocks[z][y][x] = density[z][y][x] > 0 ? BLOCK_STONE : empty;
+	}
+	chunk_write(c, blocks, density);
+}
+
+int
+classify_chunk(int cy, const Column *col, float *r)
+{
+	/* 1 if the density is positive all over the chunk, -1 if negative, 0
+	 * if the noise can go either way. r gets the height term closest to
+	 * zero, with the sign of the density */
+	float lo = (col->min - (cy + LAST_BLOCK)) * HEIGHT_AMPL / GROUND_HEIGHT;
+	float hi = (col->max - cy) * HEIGHT_AMPL / GROUND_HEIGHT;
+
+	if(lo > DENSITY_NOISE_MAX) {
+		*r = lo;
+		return 1;
+	}
+	if(hi < -DENSITY_NOISE_MAX) {
+		*r = hi;
+		return -1;
+	}
+	return 0;
+}
+
+void
+density_noise_exact(int cx, int cy, int cz, float out[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE], float lo, float hi)
+{
+	/* a slice at a time, small enough to stay in L1 through the octaves,
+	 * every block only depends on its own point so each slice can stop on
+	 * its own */
+	for(int z = 0; z < CHUNK_SIZE; z++) {
+		float px[CHUNK_SIZE * CHUNK_SIZE], py[CHUNK_SIZE * CHUNK_SIZE], pz[CHUNK_SIZE * CHUNK_SIZE];
+		int i = 0;
+
+		for(int y = 0; y < CHUNK_SIZE; y++)
+		for(int x = 0; x < CHUNK_SIZE; x++, i++) {
+			px[i] = (x + cx) * NOISE3_SCALE[0];
+			py[i] = (y + cy) * NOISE3_SCALE[1];
+			pz[i] = (z + cz) * NOISE3_SCALE[2];
 		}
+		octaved3(px, py, pz, &out[z][0][0], i, &density_noise, lo, hi);
 	}
 }
 
-float
-octaved2(vec2 v, int seed)
+void
+density_noise_lattice(int cx, int cy, int cz, float out[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE], float lo, float hi)
+{
+	/* the lattice points are at multiples of the steps in world
+	 * coordinates, a chunk samples its far faces too so neighbours share
+	 * them and interpolate to the same values across the border */
+	static _Thread_local float px[MAX_POINTS], py[MAX_POINTS], pz[MAX_POINTS], lattice[MAX_POINTS];
+	int sxz = lattice_xz, sy = lattice_y;
+	int nxz = CHUNK_SIZE / sxz + 1, ny = CHUNK_SIZE / sy + 1;
+	int i = 0;
+
+	for(int lz = 0; lz < nxz; lz++)
+	for(int lx = 0; lx < nxz; lx++)
+	for(int ly = 0; ly < ny; ly++, i++) {
+		px[i] = (lx * sxz + cx) * NOISE3_SCALE[0];
+		py[i] = (ly * sy + cy) * NOISE3_SCALE[1];
+		pz[i] = (lz * sxz + cz) * NOISE3_SCALE[2];
+	}
+	/* interpolating keeps the values between the lattice extremes, so the
+	 * bounds hold for the blocks too. all of the lattice stops together, a
+	 * block between stopped and finished points could get the wrong sign */
+	octaved3(px, py, pz, lattice, i, &density_noise, lo, hi);
+
+	for(int z = 0; z < CHUNK_SIZE; z++)
+	for(int x = 0; x < CHUNK_SIZE; x++) {
+		int lz = z / sxz, lx = x / sxz;
+		float tz = (float)(z % sxz) / sxz;
+		float tx = (float)(x % sxz) / sxz;
+		const float *c00 = &lattice[(lz * nxz + lx) * ny];
+		const float *c01 = &lattice[(lz * nxz + lx + 1) * ny];
+		const float *c10 = &lattice[((lz + 1) * nxz + lx) * ny];
+		const float *c11 = &lattice[((lz + 1) * nxz + lx + 1) * ny];
+
+		for(int y = 0; y < CHUNK_SIZE; y++) {
+			int ly = y / sy;
+			float ty = (float)(y % sy) / sy;
+			float v00 = c00[ly] + ty * (c00[ly + 1] - c00[ly]);
+			float v01 = c01[ly] + ty * (c01[ly + 1] - c01[ly]);
+			float v10 = c10[ly] + ty * (c10[ly + 1] - c10[ly]);
+			float v11 = c11[ly] + ty * (c11[ly + 1] - c11[ly]);
+			float v0 = v00 + tx * (v01 - v00);
+			float v1 = v10 + tx * (v11 - v10);
+			out[z][y][x] = v0 + tz * (v1 - v0);
+		}
+	}
+}
+
+int
+lattice_step(int step)
 {
+	/* a power of two dividing the chunk */
+	int s = 1;
+	while(s * 2 <= step && s * 2 <= CHUNK_SIZE)
+		s *= 2;
+	return s;
+}
+
+void
+octaved2(const float *x, const float *y, float *out, int count, const Noise *n)
+{
+	float px[MAX_BATCH], py[MAX_BATCH], noise[MAX_BATCH];
 	float a = 4.0;
-	float r = 0.0;
 
-	for(int i = 0; i < 8; i++) {
-		r += noise3(v[0] * a, v[1] * a, seed) * a;
+	assert(count <= MAX_BATCH);
+	for(int i = 0; i < count; i++)
+		out[i] = 0.0;
+	for(int o = 0; o < 8; o++) {
+		for(int i = 0; i < count; i++) {
+			px[i] = x[i] * a;
+			py[i] = y[i] * a;
+		}
+		noise_2d_batch(n, px, py, noise, count);
+		for(int i = 0; i < count; i++)
+			out[i] += noise[i] * a;
 		a *= 0.5;
 	}
 
-	return r / 4;
+	for(int i = 0; i < count; i++)
+		out[i] /= 4;
 }
 
-float
-octaved3(vec3 position, int seed)
+void
+octaved3(const float *x, const float *y, const float *z, float *out, int count, const Noise *n, float lo, float hi)
 {
-	float a = 4.0;
-	float r = 0.0;
+	/*
+	 * octave by octave over every point, largest first. once the noise so
+	 * far plus anything between lo and hi is beyond what the octaves left
+	 * can add, every point has the sign it will end with and the rest is
+	 * skipped, the shape only needs the sign of the density and the later
+	 * stages only look at signs too.
+	 */
+	static _Thread_local float px[MAX_POINTS], py[MAX_POINTS], pz[MAX_POINTS], noise[MAX_POINTS];
+	float a = 4.0, left = 0;
+
+	assert(count <= MAX_POINTS);
+	for(int o = 0; o < OCTAVES; o++)
+		left += a / (1 << o);
+	for(int i = 0; i < count; i++)
+		out[i] = 0.0;
+
+	for(int o = 0; o < OCTAVES; o++) {
+		for(int i = 0; i < count; i++) {
+			px[i] = x[i] * a;
+			py[i] = y[i] * a;
+			pz[i] = z[i] * a;
+		}
+		noise_3d_batch(n, px, py, pz, noise, count);
 
-	for(int i = 0; i < 8; i++) {
-		r += noise4(position[0] * a, position[1] * a, position[2] * a, seed) * a;
+		float min = INFINITY, max = -INFINITY;
+		for(int i = 0; i < count; i++) {
+			out[i] += noise[i] * a;
+			min = out[i] < min ? out[i] : min;
+			max = out[i] > max ? out[i] : max;
+		}
+		left -= a;
 		a *= 0.5;
+
+		float bound = left * NOISE_3D_MAX;
+		if(min + lo * 4 > bound || max + hi * 4 < -bound)
+			break;
 	}
 
-	return r / 4;
+	for(int i = 0; i < count; i++)
+		out[i] /= 4;
 }
 
 float
@@ -195,8 +780,8 @@ spline(float in, size_t nsplines, SplinePoint *splines)
 	return 0;
 }
 
-float
-heightmap(vec2 v, int seed)
+void
+heightmap(const float *x, const float *z, float *out, int count, const Noise *n)
 {
 	static SplinePoint splines[] = {
 		{ -1.00, GROUND_HEIGHT - 20 },
@@ -207,7 +792,9 @@ heightmap(vec2 v, int seed)
 		{  0.95, GROUND_HEIGHT + 40 }
 	};
 
-	return spline(octaved2(v, seed), LENGTH(splines), splines);
+	octaved2(x, z, out, count, n);
+	for(int i = 0; i < count; i++)
+		out[i] = spline(out[i], LENGTH(splines), splines);
 }
 
 static uint32_t hash(uint32_t i)
@@ -233,32 +820,27 @@ hash_coord(uint32_t s, int x, int y, int z)
 }
 
 void
-generate_block(int cx, int cy, int cz, int x, int y, int z, ChunkState state, bool force, Block block)
+generate_block(ArrayBuffer *out, int x, int y, int z, bool force, Block block)
 {
-	if(x < cx || x >= (cx + CHUNK_SIZE)) return;
-	if(y < cy || y >= (cy + CHUNK_SIZE)) return;
-	if(z < cz || z >= (cz + CHUNK_SIZE)) return;
-	
-	if(force || block_properties(world_get(x, y, z, state))->replaceable)
-		world_set(x, y, z, state, block);
+	arrbuf_insert(out, sizeof(StructureBlock), &(StructureBlock){ x, y, z, block, force });
 }
 
 void
-generate_tree(int cx, int cy, int cz, int x, int y, int z)
+generate_tree(ArrayBuffer *out, int x, int y, int z)
 {
 	for(int xx = x - 1; xx <= x + 1; xx++)
 	for(int zz = z - 1; zz <= z + 1; zz++) {
-		generate_block(cx, cy, cz, xx, y + 6, zz, CSTATE_DECORATING, false, BLOCK_LEAVES);
+		generate_block(out, xx, y + 6, zz, false, BLOCK_LEAVES);
 	}
 
 	for(int xx = x - 2; xx <= x + 2; xx++)
 	for(int yy = 1; yy < 3; yy++)
 	for(int zz = z - 2; zz <= z + 2; zz++) {
-		generate_block(cx, cy, cz, xx, y + 6 - yy, zz, CSTATE_DECORATING, false, BLOCK_LEAVES);
+		generate_block(out, xx, y + 6 - yy, zz, false, BLOCK_LEAVES);
 	}
 
 	for(int yy = y + 5; yy >= y; yy--) {
-		generate_block(cx, cy, cz, x, yy, z, CSTATE_DECORATING, false, BLOCK_WOOD);
+		generate_block(out, x, yy, z, false, BLOCK_WOOD);
 	}
-	generate_block(cx, cy, cz, x, y - 1, z, CSTATE_DECORATING, true, BLOCK_DIRT);
+	generate_block(out, x, y - 1, z, true, BLOCK_DIRT);
 }
@@ -1,9 +1,50 @@
 #ifndef WORLDGEN_H
 #define WORLDGEN_H
 
+#include "world.h"
+
+/*
+ * the heightmap of a column of chunks is made once and kept for every chunk
+ * above and below, in a cache of a few sets of columns picked by the
+ * coordinates. a column replaces the least recently used one of its set.
+ *
+ * chunks far enough above or below the heightmap of their column for no
+ * noise to change a block are shaped without sampling it.
+ */
+typedef struct {
+	size_t columns;
+	size_t column_hits;
+	size_t column_misses;
+	size_t column_evictions;
+	size_t skipped_chunks;
+} WorldGenStats;
+
+/* bumped whenever the same seed and lattice start making different terrain */
+#define WGEN_VERSION 1
+
 void wgen_set_seed(const char *seed);
-void wgen_shape(int cx, int cy, int cz);
-void wgen_surface(int cx, int cy, int cz);
-void wgen_decorate(int cx, int cy, int cz);
+/*
+ * the 3D noise is sampled every horizontal blocks along x and z and every
+ * vertical blocks along y, and interpolated in between. 1 and 1 samples
+ * every block, the steps are rounded down to powers of two up to CHUNK_SIZE.
+ */
+void wgen_set_lattice(int horizontal, int vertical);
+void wgen_density(int cx, int cy, int cz, float density[CHUNK_SIZE][CHUNK_SIZE][CHUNK_SIZE]);
+
+/* the stages, on chunks the caller claimed, see chunk_read() */
+/* shapes count chunks stacked from column[0] up */
+void wgen_shape_column(volatile Chunk **column, int count);
+void wgen_surface(volatile Chunk *c);
+/* places the structures rooted in the chunk, see world_place_structure() */
+void wgen_decorate(volatile Chunk *c);
+
+/*
+ * what saves keep to know they are of this terrain, the hash of the seed and
+ * WGEN_VERSION with the lattice, which changes the terrain as well
+ */
+uint64_t wgen_seed();
+uint32_t wgen_version();
+
+void wgen_get_stats(WorldGenStats *stats);
 
 #endif